@@ -288,6 +288,7 @@ qboolean CL_Disconnect( qboolean showMainMenu ) {
 	CL_ClearState();
 
 	// wipe the client connection
+	Netchan_Release( &clc.netchan );
 	Com_Memset( &clc, 0, sizeof( clc ) );
 
 	cls.state = CA_DISCONNECTED;
@@ -50,140 +50,31 @@ MESSAGE PARSING
 =========================================================================
 */
 
-/*
-==================
-CL_DeltaEntity
-
-Parses deltas from the given base and adds the resulting entity
-to the current frame
-==================
-*/
-static void CL_DeltaEntity( msg_t *msg, clSnapshot_t *frame, int newnum, const entityState_t *old, qboolean unchanged) {
-	entityState_t	*state;
-
-	// save the parsed entity state into the big circular buffer so
-	// it can be used as the source for a later delta
-	state = &cl.parseEntities[cl.parseEntitiesNum & (MAX_PARSE_ENTITIES-1)];
-
-	if ( unchanged ) {
-		*state = *old;
-	} else {
-		MSG_ReadDeltaEntity( msg, old, state, newnum );
-	}
-
-	if ( state->number == (MAX_GENTITIES-1) ) {
-		return;		// entity was delta removed
-	}
-	cl.parseEntitiesNum++;
-	frame->numEntities++;
-}
-
-
 /*
 ==================
 CL_ParsePacketEntities
 ==================
 */
 static void CL_ParsePacketEntities( msg_t *msg, const clSnapshot_t *oldframe, clSnapshot_t *newframe ) {
-	const entityState_t	*oldstate;
-	int	newnum;
-	int	oldindex, oldnum;
+	entityParse_t	parse;
 
-	newframe->parseEntitiesNum = cl.parseEntitiesNum;
-	newframe->numEntities = 0;
+	parse.entities = cl.parseEntities;
+	parse.mask = MAX_PARSE_ENTITIES-1;
+	parse.num = cl.parseEntitiesNum;
+	parse.baselines = cl.entityBaselines;
 
-	// delta from the entities present in oldframe
-	oldindex = 0;
-	oldstate = NULL;
-	if ( !oldframe ) {
-		oldnum = MAX_GENTITIES+1;
+	newframe->parseEntitiesNum = cl.parseEntitiesNum;
+	if ( oldframe ) {
+		newframe->numEntities = MSG_ParsePacketEntities( msg, &parse, oldframe->parseEntitiesNum, oldframe->numEntities );
 	} else {
-		if ( oldindex >= oldframe->numEntities ) {
-			oldnum = MAX_GENTITIES+1;
-		} else {
-			oldstate = &cl.parseEntities[
-				(oldframe->parseEntitiesNum + oldindex) & (MAX_PARSE_ENTITIES-1)];
-			oldnum = oldstate->number;
-		}
+		newframe->numEntities = MSG_ParsePacketEntities( msg, &parse, 0, 0 );
 	}
 
-	while ( 1 ) {
-		// read the entity index number
-		newnum = MSG_ReadEntitynum( msg );
-
-		if ( newnum < 0 ) {
-			Com_Error( ERR_DROP, "CL_ParsePacketEntities: end of message" );
-		}
-
-		if ( newnum == (MAX_GENTITIES-1) ) {
-			break;
-		}
-
-		while ( oldnum < newnum ) {
-			// one or more entities from the old packet are unchanged
-			if ( cl_shownet->integer == 3 ) {
-				Com_Printf ("%3i:  unchanged: %i\n", msg->readcount, oldnum);
-			}
-			CL_DeltaEntity( msg, newframe, oldnum, oldstate, qtrue );
-
-			oldindex++;
-
-			if ( oldindex >= oldframe->numEntities ) {
-				oldnum = MAX_GENTITIES+1;
-			} else {
-				oldstate = &cl.parseEntities[
-					(oldframe->parseEntitiesNum + oldindex) & (MAX_PARSE_ENTITIES-1)];
-				oldnum = oldstate->number;
-			}
-		}
-		if (oldnum == newnum) {
-			// delta from previous state
-			if ( cl_shownet->integer == 3 ) {
-				Com_Printf ("%3i:  delta: %i\n", msg->readcount, newnum);
-			}
-			CL_DeltaEntity( msg, newframe, newnum, oldstate, qfalse );
-
-			oldindex++;
-
-			if ( oldindex >= oldframe->numEntities ) {
-				oldnum = MAX_GENTITIES+1;
-			} else {
-				oldstate = &cl.parseEntities[
-					(oldframe->parseEntitiesNum + oldindex) & (MAX_PARSE_ENTITIES-1)];
-				oldnum = oldstate->number;
-			}
-			continue;
-		}
-
-		if ( oldnum > newnum ) {
-			// delta from baseline
-			if ( cl_shownet->integer == 3 ) {
-				Com_Printf ("%3i:  baseline: %i\n", msg->readcount, newnum);
-			}
-			CL_DeltaEntity( msg, newframe, newnum, &cl.entityBaselines[newnum], qfalse );
-			continue;
-		}
-
+	if ( newframe->numEntities < 0 ) {
+		Com_Error( ERR_DROP, "CL_ParsePacketEntities: end of message" );
 	}
 
-	// any remaining entities in the old frame are copied over
-	while ( oldnum != MAX_GENTITIES+1 ) {
-		// one or more entities from the old packet are unchanged
-		if ( cl_shownet->integer == 3 ) {
-			Com_Printf ("%3i:  unchanged: %i\n", msg->readcount, oldnum);
-		}
-		CL_DeltaEntity( msg, newframe, oldnum, oldstate, qtrue );
-
-		oldindex++;
-
-		if ( oldindex >= oldframe->numEntities ) {
-			oldnum = MAX_GENTITIES+1;
-		} else {
-			oldstate = &cl.parseEntities[
-				(oldframe->parseEntitiesNum + oldindex) & (MAX_PARSE_ENTITIES-1)];
-			oldnum = oldstate->number;
-		}
-	}
+	cl.parseEntitiesNum = parse.num;
 }
 
 
@@ -1691,6 +1691,9 @@ void Com_Init( char *commandLine ) {
 	Cmd_AddCommand( "quit", Com_Quit_f );
 	Cmd_AddCommand( "writeconfig", Com_WriteConfig_f );
 	Cmd_AddCommand( "game_restart", Com_GameRestart_f );
+	Cmd_AddCommand( "huffbench", MSG_HuffmanBench_f );
+
+	HuffmanInitTables();
 
 	Sys_Init();
 
@@ -209,3 +209,122 @@ int HuffmanGetSymbol( unsigned int* symbol, const byte* buffer, int bitIndex )
 
 	return (int)(entry >> 8);
 }
+
+
+// two symbol decoder table built from HuffmanDecoderTable,
+// bits 0-15 hold the symbols, 16-19 the first length and
+// 20-23 the combined length, zero when only one symbol fits
+static uint32_t HuffmanPairTable[ 2048 ];
+
+
+void HuffmanInitTables( void )
+{
+	uint32_t code;
+	uint16_t first, second;
+	uint32_t len0, len1;
+
+	for( code = 0; code < 2048; ++code )
+	{
+		first = HuffmanDecoderTable[ code ];
+		len0 = first >> 8;
+
+		// remaining bits are zero-filled, the second symbol
+		// is valid only if it ends within the known bits
+		second = HuffmanDecoderTable[ code >> len0 ];
+		len1 = second >> 8;
+
+		HuffmanPairTable[ code ] = (first & 0xFF) | ((second & 0xFF) << 8) | (len0 << 16);
+		if ( len0 + len1 <= 11 )
+		{
+			HuffmanPairTable[ code ] |= (len0 + len1) << 20;
+		}
+	}
+}
+
+
+int HuffmanPutBits( byte* fout, uint32_t offset, uint32_t value, int nbits, int symbols )
+{
+	const uint32_t shift = offset & 7;
+	byte *out = fout + (offset >> 3);
+	uint64_t acc;
+	uint32_t count, n;
+	uint16_t result;
+
+	// raw low bits go first, then whole symbols
+	acc = value & ((1u << nbits) - 1);
+	count = nbits;
+	value >>= nbits;
+
+	while ( symbols-- > 0 )
+	{
+		result = HuffmanEncoderTable[ value & 0xFF ];
+		acc |= (uint64_t)((result >> 4) & 0x7FF) << count;
+		count += result & 15;
+		value >>= 8;
+	}
+
+	// at most 7 + 4 * 11 bits, so the shifted accumulator can't overflow
+	acc <<= shift;
+	if ( shift )
+	{
+		acc |= out[ 0 ];
+	}
+
+	for( n = (shift + count + 7) >> 3; n > 0; --n )
+	{
+		*out++ = (byte)acc;
+		acc >>= 8;
+	}
+
+	return (int)count;
+}
+
+
+int HuffmanGetBits( uint32_t* value, const byte* buffer, uint32_t offset, int nbits, int symbols )
+{
+	const byte *in = buffer + (offset >> 3);
+	uint64_t window;
+	uint32_t result, entry, count, shift, len;
+
+	// reads 8 bytes, at least 57 valid bits after alignment
+	window = (uint64_t)in[0] | ((uint64_t)in[1] << 8) | ((uint64_t)in[2] << 16) | ((uint64_t)in[3] << 24) |
+		((uint64_t)in[4] << 32) | ((uint64_t)in[5] << 40) | ((uint64_t)in[6] << 48) | ((uint64_t)in[7] << 56);
+	window >>= offset & 7;
+
+	result = (uint32_t)window & ((1u << nbits) - 1);
+	window >>= nbits;
+	count = nbits;
+	shift = nbits;
+
+	while ( symbols >= 2 )
+	{
+		entry = HuffmanPairTable[ window & 0x7FF ];
+		if ( entry >> 20 )
+		{
+			result |= (entry & 0xFFFF) << shift;
+			len = entry >> 20;
+			shift += 16;
+			symbols -= 2;
+		}
+		else
+		{
+			result |= (entry & 0xFF) << shift;
+			len = (entry >> 16) & 15;
+			shift += 8;
+			symbols--;
+		}
+		window >>= len;
+		count += len;
+	}
+
+	if ( symbols )
+	{
+		entry = HuffmanDecoderTable[ window & 0x7FF ];
+		result |= (entry & 0xFF) << shift;
+		count += entry >> 8;
+	}
+
+	*value = result;
+
+	return (int)count;
+}
@@ -22,6 +22,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "q_shared.h"
 #include "qcommon.h"
 
+#if idx64
+#include <emmintrin.h>
+#elif arm64
+#include <arm_neon.h>
+#endif
+
 /*
 ==============================================================================
 			MESSAGE IO FUNCTIONS
@@ -84,9 +90,85 @@ bit functions
 =============================================================================
 */
 
+// set only by huffbench to time the reference coder
+static qboolean msgBytewise;
+
+/*
+==================
+MSG_PutBitsBytewise
+
+Reference encoder, one bit or one symbol at a time
+==================
+*/
+static void MSG_PutBitsBytewise( msg_t *msg, int value, int bits ) {
+	int	i;
+
+	if ( bits & 7 ) {
+		int nbits;
+		nbits = bits&7;
+		for ( i = 0; i < nbits ; i++ ) {
+			HuffmanPutBit( msg->data, msg->bit, (value & 1) );
+			msg->bit++;
+			value = (value>>1);
+		}
+		bits = bits - nbits;
+	}
+	if ( bits ) {
+		for( i = 0 ; i < bits ; i += 8 ) {
+			msg->bit += HuffmanPutSymbol( msg->data, msg->bit, (value & 0xFF) );
+			value = (value>>8);
+		}
+	}
+}
+
+
+/*
+==================
+MSG_GetBitsBytewise
+
+Reference decoder, one bit or one symbol at a time
+==================
+*/
+static int MSG_GetBitsBytewise( msg_t *msg, int bits ) {
+	const byte *buffer = msg->data;
+	const int nbits = bits & 7;
+	int bitIndex = msg->bit;
+	unsigned int sym;
+	int value = 0;
+	int i;
+
+	for ( i = 0; i < nbits; i++ ) {
+		value |= HuffmanGetBit( buffer, bitIndex ) << i;
+		bitIndex++;
+	}
+	for ( i = 0; i < bits - nbits; i += 8 ) {
+		bitIndex += HuffmanGetSymbol( &sym, buffer, bitIndex );
+		value |= ( sym << (i+nbits) );
+	}
+
+	msg->bit = bitIndex;
+	return value;
+}
+
+
+/*
+==================
+MSG_SetUnreadable
+
+Delta readers don't call Com_Error on bad data, the server load test
+decodes with them too. Instead the rest of the message reads as past
+its end, which callers already treat as an error.
+==================
+*/
+static void MSG_SetUnreadable( msg_t *msg, const char *reason ) {
+	Com_DPrintf( S_COLOR_YELLOW "%s\n", reason );
+	msg->readcount = msg->cursize + 1;
+	msg->bit = msg->maxbits;
+}
+
+
 // negative bit values include signs
 void MSG_WriteBits( msg_t *msg, int value, int bits ) {
-	int	i;
 
 	if ( bits == 0 || bits < -31 || bits > 32 ) {
 		Com_Error( ERR_DROP, "MSG_WriteBits: bad bits %i", bits );
@@ -118,21 +200,11 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 		}
 	} else {
 		value &= (0xffffffff>>(32-bits));
-		if ( bits & 7 ) {
-			int nbits;
-			nbits = bits&7;
-			for ( i = 0; i < nbits ; i++ ) {
-				HuffmanPutBit( msg->data, msg->bit, (value & 1) );
-				msg->bit++;
-				value = (value>>1);
-			}
-			bits = bits - nbits;
-		}
-		if ( bits ) {
-			for( i = 0 ; i < bits ; i += 8 ) {
-				msg->bit += HuffmanPutSymbol( msg->data, msg->bit, (value & 0xFF) );
-				value = (value>>8);
-			}
+		if ( msgBytewise ) {
+			MSG_PutBitsBytewise( msg, value, bits );
+		} else {
+			// touches exactly the same bytes as MSG_PutBitsBytewise
+			msg->bit += HuffmanPutBits( msg->data, msg->bit, value, bits & 7, bits >> 3 );
 		}
 		msg->cursize = (msg->bit>>3)+1;
 	}
@@ -142,11 +214,52 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 	}
 }
 
+/*
+==================
+MSG_WriteBitStream
+
+Appends bits that were already Huffman encoded by MSG_WriteBits
+into another message, the source must be zero-padded to a whole byte
+==================
+*/
+void MSG_WriteBitStream( msg_t *msg, const byte *data, int bits ) {
+	int	i, n, shift;
+	byte *out;
+
+	if ( bits <= 0 || msg->overflowed != qfalse )
+		return;
+
+	if ( msg->oob ) {
+		Com_Error( ERR_DROP, "MSG_WriteBitStream: out-of-band message" );
+	}
+
+	if ( msg->bit + bits > msg->maxbits ) {
+		msg->overflowed = qtrue;
+		return;
+	}
+
+	n = ( bits + 7 ) >> 3;
+	shift = msg->bit & 7;
+	out = msg->data + ( msg->bit >> 3 );
+
+	if ( shift == 0 ) {
+		Com_Memcpy( out, data, n );
+	} else {
+		*out &= ( 1 << shift ) - 1;
+		for ( i = 0; i < n; i++ ) {
+			out[i] |= data[i] << shift;
+			out[i+1] = data[i] >> ( 8 - shift );
+		}
+	}
+
+	msg->bit += bits;
+	msg->cursize = (msg->bit>>3)+1;
+}
+
 static int MSG_ReadBits( msg_t *msg, int bits ) {
 	int		value;
 	qboolean	sgn;
-	int		i;
-	unsigned int	sym;
+	uint32_t	sym;
 	const byte *buffer = msg->data; // dereference optimization
 
 	if ( msg->bit >= msg->maxbits )
@@ -186,25 +299,15 @@ static int MSG_ReadBits( msg_t *msg, int bits ) {
 			Com_Error( ERR_DROP, "can't read %d bits", bits );
 	} else {
 		const int nbits = bits & 7;
-		int bitIndex = msg->bit; // dereference optimization
-		if ( nbits )
-		{		
-			for ( i = 0; i < nbits; i++ ) {
-				value |= HuffmanGetBit( buffer, bitIndex ) << i;
-				bitIndex++;
-			}
-			bits -= nbits;
-		}
-		if ( bits )
-		{
-			for ( i = 0; i < bits; i += 8 )
-			{
-				bitIndex += HuffmanGetSymbol( &sym, buffer, bitIndex );
-				value |= ( sym << (i+nbits) );
-			}
+		// the table decoder loads 8 bytes at once
+		if ( msg->bit + 64 <= msg->maxbits && !msgBytewise ) {
+			msg->bit += HuffmanGetBits( &sym, buffer, msg->bit, nbits, bits >> 3 );
+			value = (int)sym;
+		} else {
+			value = MSG_GetBitsBytewise( msg, bits );
 		}
-		msg->bit = bitIndex;
-		msg->readcount = (bitIndex >> 3) + 1;
+		bits -= nbits;
+		msg->readcount = (msg->bit >> 3) + 1;
 	}
 
 	if ( sgn && bits < 32 ) {
@@ -443,8 +546,60 @@ void MSG_ReadData( msg_t *msg, void *data, int len ) {
 }
 
 
+/*
+============
+Entity numbers
+
+Numbers are sent in ENTITYNUM_SHORT_BITS so that builds with a raised
+GENTITYNUM_BITS keep the stock cost on ordinary maps: the top short code
+stands for ENTITYNUM_NONE (end of packet entities) and the one below it
+escapes to a full GENTITYNUM_BITS number. With the default 12-bit limit
+this is plain MSG_WriteBits/MSG_ReadBits.
+============
+*/
+#define ENTITYNUM_SHORT_BITS	12
+#define ENTITYNUM_SHORT_NONE	((1<<ENTITYNUM_SHORT_BITS)-1)
+#define ENTITYNUM_SHORT_ESCAPE	((1<<ENTITYNUM_SHORT_BITS)-2)
+
+int MSG_EntitynumBits( int num ) {
+#if GENTITYNUM_BITS > ENTITYNUM_SHORT_BITS
+	if ( num >= ENTITYNUM_SHORT_ESCAPE && num != MAX_GENTITIES-1 ) {
+		return ENTITYNUM_SHORT_BITS + GENTITYNUM_BITS;
+	}
+	return ENTITYNUM_SHORT_BITS;
+#else
+	return GENTITYNUM_BITS;
+#endif
+}
+
+
+void MSG_WriteEntitynum( msg_t *msg, int num ) {
+#if GENTITYNUM_BITS > ENTITYNUM_SHORT_BITS
+	if ( num == MAX_GENTITIES-1 ) {
+		MSG_WriteBits( msg, ENTITYNUM_SHORT_NONE, ENTITYNUM_SHORT_BITS );
+	} else if ( num >= ENTITYNUM_SHORT_ESCAPE ) {
+		MSG_WriteBits( msg, ENTITYNUM_SHORT_ESCAPE, ENTITYNUM_SHORT_BITS );
+		MSG_WriteBits( msg, num, GENTITYNUM_BITS );
+	} else {
+		MSG_WriteBits( msg, num, ENTITYNUM_SHORT_BITS );
+	}
+#else
+	MSG_WriteBits( msg, num, GENTITYNUM_BITS );
+#endif
+}
+
+
 int MSG_ReadEntitynum( msg_t *msg ) {
+#if GENTITYNUM_BITS > ENTITYNUM_SHORT_BITS
+	int num = MSG_ReadBits( msg, ENTITYNUM_SHORT_BITS );
+	if ( num == ENTITYNUM_SHORT_NONE ) {
+		num = MAX_GENTITIES-1;
+	} else if ( num == ENTITYNUM_SHORT_ESCAPE ) {
+		num = MSG_ReadBits( msg, GENTITYNUM_BITS );
+	}
+#else
 	const int num = MSG_ReadBits( msg, GENTITYNUM_BITS );
+#endif
 	if ( msg->readcount > msg->cursize ) {
 		return -1;
 	} else {
@@ -584,6 +739,62 @@ typedef struct {
 	const int	bits;	// 0 = float
 } netField_t;
 
+// one bit per 32-bit word of the compared structures, plus a spare
+// entry so that MSG_MaskBits can always read two words
+#define DIFF_MASK_WORDS( size )	( ( (size) / 4 + 31 ) / 32 + 1 )
+
+#define DIFF_CHANGED( mask, offset )	( ( (mask)[ (offset) >> 7 ] >> ( ( (offset) >> 2 ) & 31 ) ) & 1 )
+
+/*
+==================
+MSG_DiffWords
+
+Compares two structures four words at a time and sets a bit in
+mask for every 32-bit word that differs
+==================
+*/
+static void MSG_DiffWords( const int *from, const int *to, int numWords, uint32_t *mask, int maskWords ) {
+	uint32_t	changed;
+	int			i;
+
+	Com_Memset( mask, 0, maskWords * sizeof( mask[0] ) );
+
+	for ( i = 0; i + 4 <= numWords; i += 4 ) {
+#if idx64
+		const __m128i eq = _mm_cmpeq_epi32( _mm_loadu_si128( (const __m128i *)( from + i ) ), _mm_loadu_si128( (const __m128i *)( to + i ) ) );
+		changed = _mm_movemask_ps( _mm_castsi128_ps( eq ) ) ^ 15;
+#elif arm64
+		static const uint32_t lanes[4] = { 1, 2, 4, 8 };
+		const uint32x4_t ne = vmvnq_u32( vceqq_s32( vld1q_s32( from + i ), vld1q_s32( to + i ) ) );
+		changed = vaddvq_u32( vandq_u32( ne, vld1q_u32( lanes ) ) );
+#else
+		changed = ( from[i] != to[i] ) | ( ( from[i+1] != to[i+1] ) << 1 ) |
+			( ( from[i+2] != to[i+2] ) << 2 ) | ( ( from[i+3] != to[i+3] ) << 3 );
+#endif
+		mask[ i >> 5 ] |= changed << ( i & 31 );
+	}
+
+	for ( ; i < numWords; i++ ) {
+		if ( from[i] != to[i] ) {
+			mask[ i >> 5 ] |= 1u << ( i & 31 );
+		}
+	}
+}
+
+
+/*
+==================
+MSG_MaskBits
+
+Extracts count (up to 32) consecutive word bits starting at offset
+==================
+*/
+static ID_INLINE int MSG_MaskBits( const uint32_t *mask, int offset, int count ) {
+	const int word = offset >> 2;
+	const uint64_t bits = mask[ word >> 5 ] | ( (uint64_t)mask[ ( word >> 5 ) + 1 ] << 32 );
+	return (int)( ( bits >> ( word & 31 ) ) & ( ( 1ULL << count ) - 1 ) );
+}
+
 // using the stringizing operator to save typing...
 #define	NETF(x) #x,(size_t)&((entityState_t*)0)->x
 
@@ -668,7 +879,9 @@ void MSG_WriteDeltaEntity( msg_t *msg, const entityState_t *from, const entitySt
 	const netField_t *field;
 	int			trunc;
 	float		fullFloat;
-	const int	*fromF, *toF;
+	const int	*toF;
+	uint32_t	changed[ DIFF_MASK_WORDS( sizeof( entityState_t ) ) ];
+	uint64_t	fieldMask;
 
 	numFields = ARRAY_LEN( entityStateFields );
 
@@ -683,7 +896,7 @@ void MSG_WriteDeltaEntity( msg_t *msg, const entityState_t *from, const entitySt
 		if ( from == NULL ) {
 			return;
 		}
-		MSG_WriteBits( msg, from->number, GENTITYNUM_BITS );
+		MSG_WriteEntitynum( msg, from->number );
 		MSG_WriteBits( msg, 1, 1 );
 		return;
 	}
@@ -692,13 +905,24 @@ void MSG_WriteDeltaEntity( msg_t *msg, const entityState_t *from, const entitySt
 		Com_Error( ERR_DROP, "MSG_WriteDeltaEntity: Bad entity number: %i", to->number );
 	}
 
+	// compare whole states first, most entities don't change at all
+	MSG_DiffWords( (const int *)from, (const int *)to, sizeof( *to ) / 4, changed, ARRAY_LEN( changed ) );
+	changed[ offsetof( entityState_t, number ) >> 7 ] &= ~( 1u << ( ( offsetof( entityState_t, number ) >> 2 ) & 31 ) );
+
 	lc = 0;
-	// build the change vector as bytes so it is endian independent
-	for ( i = 0, field = entityStateFields ; i < numFields ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
-		toF = (int *)( (byte *)to + field->offset );
-		if ( *fromF != *toF ) {
-			lc = i+1;
+	fieldMask = 0;
+	for ( i = 0; i < ARRAY_LEN( changed ); i++ ) {
+		if ( changed[i] ) {
+			break;
+		}
+	}
+	if ( i < ARRAY_LEN( changed ) ) {
+		// build the change vector in field order
+		for ( i = 0, field = entityStateFields ; i < numFields ; i++, field++ ) {
+			if ( DIFF_CHANGED( changed, field->offset ) ) {
+				fieldMask |= 1ULL << i;
+				lc = i+1;
+			}
 		}
 	}
 
@@ -708,23 +932,22 @@ void MSG_WriteDeltaEntity( msg_t *msg, const entityState_t *from, const entitySt
 			return;		// nothing at all
 		}
 		// write two bits for no change
-		MSG_WriteBits( msg, to->number, GENTITYNUM_BITS );
+		MSG_WriteEntitynum( msg, to->number );
 		MSG_WriteBits( msg, 0, 1 );		// not removed
 		MSG_WriteBits( msg, 0, 1 );		// no delta
 		return;
 	}
 
-	MSG_WriteBits( msg, to->number, GENTITYNUM_BITS );
+	MSG_WriteEntitynum( msg, to->number );
 	MSG_WriteBits( msg, 0, 1 );			// not removed
 	MSG_WriteBits( msg, 1, 1 );			// we have a delta
 
 	MSG_WriteByte( msg, lc );	// # of changes
 
 	for ( i = 0, field = entityStateFields ; i < lc ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
 		toF = (int *)( (byte *)to + field->offset );
 
-		if ( *fromF == *toF ) {
+		if ( !( fieldMask & ( 1ULL << i ) ) ) {
 			MSG_WriteBits( msg, 0, 1 );	// no change
 			continue;
 		}
@@ -790,9 +1013,9 @@ void MSG_ReadDeltaEntity( msg_t *msg, const entityState_t *from, entityState_t *
 	}
 
 	if ( msg->bit == 0 ) {
-		startBit = msg->readcount * 8 - GENTITYNUM_BITS;
+		startBit = msg->readcount * 8 - MSG_EntitynumBits( number );
 	} else {
-		startBit = ( msg->readcount - 1 ) * 8 + msg->bit - GENTITYNUM_BITS;
+		startBit = ( msg->readcount - 1 ) * 8 + msg->bit - MSG_EntitynumBits( number );
 	}
 
 	// check for a remove
@@ -818,7 +1041,10 @@ void MSG_ReadDeltaEntity( msg_t *msg, const entityState_t *from, entityState_t *
 	lc = MSG_ReadByte(msg);
 
 	if ( lc > numFields || lc < 0 ) {
-		Com_Error( ERR_DROP, "invalid entityState field count" );
+		*to = *from;
+		to->number = number;
+		MSG_SetUnreadable( msg, "invalid entityState field count" );
+		return;
 	}
 
 	to->number = number;
@@ -889,15 +1115,158 @@ void MSG_ReadDeltaEntity( msg_t *msg, const entityState_t *from, entityState_t *
 
 	if ( print ) {
 		if ( msg->bit == 0 ) {
-			endBit = msg->readcount * 8 - GENTITYNUM_BITS;
+			endBit = msg->readcount * 8 - MSG_EntitynumBits( number );
 		} else {
-			endBit = ( msg->readcount - 1 ) * 8 + msg->bit - GENTITYNUM_BITS;
+			endBit = ( msg->readcount - 1 ) * 8 + msg->bit - MSG_EntitynumBits( number );
 		}
 		Com_Printf( " (%i bits)\n", endBit - startBit  );
 	}
 }
 
 
+/*
+==================
+MSG_ParseDeltaEntity
+
+Parses deltas from the given base and appends the
+resulting entity to the parse buffer
+==================
+*/
+static void MSG_ParseDeltaEntity( msg_t *msg, entityParse_t *parse, int *count, int newnum, const entityState_t *old, qboolean unchanged ) {
+	entityState_t	*state;
+
+	// save the parsed entity state into the big circular buffer so
+	// it can be used as the source for a later delta
+	state = &parse->entities[ parse->num & parse->mask ];
+
+	if ( unchanged ) {
+		*state = *old;
+	} else {
+		MSG_ReadDeltaEntity( msg, old, state, newnum );
+	}
+
+	if ( state->number == (MAX_GENTITIES-1) ) {
+		return;		// entity was delta removed
+	}
+	parse->num++;
+	(*count)++;
+}
+
+
+/*
+==================
+MSG_ParsePacketEntities
+
+Reads packetentities delta compressed from the oldCount states at
+oldFirst in the parse buffer, new entities come from the baselines.
+The new frame starts at the parse->num passed in, its entity count
+is returned, or -1 if the message ended early.
+==================
+*/
+int MSG_ParsePacketEntities( msg_t *msg, entityParse_t *parse, int oldFirst, int oldCount ) {
+	const entityState_t	*oldstate;
+	int	newnum, count;
+	int	oldindex, oldnum;
+
+	count = 0;
+
+	// delta from the entities present in oldframe
+	oldindex = 0;
+	oldstate = NULL;
+	if ( oldindex >= oldCount ) {
+		oldnum = MAX_GENTITIES+1;
+	} else {
+		oldstate = &parse->entities[ (oldFirst + oldindex) & parse->mask ];
+		oldnum = oldstate->number;
+	}
+
+	while ( 1 ) {
+		// read the entity index number
+		newnum = MSG_ReadEntitynum( msg );
+
+		if ( newnum < 0 ) {
+			return -1;
+		}
+
+		if ( newnum == (MAX_GENTITIES-1) ) {
+			break;
+		}
+
+		while ( oldnum < newnum ) {
+			// one or more entities from the old packet are unchanged
+#ifndef DEDICATED
+			if ( cl_shownet && cl_shownet->integer == 3 ) {
+				Com_Printf ("%3i:  unchanged: %i\n", msg->readcount, oldnum);
+			}
+#endif
+			MSG_ParseDeltaEntity( msg, parse, &count, oldnum, oldstate, qtrue );
+
+			oldindex++;
+
+			if ( oldindex >= oldCount ) {
+				oldnum = MAX_GENTITIES+1;
+			} else {
+				oldstate = &parse->entities[ (oldFirst + oldindex) & parse->mask ];
+				oldnum = oldstate->number;
+			}
+		}
+		if (oldnum == newnum) {
+			// delta from previous state
+#ifndef DEDICATED
+			if ( cl_shownet && cl_shownet->integer == 3 ) {
+				Com_Printf ("%3i:  delta: %i\n", msg->readcount, newnum);
+			}
+#endif
+			MSG_ParseDeltaEntity( msg, parse, &count, newnum, oldstate, qfalse );
+
+			oldindex++;
+
+			if ( oldindex >= oldCount ) {
+				oldnum = MAX_GENTITIES+1;
+			} else {
+				oldstate = &parse->entities[ (oldFirst + oldindex) & parse->mask ];
+				oldnum = oldstate->number;
+			}
+			continue;
+		}
+
+		if ( oldnum > newnum ) {
+			// delta from baseline
+#ifndef DEDICATED
+			if ( cl_shownet && cl_shownet->integer == 3 ) {
+				Com_Printf ("%3i:  baseline: %i\n", msg->readcount, newnum);
+			}
+#endif
+			MSG_ParseDeltaEntity( msg, parse, &count, newnum, &parse->baselines[newnum], qfalse );
+			continue;
+		}
+
+	}
+
+	// any remaining entities in the old frame are copied over
+	while ( oldnum != MAX_GENTITIES+1 ) {
+		// one or more entities from the old packet are unchanged
+#ifndef DEDICATED
+		if ( cl_shownet && cl_shownet->integer == 3 ) {
+			Com_Printf ("%3i:  unchanged: %i\n", msg->readcount, oldnum);
+		}
+#endif
+		MSG_ParseDeltaEntity( msg, parse, &count, oldnum, oldstate, qtrue );
+
+		oldindex++;
+
+		if ( oldindex >= oldCount ) {
+			oldnum = MAX_GENTITIES+1;
+		} else {
+			oldstate = &parse->entities[ (oldFirst + oldindex) & parse->mask ];
+			oldnum = oldstate->number;
+		}
+	}
+
+	return count;
+}
+
+
 /*
 ============================================================================
 
@@ -975,9 +1344,11 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, const playerState_t *from, const pla
 	int				powerupbits;
 	int				numFields;
 	const netField_t *field;
-	const int		*fromF, *toF;
+	const int		*toF;
 	float			fullFloat;
 	int				trunc, lc;
+	uint32_t		changed[ DIFF_MASK_WORDS( sizeof( playerState_t ) ) ];
+	uint64_t		fieldMask;
 
 	if ( !from ) {
 		from = &dummy;
@@ -985,11 +1356,14 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, const playerState_t *from, const pla
 
 	numFields = ARRAY_LEN( playerStateFields );
 
+	// compare whole states first, the arrays are taken from the same mask
+	MSG_DiffWords( (const int *)from, (const int *)to, sizeof( *to ) / 4, changed, ARRAY_LEN( changed ) );
+
 	lc = 0;
+	fieldMask = 0;
 	for ( i = 0, field = playerStateFields ; i < numFields ; i++, field++ ) {
-		fromF = (const int *)( (byte *)from + field->offset );
-		toF = (const int *)( (byte *)to + field->offset );
-		if ( *fromF != *toF ) {
+		if ( DIFF_CHANGED( changed, field->offset ) ) {
+			fieldMask |= 1ULL << i;
 			lc = i+1;
 		}
 	}
@@ -997,10 +1371,9 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, const playerState_t *from, const pla
 	MSG_WriteByte( msg, lc );	// # of changes
 
 	for ( i = 0, field = playerStateFields ; i < lc ; i++, field++ ) {
-		fromF = (const int *)( (byte *)from + field->offset );
 		toF = (const int *)( (byte *)to + field->offset );
 
-		if ( *fromF == *toF ) {
+		if ( !( fieldMask & ( 1ULL << i ) ) ) {
 			MSG_WriteBits( msg, 0, 1 );	// no change
 			continue;
 		}
@@ -1031,24 +1404,9 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, const playerState_t *from, const pla
 	//
 	// send the arrays
 	//
-	statsbits = 0;
-	for (i=0 ; i<MAX_STATS ; i++) {
-		if (to->stats[i] != from->stats[i]) {
-			statsbits |= 1<<i;
-		}
-	}
-	persistantbits = 0;
-	for (i=0 ; i<MAX_PERSISTANT ; i++) {
-		if (to->persistant[i] != from->persistant[i]) {
-			persistantbits |= 1<<i;
-		}
-	}
-	powerupbits = 0;
-	for (i=0 ; i<MAX_POWERUPS ; i++) {
-		if (to->powerups[i] != from->powerups[i]) {
-			powerupbits |= 1<<i;
-		}
-	}
+	statsbits = MSG_MaskBits( changed, offsetof( playerState_t, stats ), MAX_STATS );
+	persistantbits = MSG_MaskBits( changed, offsetof( playerState_t, persistant ), MAX_PERSISTANT );
+	powerupbits = MSG_MaskBits( changed, offsetof( playerState_t, powerups ), MAX_POWERUPS );
 
 	if (!statsbits && !persistantbits && !powerupbits) {
 		MSG_WriteBits( msg, 0, 1 );	// no change
@@ -1136,7 +1494,8 @@ void MSG_ReadDeltaPlayerstate( msg_t *msg, const playerState_t *from, playerStat
 	lc = MSG_ReadByte(msg);
 
 	if ( lc > numFields || lc < 0 ) {
-		Com_Error( ERR_DROP, "invalid playerState field count" );
+		MSG_SetUnreadable( msg, "invalid playerState field count" );
+		return;
 	}
 
 	for ( i = 0, field = playerStateFields ; i < lc ; i++, field++ ) {
@@ -1229,3 +1588,366 @@ void MSG_ReadDeltaPlayerstate( msg_t *msg, const playerState_t *from, playerStat
 }
 
 //===========================================================================
+
+/*
+=============================================================================
+
+huffman benchmark
+
+=============================================================================
+*/
+
+#define BENCH_MAX_BYTES		(4*1024*1024)
+#define BENCH_PASSES		16
+#define BENCH_PARSE_ENTITIES	( MAX_SNAPSHOT_ENTITIES * 2 )	// smallest ring that can always delta
+
+typedef struct {
+	byte	*data;
+	int		length;
+	int		sequence;
+} benchMessage_t;
+
+typedef struct {
+	qboolean		valid;
+	int				messageNum;
+	int				parseEntitiesNum;
+	int				numEntities;
+	playerState_t	ps;
+} benchFrame_t;
+
+typedef struct {
+	entityParse_t	parse;
+	entityState_t	*baselines;		// [MAX_GENTITIES]
+	benchFrame_t	frames[ PACKET_BACKUP ];
+	byte			*out;			// [MAX_MSGLEN_BUF] re-encoded snapshot
+	int				snapshots;
+	int				errors;
+	unsigned int	checksum;		// of everything decoded and encoded
+	int64_t			decodeTime;
+	int64_t			encodeTime;
+} benchState_t;
+
+
+/*
+==================
+MSG_BenchGamestate
+==================
+*/
+static qboolean MSG_BenchGamestate( benchState_t *b, msg_t *msg ) {
+	entityState_t	nullstate;
+	int				cmd, i;
+
+	Com_Memset( &nullstate, 0, sizeof( nullstate ) );
+	Com_Memset( b->baselines, 0, MAX_GENTITIES * sizeof( entityState_t ) );
+
+	MSG_ReadLong( msg );	// serverCommandSequence
+
+	while ( 1 ) {
+		cmd = MSG_ReadByte( msg );
+		if ( cmd == svc_EOF ) {
+			break;
+		}
+		if ( cmd == svc_configstring ) {
+			MSG_ReadShort( msg );
+			MSG_ReadBigString( msg );
+		} else if ( cmd == svc_baseline ) {
+			i = MSG_ReadEntitynum( msg );
+			if ( i < 0 || i >= MAX_GENTITIES ) {
+				return qfalse;
+			}
+			MSG_ReadDeltaEntity( msg, &nullstate, &b->baselines[ i ], i );
+		} else {
+			return qfalse;
+		}
+	}
+
+	MSG_ReadLong( msg );	// clientNum
+	MSG_ReadLong( msg );	// checksumFeed
+
+	for ( i = 0; i < PACKET_BACKUP; i++ ) {
+		b->frames[ i ].valid = qfalse;
+	}
+
+	return qtrue;
+}
+
+
+/*
+==================
+MSG_BenchEmitEntities
+
+Writes packet entities the same way SV_EmitPacketEntities does
+==================
+*/
+static void MSG_BenchEmitEntities( const benchState_t *b, msg_t *msg, const benchFrame_t *from, const benchFrame_t *to ) {
+	const entityState_t	*oldent, *newent;
+	int		oldindex, newindex;
+	int		oldnum, newnum;
+	int		fromCount;
+
+	fromCount = from ? from->numEntities : 0;
+	oldent = newent = NULL;
+	oldindex = newindex = 0;
+
+	while ( newindex < to->numEntities || oldindex < fromCount ) {
+		if ( newindex >= to->numEntities ) {
+			newnum = MAX_GENTITIES+1;
+		} else {
+			newent = &b->parse.entities[ ( to->parseEntitiesNum + newindex ) & b->parse.mask ];
+			newnum = newent->number;
+		}
+
+		if ( oldindex >= fromCount ) {
+			oldnum = MAX_GENTITIES+1;
+		} else {
+			oldent = &b->parse.entities[ ( from->parseEntitiesNum + oldindex ) & b->parse.mask ];
+			oldnum = oldent->number;
+		}
+
+		if ( newnum == oldnum ) {
+			MSG_WriteDeltaEntity( msg, oldent, newent, qfalse );
+			oldindex++;
+			newindex++;
+		} else if ( newnum < oldnum ) {
+			MSG_WriteDeltaEntity( msg, &b->baselines[ newnum ], newent, qtrue );
+			newindex++;
+		} else {
+			MSG_WriteDeltaEntity( msg, oldent, NULL, qtrue );
+			oldindex++;
+		}
+	}
+
+	MSG_WriteEntitynum( msg, MAX_GENTITIES-1 );	// end of packetentities
+}
+
+
+/*
+==================
+MSG_BenchSnapshot
+
+Parses a snapshot like CL_ParseSnapshot, then encodes it again from
+the same delta base and checksums both results
+==================
+*/
+static qboolean MSG_BenchSnapshot( benchState_t *b, msg_t *msg, int messageNum, int64_t start ) {
+	const benchFrame_t	*old;
+	benchFrame_t	*frame;
+	byte			areamask[ MAX_MAP_AREA_BYTES ];
+	int				deltaNum, areabytes;
+	msg_t			out;
+
+	MSG_ReadLong( msg );	// serverTime
+	deltaNum = MSG_ReadByte( msg );
+	MSG_ReadByte( msg );	// snapFlags
+
+	if ( deltaNum >= PACKET_BACKUP ) {
+		return qfalse;
+	}
+
+	old = NULL;
+	if ( deltaNum ) {
+		old = &b->frames[ ( messageNum - deltaNum ) & PACKET_MASK ];
+		if ( !old->valid || old->messageNum != messageNum - deltaNum
+			|| b->parse.num - old->parseEntitiesNum > BENCH_PARSE_ENTITIES - MAX_SNAPSHOT_ENTITIES ) {
+			return qfalse;
+		}
+	}
+
+	areabytes = MSG_ReadByte( msg );
+	if ( areabytes > sizeof( areamask ) ) {
+		return qfalse;
+	}
+	MSG_ReadData( msg, areamask, areabytes );
+
+	frame = &b->frames[ messageNum & PACKET_MASK ];
+	frame->valid = qfalse;
+	frame->messageNum = messageNum;
+
+	MSG_ReadDeltaPlayerstate( msg, old ? &old->ps : NULL, &frame->ps );
+
+	frame->parseEntitiesNum = b->parse.num;
+	if ( old ) {
+		frame->numEntities = MSG_ParsePacketEntities( msg, &b->parse, old->parseEntitiesNum, old->numEntities );
+	} else {
+		frame->numEntities = MSG_ParsePacketEntities( msg, &b->parse, 0, 0 );
+	}
+	if ( frame->numEntities < 0 || msg->readcount > msg->cursize ) {
+		return qfalse;
+	}
+	frame->valid = qtrue;
+
+	b->decodeTime += Sys_Microseconds() - start;
+
+	start = Sys_Microseconds();
+	MSG_Init( &out, b->out, MAX_MSGLEN );
+	MSG_WriteDeltaPlayerstate( &out, old ? &old->ps : NULL, &frame->ps );
+	MSG_BenchEmitEntities( b, &out, old, frame );
+	b->encodeTime += Sys_Microseconds() - start;
+
+	b->checksum = b->checksum * 31 + crc32_buffer( (const byte *)&frame->ps, sizeof( frame->ps ) );
+	b->checksum = b->checksum * 31 + crc32_buffer( out.data, out.cursize );
+	b->snapshots++;
+
+	return qtrue;
+}
+
+
+/*
+==================
+MSG_BenchMessage
+
+Returns qfalse when the message can't be parsed
+==================
+*/
+static qboolean MSG_BenchMessage( benchState_t *b, const benchMessage_t *m ) {
+	msg_t	msg;
+	int64_t	start;
+	int		cmd;
+
+	start = Sys_Microseconds();
+
+	MSG_Init( &msg, m->data, m->length );
+	msg.cursize = m->length;
+	MSG_Bitstream( &msg );
+	MSG_ReadLong( &msg );	// reliableAcknowledge
+
+	while ( 1 ) {
+		if ( msg.readcount > msg.cursize ) {
+			return qfalse;
+		}
+
+		cmd = MSG_ReadByte( &msg );
+		if ( cmd == svc_EOF ) {
+			break;
+		}
+
+		switch ( cmd ) {
+		case svc_nop:
+			break;
+		case svc_serverCommand:
+			MSG_ReadLong( &msg );
+			MSG_ReadString( &msg );
+			break;
+		case svc_gamestate:
+			if ( !MSG_BenchGamestate( b, &msg ) ) {
+				return qfalse;
+			}
+			break;
+		case svc_snapshot:
+			// times its own decode and encode
+			if ( !MSG_BenchSnapshot( b, &msg, m->sequence, start ) ) {
+				return qfalse;
+			}
+			start = Sys_Microseconds();
+			break;
+		default:
+			return qfalse;
+		}
+	}
+
+	b->decodeTime += Sys_Microseconds() - start;
+
+	return qtrue;
+}
+
+
+/*
+==================
+MSG_HuffmanBench_f
+
+Compares the table driven coder with the bytewise reference by parsing
+the snapshots of a message dump and encoding each one again, dumps are
+written by "loadtest <clients> <seconds> <name>" and use the framing
+of demo messages, so demo files work as well
+==================
+*/
+void MSG_HuffmanBench_f( void ) {
+	benchMessage_t	*messages;
+	benchState_t	*bench[2];
+	fileHandle_t	f;
+	byte	*data;
+	int		numMessages, maxMessages, total;
+	int		header[2], len, i, pass, method;
+
+	if ( Cmd_Argc() != 2 ) {
+		Com_Printf( "usage: huffbench <dumpfile>\n" );
+		return;
+	}
+
+	if ( FS_FOpenFileRead( Cmd_Argv( 1 ), &f, qtrue ) <= 0 ) {
+		Com_Printf( "couldn't open %s\n", Cmd_Argv( 1 ) );
+		return;
+	}
+
+	// messages are a sequence number and a length followed by the payload
+	data = Z_Malloc( BENCH_MAX_BYTES );
+	maxMessages = BENCH_MAX_BYTES / 64;
+	messages = Z_Malloc( maxMessages * sizeof( *messages ) );
+	numMessages = total = 0;
+
+	while ( numMessages < maxMessages && FS_Read( header, sizeof( header ), f ) == sizeof( header ) ) {
+		len = LittleLong( header[1] );
+		if ( len <= 0 || len > MAX_MSGLEN - 64 || total + len + 8 > BENCH_MAX_BYTES ) {
+			break;
+		}
+		if ( FS_Read( data + total, len, f ) != len ) {
+			break;
+		}
+		messages[ numMessages ].data = data + total;
+		messages[ numMessages ].length = len;
+		messages[ numMessages ].sequence = LittleLong( header[0] );
+		numMessages++;
+		total += len + 8;
+	}
+	FS_FCloseFile( f );
+
+	if ( !numMessages ) {
+		Com_Printf( "no messages in %s\n", Cmd_Argv( 1 ) );
+		Z_Free( messages );
+		Z_Free( data );
+		return;
+	}
+
+	for ( method = 0; method < 2; method++ ) {
+		bench[ method ] = Z_Malloc( sizeof( benchState_t ) );
+		bench[ method ]->baselines = Z_Malloc( MAX_GENTITIES * sizeof( entityState_t ) );
+		bench[ method ]->parse.entities = Z_Malloc( BENCH_PARSE_ENTITIES * sizeof( entityState_t ) );
+		bench[ method ]->parse.mask = BENCH_PARSE_ENTITIES - 1;
+		bench[ method ]->parse.baselines = bench[ method ]->baselines;
+		bench[ method ]->out = Z_Malloc( MAX_MSGLEN_BUF );
+
+		msgBytewise = ( method == 0 );
+		for ( pass = 0; pass < BENCH_PASSES; pass++ ) {
+			bench[ method ]->snapshots = bench[ method ]->errors = 0;
+			bench[ method ]->checksum = 0;
+			bench[ method ]->parse.num = 0;
+			for ( i = 0; i < PACKET_BACKUP; i++ ) {
+				bench[ method ]->frames[ i ].valid = qfalse;
+			}
+			for ( i = 0; i < numMessages; i++ ) {
+				if ( !MSG_BenchMessage( bench[ method ], &messages[ i ] ) ) {
+					bench[ method ]->errors++;
+				}
+			}
+		}
+	}
+	msgBytewise = qfalse;
+
+	Com_Printf( "%i messages, %i snapshots, %i KB, %i passes\n", numMessages, bench[1]->snapshots, total / 1024, BENCH_PASSES );
+	Com_Printf( "bytewise: decode %6i usec, encode %6i usec, %i bad messages\n",
+		(int)bench[0]->decodeTime, (int)bench[0]->encodeTime, bench[0]->errors );
+	Com_Printf( "table:    decode %6i usec, encode %6i usec, %i bad messages\n",
+		(int)bench[1]->decodeTime, (int)bench[1]->encodeTime, bench[1]->errors );
+	if ( bench[0]->checksum != bench[1]->checksum || bench[0]->snapshots != bench[1]->snapshots ) {
+		Com_Printf( S_COLOR_YELLOW "coders disagree on decoded or encoded snapshots\n" );
+	}
+
+	for ( method = 0; method < 2; method++ ) {
+		Z_Free( bench[ method ]->out );
+		Z_Free( bench[ method ]->parse.entities );
+		Z_Free( bench[ method ]->baselines );
+		Z_Free( bench[ method ] );
+	}
+	Z_Free( messages );
+	Z_Free( data );
+}
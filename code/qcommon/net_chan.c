@@ -54,11 +54,134 @@ cvar_t		*showpackets;
 cvar_t		*showdrop;
 cvar_t		*qport;
 
+static cvar_t	*net_fragmentBuffers;
+
 static const char *netsrcString[2] = {
 	"client",
 	"server"
 };
 
+
+/*
+=============================================================================
+
+FRAGMENT BUFFER POOL
+
+Fragment assembly and unsent storage are only needed while a fragmented
+message is in flight, so channels borrow MAX_MSGLEN blocks from a shared
+pool instead of embedding them. A few released blocks are kept for reuse,
+net_fragmentBuffers limits how many reassembly blocks can be borrowed at
+once. Outgoing messages may go past the limit, their fragments are still
+paced by rate instead of being sent in one burst.
+
+=============================================================================
+*/
+
+#define POOL_KEEP_FREE	4
+
+typedef struct poolBlock_s {
+	struct poolBlock_s *next;
+} poolBlock_t;
+
+static poolBlock_t	*poolFree;
+static int			poolNumFree;
+static int			poolInUse;
+static int			poolPeak;
+static int			poolExhausted;
+
+
+/*
+===============
+Netchan_AllocBuffer
+
+Returns NULL when the pool is exhausted, outgoing blocks
+only fail when out of memory
+===============
+*/
+static byte *Netchan_AllocBuffer( qboolean outgoing ) {
+	poolBlock_t *block;
+
+	if ( poolInUse >= net_fragmentBuffers->integer ) {
+		poolExhausted++;
+		if ( !outgoing ) {
+			return NULL;
+		}
+	}
+
+	if ( poolFree ) {
+		block = poolFree;
+		poolFree = block->next;
+		poolNumFree--;
+	} else {
+		block = malloc( MAX_MSGLEN );
+		if ( !block ) {
+			poolExhausted++;
+			return NULL;
+		}
+	}
+
+	if ( ++poolInUse > poolPeak )
+		poolPeak = poolInUse;
+
+	return (byte *)block;
+}
+
+
+/*
+===============
+Netchan_FreeBuffer
+===============
+*/
+static void Netchan_FreeBuffer( byte *buf ) {
+	poolBlock_t *block = (poolBlock_t *)buf;
+
+	poolInUse--;
+
+	if ( poolNumFree >= POOL_KEEP_FREE ) {
+		free( block );
+		return;
+	}
+
+	block->next = poolFree;
+	poolFree = block;
+	poolNumFree++;
+}
+
+
+/*
+===============
+Netchan_Release
+
+Returns borrowed buffers, must be called before a channel is discarded
+===============
+*/
+void Netchan_Release( netchan_t *chan ) {
+	if ( chan->fragmentBuffer ) {
+		Netchan_FreeBuffer( chan->fragmentBuffer );
+		chan->fragmentBuffer = NULL;
+	}
+	chan->fragmentLength = 0;
+
+	if ( chan->unsentBuffer ) {
+		Netchan_FreeBuffer( chan->unsentBuffer );
+		chan->unsentBuffer = NULL;
+	}
+	chan->unsentFragments = qfalse;
+}
+
+
+/*
+===============
+Netchan_PoolInfo_f
+===============
+*/
+static void Netchan_PoolInfo_f( void ) {
+	Com_Printf( "fragment buffers: %i in use, %i peak, %i cached, limit %i\n",
+		poolInUse, poolPeak, poolNumFree, net_fragmentBuffers->integer );
+	Com_Printf( "%i KB allocated, %i requests failed\n",
+		( poolInUse + poolNumFree ) * ( MAX_MSGLEN / 1024 ), poolExhausted );
+}
+
 /*
 ===============
 Netchan_Init
@@ -69,6 +192,11 @@ void Netchan_Init( int port ) {
 	showpackets = Cvar_Get ("showpackets", "0", 0 );
 	showdrop = Cvar_Get ("showdrop", "0", 0 );
 	qport = Cvar_Get ("net_qport", va("%i", port), 0 );
+
+	// every client channel may be reassembling one message while sending another
+	net_fragmentBuffers = Cvar_Get( "net_fragmentBuffers", va( "%i", MAX_CLIENTS * 2 ), 0 );
+
+	Cmd_AddCommand( "netchan_pool", Netchan_PoolInfo_f );
 }
 
 
@@ -81,6 +209,8 @@ called to open a channel to a remote system
 */
 void Netchan_Setup( netsrc_t sock, netchan_t *chan, const netadr_t *adr, int port, int challenge )
 {
+	Netchan_Release( chan );
+
 	Com_Memset (chan, 0, sizeof(*chan));
 	
 	chan->sock = sock;
@@ -131,6 +261,7 @@ void Netchan_TransmitNextFragment( netchan_t *chan ) {
 
 	// send the datagram
 	NET_SendPacket( chan->sock, send.cursize, send.data, &chan->remoteAddress );
+	chan->fragmentsSent++;
 
 	// Store send time and size of this packet for rate control
 	chan->lastSentTime = Sys_Milliseconds();
@@ -231,6 +362,21 @@ void Netchan_Transmit( netchan_t *chan, int length, const byte *data ) {
 	if ( length >= FRAGMENT_SIZE ) {
 		chan->unsentFragments = qtrue;
 		chan->unsentLength = length;
+
+		if ( !chan->unsentBuffer ) {
+			chan->unsentBuffer = Netchan_AllocBuffer( qtrue );
+		}
+
+		if ( !chan->unsentBuffer ) {
+			// out of memory, send all fragments right away
+			chan->unsentBuffer = (byte *)data;
+			while ( chan->unsentFragments ) {
+				Netchan_TransmitNextFragment( chan );
+			}
+			chan->unsentBuffer = NULL;
+			return;
+		}
+
 		Com_Memcpy( chan->unsentBuffer, data, length );
 
 		// only send the first fragment now
@@ -238,6 +384,12 @@ void Netchan_Transmit( netchan_t *chan, int length, const byte *data ) {
 		return;
 	}
 
+	// previous fragmented message is done, return its buffer
+	if ( chan->unsentBuffer ) {
+		Netchan_FreeBuffer( chan->unsentBuffer );
+		chan->unsentBuffer = NULL;
+	}
+
 	// write the packet header
 	MSG_InitOOB( &send, send_buf, sizeof(send_buf)-8 );
 
@@ -389,6 +541,7 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 				,  sequence
 				, chan->incomingSequence );
 		}
+		chan->outOfOrder++;
 		return qfalse;
 	}
 
@@ -397,6 +550,7 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 	//
 	chan->dropped = sequence - (chan->incomingSequence+1);
 	if ( chan->dropped > 0 ) {
+		chan->droppedTotal += chan->dropped;
 		if ( showdrop->integer || showpackets->integer ) {
 			Com_Printf( "%s:Dropped %i packets at %i\n"
 			, NET_AdrToString( &chan->remoteAddress )
@@ -421,20 +575,42 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 			chan->fragmentLength = 0;
 		}
 
-		// if we missed a fragment, dump the message
-		if ( fragmentStart != chan->fragmentLength ) {
+		// fragments are never resent, a gap means this message can't be
+		// completed so don't keep its buffer until the next fragmented one
+		if ( fragmentStart > chan->fragmentLength ) {
 			if ( showdrop->integer || showpackets->integer ) {
 				Com_Printf( "%s:Dropped a message fragment\n"
 				, NET_AdrToString( &chan->remoteAddress ));
 			}
-			// we can still keep the part that we have so far,
-			// so we don't need to clear chan->fragmentLength
+			if ( chan->fragmentBuffer ) {
+				Netchan_FreeBuffer( chan->fragmentBuffer );
+				chan->fragmentBuffer = NULL;
+			}
+			chan->fragmentLength = 0;
+			return qfalse;
+		}
+
+		if ( !chan->fragmentBuffer ) {
+			chan->fragmentBuffer = Netchan_AllocBuffer( qfalse );
+			if ( !chan->fragmentBuffer ) {
+				// pool exhausted, the message is dropped like one missing a fragment
+				if ( showdrop->integer || showpackets->integer ) {
+					Com_Printf( "%s:no fragment buffer available\n"
+					, NET_AdrToString( &chan->remoteAddress ) );
+				}
+				chan->fragmentLength = 0;
+				return qfalse;
+			}
+		}
+
+		// duplicated fragment, keep the part that we have so far
+		if ( fragmentStart != chan->fragmentLength ) {
 			return qfalse;
 		}
 
 		// copy the fragment to the fragment buffer
 		if ( fragmentLength < 0 || msg->readcount + fragmentLength > msg->cursize ||
-			chan->fragmentLength + fragmentLength > sizeof( chan->fragmentBuffer ) ) {
+			chan->fragmentLength + fragmentLength > MAX_MSGLEN ) {
 			if ( showdrop->integer || showpackets->integer ) {
 				Com_Printf ("%s:illegal fragment length\n"
 				, NET_AdrToString( &chan->remoteAddress ) );
@@ -467,6 +643,9 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 		Com_Memcpy( msg->data + 4, chan->fragmentBuffer, chan->fragmentLength );
 		msg->cursize = chan->fragmentLength + 4;
 		chan->fragmentLength = 0;
+
+		Netchan_FreeBuffer( chan->fragmentBuffer );
+		chan->fragmentBuffer = NULL;
 		msg->readcount = 4;	// past the sequence number
 		msg->bit = 32;	// past the sequence number
 
@@ -477,6 +656,13 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 		return qtrue;
 	}
 
+	// a newer unfragmented message means a partial one will never complete
+	if ( chan->fragmentBuffer ) {
+		Netchan_FreeBuffer( chan->fragmentBuffer );
+		chan->fragmentBuffer = NULL;
+		chan->fragmentLength = 0;
+	}
+
 	//
 	// the message can now be read from the current message pointer
 	//
@@ -667,6 +853,21 @@ void NET_FlushPacketQueue( int time_diff )
 }
 
 
+/*
+=================
+NET_SetSendSink
+
+Redirects all outgoing packets to sink instead of the sockets,
+used to replay captured traffic, NULL restores normal sending
+=================
+*/
+static netSendSink_t sendSink;
+
+void NET_SetSendSink( netSendSink_t sink ) {
+	sendSink = sink;
+}
+
+
 void NET_SendPacket( netsrc_t sock, int length, const void *data, const netadr_t *to ) {
 
 	// sequenced packets are shown in netchan, so just show oob
@@ -680,6 +881,10 @@ void NET_SendPacket( netsrc_t sock, int length, const void *data, const netadr_t
 	if ( to->type == NA_BAD ) {
 		return;
 	}
+	if ( sendSink ) {
+		sendSink( sock, length, data, to );
+		return;
+	}
 #ifndef DEDICATED
 	if ( sock == NS_CLIENT && cl_packetdelay->integer > 0 ) {
 		NET_QueuePacket( sock, length, data, to, cl_packetdelay->integer );
@@ -20,6 +20,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 ===========================================================================
 */
 
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE // recvmmsg/sendmmsg
+#endif
+
 #include "../qcommon/q_shared.h"
 #include "../qcommon/qcommon.h"
 
@@ -101,6 +105,22 @@ typedef int SOCKET;
 typedef int	ioctlarg_t;
 #	define socketError			errno
 
+#	ifdef USE_NET_THREAD
+#		include <pthread.h>
+#		include <poll.h>
+#		include <fcntl.h>
+#		ifdef SO_REUSEPORT
+#			define USE_REUSEPORT
+#		endif
+#	endif
+
+#	ifdef __linux__
+#		define USE_MMSG
+#		define USE_EPOLL
+#		include <sys/epoll.h>
+#		include <sys/timerfd.h>
+#	endif
+
 #endif
 
 typedef union {
@@ -175,6 +195,29 @@ static cvar_t	*net_mcast6addr;
 static cvar_t	*net_mcast6iface;
 #endif
 static cvar_t	*net_dropsim;
+#ifdef USE_MMSG
+static cvar_t	*net_mmsg;
+#endif
+#ifdef USE_NET_THREAD
+static cvar_t	*net_thread;
+#endif
+#ifdef USE_REUSEPORT
+static cvar_t	*net_shards;
+
+typedef enum {
+	REUSEPORT_NONE,
+	REUSEPORT_FIRST,	// first listener, fails if port group exists already
+	REUSEPORT_JOIN
+} reusePort_t;
+
+static reusePort_t reusePort;
+#endif
+#ifdef USE_EPOLL
+static cvar_t	*net_epoll;
+
+static int		epoll_fd = -1;
+static int		timer_fd = -1;
+#endif
 
 static sockaddr_t socksRelayAddr;
 
@@ -554,87 +597,1036 @@ qboolean NET_CompareBaseAdrMask( const netadr_t *a, const netadr_t *b, unsigned
 
 
 /*
-===================
-NET_CompareBaseAdr
+===================
+NET_CompareBaseAdr
+
+Compares without the port
+===================
+*/
+qboolean NET_CompareBaseAdr( const netadr_t *a, const netadr_t *b )
+{
+	return NET_CompareBaseAdrMask( a, b, ~0U );
+}
+
+
+const char *NET_AdrToString( const netadr_t *a )
+{
+	static char s[NET_ADDRSTRMAXLEN];
+
+	if (a->type == NA_LOOPBACK)
+		strcpy( s, "loopback" );
+	else if (a->type == NA_BOT)
+		strcpy( s, "bot" );
+#ifdef USE_IPV6
+	else if (a->type == NA_IP || a->type == NA_IP6)
+#else
+	else if (a->type == NA_IP)
+#endif
+	{
+		sockaddr_t sadr;
+		NetadrToSockadr( a, &sadr );
+		Sys_SockaddrToString( s, sizeof(s), &sadr );
+	}
+
+	return s;
+}
+
+
+const char *NET_AdrToStringwPort( const netadr_t *a )
+{
+	static char s[NET_ADDRSTRMAXLEN];
+
+	if (a->type == NA_LOOPBACK)
+		strcpy( s, "loopback" );
+	else if (a->type == NA_BOT)
+		strcpy( s, "bot" );
+	else if(a->type == NA_IP)
+		Com_sprintf(s, sizeof(s), "%s:%hu", NET_AdrToString(a), ntohs(a->port));
+#ifdef USE_IPV6
+	else if(a->type == NA_IP6)
+		Com_sprintf(s, sizeof(s), "[%s]:%hu", NET_AdrToString(a), ntohs(a->port));
+#endif
+
+	return s;
+}
+
+
+qboolean NET_CompareAdr( const netadr_t *a, const netadr_t *b )
+{
+	if ( !NET_CompareBaseAdr( a, b ) )
+		return qfalse;
+
+#ifdef USE_IPV6
+	if (a->type == NA_IP || a->type == NA_IP6)
+#else
+	if (a->type == NA_IP)
+#endif
+	{
+		if (a->port == b->port)
+			return qtrue;
+	}
+	else
+		return qtrue;
+		
+	return qfalse;
+}
+
+
+qboolean NET_IsLocalAddress( const netadr_t *adr ) 
+{
+	return adr->type == NA_LOOPBACK;
+}
+
+//=============================================================================
+
+#ifdef USE_MMSG
+/*
+=============================================================================
+
+BATCHED I/O
+
+Linux can move many datagrams per syscall with recvmmsg/sendmmsg, incoming
+packets are drained into a batch and handed out one by one, outgoing packets
+are collected between Sys_BeginPacketBatch and Sys_EndPacketBatch
+
+=============================================================================
+*/
+
+#define MMSG_BATCH	32
+
+typedef struct {
+	struct mmsghdr	hdr[ MMSG_BATCH ];
+	struct iovec	iov[ MMSG_BATCH ];
+	sockaddr_t		addr[ MMSG_BATCH ];
+	byte			data[ MMSG_BATCH ][ MAX_PACKETLEN ];
+	int				count;
+	int				next;	// next received packet to process
+} mmsgBatch_t;
+
+static mmsgBatch_t	ip_recv, ip_send;
+#ifdef USE_IPV6
+static mmsgBatch_t	ip6_recv, ip6_send;
+#endif
+
+static qboolean mmsgBroken;	// not supported by kernel
+static qboolean mmsgSending;
+
+
+/*
+==================
+NET_ResetBatches
+==================
+*/
+static void NET_ResetBatches( void )
+{
+	ip_recv.count = ip_recv.next = 0;
+	ip_send.count = 0;
+#ifdef USE_IPV6
+	ip6_recv.count = ip6_recv.next = 0;
+	ip6_send.count = 0;
+#endif
+}
+
+
+/*
+==================
+NET_RecvBatch
+
+Returns next packet from the batch, refills it when empty
+==================
+*/
+static int NET_RecvBatch( SOCKET s, mmsgBatch_t *b, void *buf, int len, sockaddr_t *from, socklen_t *fromlen )
+{
+	const struct mmsghdr *h;
+	int i, ret;
+
+	if ( b->next >= b->count ) {
+		b->next = b->count = 0;
+		for ( i = 0; i < MMSG_BATCH; i++ ) {
+			b->iov[i].iov_base = b->data[i];
+			b->iov[i].iov_len = sizeof( b->data[i] );
+			memset( &b->hdr[i], 0, sizeof( b->hdr[i] ) );
+			b->hdr[i].msg_hdr.msg_name = &b->addr[i];
+			b->hdr[i].msg_hdr.msg_namelen = sizeof( b->addr[i] );
+			b->hdr[i].msg_hdr.msg_iov = &b->iov[i];
+			b->hdr[i].msg_hdr.msg_iovlen = 1;
+		}
+		ret = recvmmsg( s, b->hdr, MMSG_BATCH, MSG_DONTWAIT, NULL );
+		if ( ret <= 0 ) {
+			if ( ret == 0 )
+				errno = EAGAIN;
+			return SOCKET_ERROR;
+		}
+		b->count = ret;
+	}
+
+	h = &b->hdr[ b->next ];
+	*fromlen = h->msg_hdr.msg_namelen;
+	memcpy( from, &b->addr[ b->next ], sizeof( *from ) );
+
+	ret = h->msg_len;
+	if ( ( h->msg_hdr.msg_flags & MSG_TRUNC ) || ret > len ) {
+		ret = len; // will be reported as oversize
+	} else {
+		memcpy( buf, b->data[ b->next ], ret );
+	}
+
+	b->next++;
+
+	return ret;
+}
+
+
+/*
+==================
+NET_FlushBatch
+
+Errors are printed unless counted by the caller
+==================
+*/
+static void NET_FlushBatch( SOCKET s, mmsgBatch_t *b, unsigned int *errors )
+{
+	int sent, ret;
+
+	sent = 0;
+	while ( sent < b->count ) {
+		ret = sendmmsg( s, b->hdr + sent, b->count - sent, 0 );
+		if ( ret <= 0 ) {
+			if ( errno == EINTR )
+				continue;
+			if ( errno == ENOSYS ) {
+				mmsgBroken = qtrue;
+			} else if ( errno != EAGAIN ) {
+				if ( errors )
+					( *errors )++;
+				else
+					Com_Printf( "Sys_SendPacket: %s\n", NET_ErrorString() );
+			}
+			// error belongs to the first datagram, skip it
+			sent++;
+			continue;
+		}
+		sent += ret;
+	}
+
+	b->count = 0;
+}
+
+
+/*
+==================
+NET_QueueBatch
+==================
+*/
+static void NET_QueueBatch( SOCKET s, mmsgBatch_t *b, const void *data, int length, const sockaddr_t *addr, socklen_t addrlen, unsigned int *errors )
+{
+	struct mmsghdr *h;
+
+	if ( b->count >= MMSG_BATCH ) {
+		NET_FlushBatch( s, b, errors );
+	}
+
+	memcpy( b->data[ b->count ], data, length );
+	memcpy( &b->addr[ b->count ], addr, addrlen );
+
+	b->iov[ b->count ].iov_base = b->data[ b->count ];
+	b->iov[ b->count ].iov_len = length;
+
+	h = &b->hdr[ b->count ];
+	memset( h, 0, sizeof( *h ) );
+	h->msg_hdr.msg_name = &b->addr[ b->count ];
+	h->msg_hdr.msg_namelen = addrlen;
+	h->msg_hdr.msg_iov = &b->iov[ b->count ];
+	h->msg_hdr.msg_iovlen = 1;
+
+	b->count++;
+}
+#endif // USE_MMSG
+
+
+#ifdef USE_MMSG
+static int NET_RecvFromBatch( SOCKET s, mmsgBatch_t *b, void *buf, int len, sockaddr_t *from, socklen_t *fromlen );
+#endif
+
+/*
+==================
+NET_RecvFrom
+==================
+*/
+static int NET_RecvFrom( SOCKET s, void *buf, int len, sockaddr_t *from, socklen_t *fromlen )
+{
+#ifdef USE_MMSG
+	if ( s == ip_socket )
+		return NET_RecvFromBatch( s, &ip_recv, buf, len, from, fromlen );
+#ifdef USE_IPV6
+	if ( s == ip6_socket )
+		return NET_RecvFromBatch( s, &ip6_recv, buf, len, from, fromlen );
+#endif
+#endif
+
+	*fromlen = sizeof( *from );
+	return recvfrom( s, buf, len, 0, (struct sockaddr *) from, fromlen );
+}
+
+
+#ifdef USE_MMSG
+/*
+==================
+NET_RecvFromBatch
+==================
+*/
+static int NET_RecvFromBatch( SOCKET s, mmsgBatch_t *b, void *buf, int len, sockaddr_t *from, socklen_t *fromlen )
+{
+	int ret;
+
+	// always drain already received packets
+	if ( b->next < b->count || ( net_mmsg->integer && !mmsgBroken ) ) {
+		ret = NET_RecvBatch( s, b, buf, len, from, fromlen );
+		if ( ret != SOCKET_ERROR || errno != ENOSYS )
+			return ret;
+		mmsgBroken = qtrue;
+	}
+
+	*fromlen = sizeof( *from );
+	return recvfrom( s, buf, len, 0, (struct sockaddr *) from, fromlen );
+}
+#endif
+
+
+#ifdef USE_NET_THREAD
+/*
+=============================================================================
+
+NETWORK THREAD
+
+Optional thread owning the sockets on dedicated servers, it receives,
+timestamps and pre-filters datagrams while the frame runs and sends the
+frame output. Both directions use single-producer/single-consumer rings
+of variable length records, main thread is woken through a pipe.
+
+With net_shards > 1 additional IPv4 listeners are bound to the same port
+with SO_REUSEPORT, each drained by its own thread. The kernel keeps every
+remote address on one shard so per-client packet order is preserved,
+connectionless queries are answered by the shard itself.
+
+=============================================================================
+*/
+
+#define NET_RING_SIZE		( 1 << 22 )
+#define NET_RING_MASK		( NET_RING_SIZE - 1 )
+#define NET_RECORD_SIZE(x)	( ( sizeof( netRecord_t ) + (x) + 7 ) & ~7 )
+
+typedef struct {
+	int			length;		// -1 marks wrap to the ring start
+	int			time;		// Sys_Milliseconds() at receive
+	netadr_t	adr;
+} netRecord_t;
+
+typedef struct {
+	unsigned int	head;		// written by producer only
+	byte			pad0[ 64 - sizeof( int ) ];
+	unsigned int	tail;		// written by consumer only
+	byte			pad1[ 64 - sizeof( int ) ];
+	byte			data[ NET_RING_SIZE ];
+} netRing_t;
+
+typedef struct {
+	pthread_t		thread;
+	SOCKET			socket;		// SO_REUSEPORT listener, shard 0 drains ip_socket and ip6_socket
+	netRing_t		in;
+#ifdef USE_MMSG
+	mmsgBatch_t		recv;
+#endif
+	byte			buf[ MAX_MSGLEN_BUF ];
+	byte			reply[ MAX_PACKETLEN ];
+
+	// written by shard thread
+	unsigned int	received;
+	unsigned int	filtered;
+	unsigned int	answered;
+	unsigned int	overflows;
+	unsigned int	oversize;
+} netShard_t;
+
+static struct {
+	qboolean		running;
+	int				quit;
+	int				numShards;
+	int				wakeMain[2];	// network threads -> main thread
+	int				wakeNet[2];		// main thread -> shard 0
+	qboolean		batching;		// delay wake-up until Sys_EndPacketBatch
+	qboolean		pending;
+	netRing_t		out;
+
+	// written by shard 0
+	unsigned int	sent;
+	unsigned int	sendErrors;
+
+	// written by main thread
+	unsigned int	processed;
+	unsigned int	directSends;
+	int				maxLatency;
+} netThread;
+
+static netShard_t	netShards[ NET_MAX_SHARDS ];
+static int			numShardSockets;	// extra listeners in netShards[1..]
+
+
+/*
+==================
+NET_RingPush
+==================
+*/
+static qboolean NET_RingPush( netRing_t *r, const netadr_t *adr, int time, const void *data, int length )
+{
+	const unsigned int need = NET_RECORD_SIZE( length );
+	const unsigned int tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+	unsigned int head = r->head;
+	unsigned int contig = NET_RING_SIZE - ( head & NET_RING_MASK );
+	netRecord_t *rec;
+
+	if ( contig < need ) {
+		// skip the ring end
+		if ( head + contig + need - tail > NET_RING_SIZE )
+			return qfalse;
+		if ( contig >= sizeof( netRecord_t ) ) {
+			rec = (netRecord_t *)( r->data + ( head & NET_RING_MASK ) );
+			rec->length = -1;
+		}
+		head += contig;
+	} else if ( head + need - tail > NET_RING_SIZE ) {
+		return qfalse;
+	}
+
+	rec = (netRecord_t *)( r->data + ( head & NET_RING_MASK ) );
+	rec->length = length;
+	rec->time = time;
+	rec->adr = *adr;
+	memcpy( rec + 1, data, length );
+
+	__atomic_store_n( &r->head, head + need, __ATOMIC_RELEASE );
+
+	return qtrue;
+}
+
+
+/*
+==================
+NET_RingPeek
+
+Returns oldest record or NULL if the ring is empty
+==================
+*/
+static const netRecord_t *NET_RingPeek( netRing_t *r )
+{
+	const unsigned int head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+	unsigned int contig;
+	const netRecord_t *rec;
+
+	while ( r->tail != head ) {
+		contig = NET_RING_SIZE - ( r->tail & NET_RING_MASK );
+		rec = (const netRecord_t *)( r->data + ( r->tail & NET_RING_MASK ) );
+		if ( contig < sizeof( netRecord_t ) || rec->length < 0 ) {
+			__atomic_store_n( &r->tail, r->tail + contig, __ATOMIC_RELEASE );
+			continue;
+		}
+		return rec;
+	}
+
+	return NULL;
+}
+
+
+/*
+==================
+NET_RingPop
+==================
+*/
+static void NET_RingPop( netRing_t *r, const netRecord_t *rec )
+{
+	__atomic_store_n( &r->tail, r->tail + NET_RECORD_SIZE( rec->length ), __ATOMIC_RELEASE );
+}
+
+
+/*
+==================
+NET_WakePipe
+==================
+*/
+static void NET_WakePipe( int fd )
+{
+	const byte b = 0;
+
+	// full pipe is already signaled
+	if ( write( fd, &b, 1 ) < 0 ) {
+	}
+}
+
+
+/*
+==================
+NET_DrainPipe
+==================
+*/
+static void NET_DrainPipe( int fd )
+{
+	byte buf[64];
+
+	while ( read( fd, buf, sizeof( buf ) ) > 0 )
+		;
+}
+
+
+/*
+==================
+NET_ThreadRecv
+
+Network thread, reads socket until it would block
+==================
+*/
+static qboolean NET_ThreadRecv( netShard_t *shard, SOCKET s )
+{
+	sockaddr_t	from;
+	socklen_t	fromlen;
+	netadr_t	adr;
+	qboolean	pushed;
+	int			ret, reply;
+
+	pushed = qfalse;
+
+	for ( ;; ) {
+#ifdef USE_MMSG
+		if ( s == shard->socket )
+			ret = NET_RecvFromBatch( s, &shard->recv, shard->buf, MAX_MSGLEN, &from, &fromlen );
+		else
+#endif
+		ret = NET_RecvFrom( s, shard->buf, MAX_MSGLEN, &from, &fromlen );
+		if ( ret == SOCKET_ERROR ) {
+			if ( socketError == ECONNRESET || socketError == EINTR )
+				continue;
+			break;
+		}
+
+		if ( from.ss.ss_family == AF_INET )
+			memset( &from.v4.sin_zero, 0, sizeof( from.v4.sin_zero ) );
+
+		adr.type = NA_BAD;
+		SockadrToNetadr( &from, &adr );
+
+		if ( ret >= MAX_MSGLEN ) {
+			shard->oversize++;
+			continue;
+		}
+
+		shard->received++;
+
+		reply = SV_NetThreadPacket( shard - netShards, &adr, shard->buf, ret, shard->reply, sizeof( shard->reply ) );
+		if ( reply < 0 ) {
+			shard->filtered++;
+			continue;
+		}
+
+		if ( reply > 0 ) {
+			sendto( s, (const void *)shard->reply, reply, 0, (struct sockaddr *) &from, fromlen );
+			shard->answered++;
+			continue;
+		}
+
+		if ( NET_RingPush( &shard->in, &adr, Sys_Milliseconds(), shard->buf, ret ) )
+			pushed = qtrue;
+		else
+			shard->overflows++;
+	}
+
+	return pushed;
+}
+
+
+/*
+==================
+NET_ThreadSend
+
+Network thread, sends everything queued by main thread
+==================
+*/
+static void NET_ThreadSend( void )
+{
+	const netRecord_t *rec;
+	sockaddr_t addr;
+	SOCKET s;
+	int ret;
+#ifdef USE_MMSG
+	const qboolean batch = net_mmsg->integer && !mmsgBroken;
+#endif
+
+	while ( ( rec = NET_RingPeek( &netThread.out ) ) != NULL ) {
+		NetadrToSockadr( &rec->adr, &addr );
+		if ( addr.ss.ss_family == AF_INET )
+			s = ip_socket;
+#ifdef USE_IPV6
+		else if ( addr.ss.ss_family == AF_INET6 )
+			s = ip6_socket;
+#endif
+		else
+			s = INVALID_SOCKET;
+
+		if ( s != INVALID_SOCKET ) {
+			netThread.sent++;
+#ifdef USE_MMSG
+			if ( batch && rec->length <= MAX_PACKETLEN ) {
+				if ( s == ip_socket )
+					NET_QueueBatch( s, &ip_send, rec + 1, rec->length, &addr, sizeof( struct sockaddr_in ), &netThread.sendErrors );
+#ifdef USE_IPV6
+				else
+					NET_QueueBatch( s, &ip6_send, rec + 1, rec->length, &addr, sizeof( struct sockaddr_in6 ), &netThread.sendErrors );
+#endif
+				NET_RingPop( &netThread.out, rec );
+				continue;
+			}
+#endif
+			ret = sendto( s, (const void *)( rec + 1 ), rec->length, 0, (struct sockaddr *) &addr,
+				addr.ss.ss_family == AF_INET ? sizeof( struct sockaddr_in ) : sizeof( struct sockaddr_in6 ) );
+			if ( ret == SOCKET_ERROR && socketError != EAGAIN )
+				netThread.sendErrors++;
+		}
+
+		NET_RingPop( &netThread.out, rec );
+	}
+
+#ifdef USE_MMSG
+	if ( ip_send.count )
+		NET_FlushBatch( ip_socket, &ip_send, &netThread.sendErrors );
+#ifdef USE_IPV6
+	if ( ip6_send.count )
+		NET_FlushBatch( ip6_socket, &ip6_send, &netThread.sendErrors );
+#endif
+#endif
+}
+
+
+/*
+==================
+NET_ThreadMain
+==================
+*/
+static void *NET_ThreadMain( void *arg )
+{
+	struct pollfd fds[3];
+	qboolean pushed;
+	int i, n;
+
+	while ( !__atomic_load_n( &netThread.quit, __ATOMIC_ACQUIRE ) ) {
+		n = 0;
+		fds[n].fd = netThread.wakeNet[0];
+		fds[n++].events = POLLIN;
+		if ( ip_socket != INVALID_SOCKET ) {
+			fds[n].fd = ip_socket;
+			fds[n++].events = POLLIN;
+		}
+#ifdef USE_IPV6
+		if ( ip6_socket != INVALID_SOCKET ) {
+			fds[n].fd = ip6_socket;
+			fds[n++].events = POLLIN;
+		}
+#endif
+		for ( i = 0; i < n; i++ )
+			fds[i].revents = 0;
+
+		if ( poll( fds, n, 100 ) <= 0 )
+			continue;
+
+		if ( fds[0].revents )
+			NET_DrainPipe( netThread.wakeNet[0] );
+
+		// flush frame output first
+		NET_ThreadSend();
+
+		pushed = qfalse;
+		for ( i = 1; i < n; i++ ) {
+			if ( fds[i].revents & POLLIN ) {
+				pushed |= NET_ThreadRecv( &netShards[0], fds[i].fd );
+			}
+		}
+
+		if ( pushed ) {
+			NET_WakePipe( netThread.wakeMain[1] );
+		}
+	}
+
+	NET_ThreadSend();
+
+	return NULL;
+}
+
+
+/*
+==================
+NET_ShardMain
+
+Receive worker of an additional SO_REUSEPORT listener
+==================
+*/
+static void *NET_ShardMain( void *arg )
+{
+	netShard_t *shard = (netShard_t *)arg;
+	struct pollfd fd;
+
+	while ( !__atomic_load_n( &netThread.quit, __ATOMIC_ACQUIRE ) ) {
+		fd.fd = shard->socket;
+		fd.events = POLLIN;
+		fd.revents = 0;
+
+		if ( poll( &fd, 1, 100 ) <= 0 )
+			continue;
+
+		if ( ( fd.revents & POLLIN ) && NET_ThreadRecv( shard, shard->socket ) ) {
+			NET_WakePipe( netThread.wakeMain[1] );
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+==================
+NET_OpenPipe
+==================
+*/
+static qboolean NET_OpenPipe( int *fds )
+{
+	if ( pipe( fds ) == -1 )
+		return qfalse;
+
+	fcntl( fds[0], F_SETFL, O_NONBLOCK );
+	fcntl( fds[1], F_SETFL, O_NONBLOCK );
+	fcntl( fds[0], F_SETFD, FD_CLOEXEC );
+	fcntl( fds[1], F_SETFD, FD_CLOEXEC );
+
+	return qtrue;
+}
+
+
+/*
+==================
+NET_StopThread
+==================
+*/
+static void NET_StopThread( void )
+{
+	int i;
+
+	if ( !netThread.running )
+		return;
+
+	__atomic_store_n( &netThread.quit, 1, __ATOMIC_RELEASE );
+	NET_WakePipe( netThread.wakeNet[1] );
+	for ( i = 0; i < netThread.numShards; i++ ) {
+		pthread_join( netShards[i].thread, NULL );
+		netShards[i].in.head = netShards[i].in.tail = 0;
+	}
+
+	close( netThread.wakeMain[0] );
+	close( netThread.wakeMain[1] );
+	close( netThread.wakeNet[0] );
+	close( netThread.wakeNet[1] );
+
+	netThread.running = qfalse;
+	netThread.numShards = 0;
+	netThread.batching = qfalse;
+	netThread.pending = qfalse;
+	netThread.out.head = netThread.out.tail = 0;
+}
+
+
+/*
+==================
+NET_CloseShards
+==================
+*/
+static void NET_CloseShards( void )
+{
+	int i;
+
+	for ( i = 1; i <= numShardSockets; i++ ) {
+		closesocket( netShards[i].socket );
+		netShards[i].socket = INVALID_SOCKET;
+#ifdef USE_MMSG
+		netShards[i].recv.count = netShards[i].recv.next = 0;
+#endif
+	}
+
+	numShardSockets = 0;
+}
+
+
+/*
+==================
+NET_StartThread
+==================
+*/
+static void NET_StartThread( void )
+{
+	netShard_t *shard;
+	int i;
+
+	if ( netThread.running || ( ip_socket == INVALID_SOCKET && ip6_socket == INVALID_SOCKET ) )
+		return;
+
+	if ( !NET_OpenPipe( netThread.wakeMain ) ) {
+		Com_Printf( "WARNING: network thread pipe: %s\n", NET_ErrorString() );
+		return;
+	}
+
+	if ( !NET_OpenPipe( netThread.wakeNet ) ) {
+		Com_Printf( "WARNING: network thread pipe: %s\n", NET_ErrorString() );
+		close( netThread.wakeMain[0] );
+		close( netThread.wakeMain[1] );
+		return;
+	}
+
+	netThread.quit = 0;
+	netThread.out.head = netThread.out.tail = 0;
+	netThread.running = qtrue;
+
+	for ( i = 0; i <= numShardSockets; i++ ) {
+		shard = &netShards[i];
+		shard->in.head = shard->in.tail = 0;
+		if ( i == 0 ) {
+			shard->socket = INVALID_SOCKET;
+			if ( pthread_create( &shard->thread, NULL, NET_ThreadMain, NULL ) == 0 ) {
+				netThread.numShards++;
+				continue;
+			}
+		} else if ( pthread_create( &shard->thread, NULL, NET_ShardMain, shard ) == 0 ) {
+			netThread.numShards++;
+			continue;
+		}
+
+		Com_Printf( "WARNING: couldn't create network thread\n" );
+		break;
+	}
+
+	if ( netThread.numShards == 0 ) {
+		netThread.running = qfalse;
+		close( netThread.wakeMain[0] );
+		close( netThread.wakeMain[1] );
+		close( netThread.wakeNet[0] );
+		close( netThread.wakeNet[1] );
+		return;
+	}
+
+	if ( netThread.numShards > 1 ) {
+		Com_Printf( "Network thread running with %i listeners\n", netThread.numShards );
+	}
+}
+
+
+/*
+==================
+NET_ShardCount
+
+Returns number of running receive threads
+==================
+*/
+int NET_ShardCount( void )
+{
+	return netThread.running ? netThread.numShards : 0;
+}
+
+
+/*
+==================
+NET_ThreadQueueSend
+
+Main thread, hands datagram over to the network thread
+==================
+*/
+static qboolean NET_ThreadQueueSend( int length, const void *data, const netadr_t *to )
+{
+	if ( length > NET_RING_SIZE / 4 || !NET_RingPush( &netThread.out, to, 0, data, length ) ) {
+		netThread.directSends++;
+		return qfalse;
+	}
+
+	if ( netThread.batching )
+		netThread.pending = qtrue;
+	else
+		NET_WakePipe( netThread.wakeNet[1] );
+
+	return qtrue;
+}
+
+
+/*
+==================
+NET_ShardEvent
+
+Main thread, processes datagrams received by one listener
+==================
+*/
+static void NET_ShardEvent( netShard_t *shard )
+{
+	byte bufData[ MAX_MSGLEN_BUF ];
+	const netRecord_t *rec;
+	netadr_t from;
+	msg_t netmsg;
+	int latency;
+
+	while ( ( rec = NET_RingPeek( &shard->in ) ) != NULL ) {
+		MSG_Init( &netmsg, bufData, MAX_MSGLEN );
+		memcpy( bufData, rec + 1, rec->length );
+		netmsg.cursize = rec->length;
+		from = rec->adr;
+
+		latency = Sys_Milliseconds() - rec->time;
+		if ( latency > netThread.maxLatency )
+			netThread.maxLatency = latency;
+
+		NET_RingPop( &shard->in, rec );
+		netThread.processed++;
+
+		if ( net_dropsim->value > 0.0f && net_dropsim->value <= 100.0f ) {
+			if ( rand() < (int) (((double) RAND_MAX) / 100.0 * (double) net_dropsim->value) )
+				continue; // drop this packet
+		}
+
+		Com_RunAndTimeServerPacket( &from, &netmsg );
+	}
+}
+
+
+/*
+==================
+NET_ThreadEvent
 
-Compares without the port
-===================
+Main thread, processes datagrams received by the network threads
+==================
 */
-qboolean NET_CompareBaseAdr( const netadr_t *a, const netadr_t *b )
+static void NET_ThreadEvent( void )
 {
-	return NET_CompareBaseAdrMask( a, b, ~0U );
+	int i;
+
+	NET_DrainPipe( netThread.wakeMain[0] );
+
+	for ( i = 0; i < netThread.numShards; i++ ) {
+		NET_ShardEvent( &netShards[i] );
+	}
 }
 
 
-const char *NET_AdrToString( const netadr_t *a )
+/*
+==================
+NET_SleepThread
+
+Main thread, waits for network thread to signal received datagrams
+==================
+*/
+static qboolean NET_SleepThread( int timeout )
 {
-	static char s[NET_ADDRSTRMAXLEN];
+	struct timeval tv;
+	fd_set fdr;
+	int retval;
 
-	if (a->type == NA_LOOPBACK)
-		strcpy( s, "loopback" );
-	else if (a->type == NA_BOT)
-		strcpy( s, "bot" );
-#ifdef USE_IPV6
-	else if (a->type == NA_IP || a->type == NA_IP6)
-#else
-	else if (a->type == NA_IP)
-#endif
-	{
-		sockaddr_t sadr;
-		NetadrToSockadr( a, &sadr );
-		Sys_SockaddrToString( s, sizeof(s), &sadr );
+	FD_ZERO( &fdr );
+	FD_SET( netThread.wakeMain[0], &fdr );
+
+	tv.tv_sec = timeout / 1000000;
+	tv.tv_usec = timeout - tv.tv_sec * 1000000;
+
+	retval = select( netThread.wakeMain[0] + 1, &fdr, NULL, NULL, &tv );
+
+	if ( retval > 0 ) {
+		NET_ThreadEvent();
+		return qfalse;
 	}
 
-	return s;
+	return qtrue;
 }
 
 
-const char *NET_AdrToStringwPort( const netadr_t *a )
+/*
+==================
+NET_ThreadStats_f
+==================
+*/
+static void NET_ThreadStats_f( void )
 {
-	static char s[NET_ADDRSTRMAXLEN];
+	const netShard_t *shard;
+	int i;
 
-	if (a->type == NA_LOOPBACK)
-		strcpy( s, "loopback" );
-	else if (a->type == NA_BOT)
-		strcpy( s, "bot" );
-	else if(a->type == NA_IP)
-		Com_sprintf(s, sizeof(s), "%s:%hu", NET_AdrToString(a), ntohs(a->port));
-#ifdef USE_IPV6
-	else if(a->type == NA_IP6)
-		Com_sprintf(s, sizeof(s), "[%s]:%hu", NET_AdrToString(a), ntohs(a->port));
-#endif
+	if ( !netThread.running ) {
+		Com_Printf( "Network thread is not running.\n" );
+		return;
+	}
 
-	return s;
+	for ( i = 0; i < netThread.numShards; i++ ) {
+		shard = &netShards[i];
+		Com_Printf( "listener %i: received: %u, filtered: %u, answered: %u, ring overflows: %u, oversize: %u\n", i,
+			__atomic_load_n( &shard->received, __ATOMIC_RELAXED ),
+			__atomic_load_n( &shard->filtered, __ATOMIC_RELAXED ),
+			__atomic_load_n( &shard->answered, __ATOMIC_RELAXED ),
+			__atomic_load_n( &shard->overflows, __ATOMIC_RELAXED ),
+			__atomic_load_n( &shard->oversize, __ATOMIC_RELAXED ) );
+	}
+	Com_Printf( "processed: %u, max queue latency: %i msec\n", netThread.processed, netThread.maxLatency );
+	Com_Printf( "sent: %u, send errors: %u, direct sends: %u\n",
+		__atomic_load_n( &netThread.sent, __ATOMIC_RELAXED ),
+		__atomic_load_n( &netThread.sendErrors, __ATOMIC_RELAXED ),
+		netThread.directSends );
 }
+#endif // USE_NET_THREAD
 
 
-qboolean NET_CompareAdr( const netadr_t *a, const netadr_t *b )
-{
-	if ( !NET_CompareBaseAdr( a, b ) )
-		return qfalse;
+/*
+==================
+Sys_BeginPacketBatch
 
-#ifdef USE_IPV6
-	if (a->type == NA_IP || a->type == NA_IP6)
-#else
-	if (a->type == NA_IP)
-#endif
-	{
-		if (a->port == b->port)
-			return qtrue;
+Packets sent after this call may be delayed until Sys_EndPacketBatch
+==================
+*/
+void Sys_BeginPacketBatch( void )
+{
+#ifdef USE_NET_THREAD
+	if ( netThread.running ) {
+		netThread.batching = qtrue;
+		return;
 	}
-	else
-		return qtrue;
-		
-	return qfalse;
+#endif
+#ifdef USE_MMSG
+	mmsgSending = ( net_mmsg && net_mmsg->integer && !mmsgBroken && !usingSocks );
+#endif
 }
 
 
-qboolean NET_IsLocalAddress( const netadr_t *adr ) 
+/*
+==================
+Sys_EndPacketBatch
+==================
+*/
+void Sys_EndPacketBatch( void )
 {
-	return adr->type == NA_LOOPBACK;
+#ifdef USE_NET_THREAD
+	if ( netThread.running ) {
+		netThread.batching = qfalse;
+		if ( netThread.pending ) {
+			netThread.pending = qfalse;
+			NET_WakePipe( netThread.wakeNet[1] );
+		}
+		return;
+	}
+#endif
+#ifdef USE_MMSG
+	if ( ip_send.count )
+		NET_FlushBatch( ip_socket, &ip_send, NULL );
+#ifdef USE_IPV6
+	if ( ip6_send.count )
+		NET_FlushBatch( ip6_socket, &ip6_send, NULL );
+#endif
+	mmsgSending = qfalse;
+#endif
 }
 
-//=============================================================================
 
 /*
 ==================
@@ -652,8 +1644,7 @@ static qboolean NET_GetPacket( netadr_t *net_from, msg_t *net_message, const fd_
 
 	if(ip_socket != INVALID_SOCKET && FD_ISSET(ip_socket, fdr))
 	{
-		fromlen = sizeof(from);
-		ret = recvfrom( ip_socket, (void *)net_message->data, net_message->maxsize, 0, (struct sockaddr *) &from, &fromlen );
+		ret = NET_RecvFrom( ip_socket, net_message->data, net_message->maxsize, &from, &fromlen );
 
 		if (ret == SOCKET_ERROR)
 		{
@@ -697,8 +1688,7 @@ static qboolean NET_GetPacket( netadr_t *net_from, msg_t *net_message, const fd_
 #ifdef USE_IPV6
 	if(ip6_socket != INVALID_SOCKET && FD_ISSET(ip6_socket, fdr))
 	{
-		fromlen = sizeof(from);
-		ret = recvfrom(ip6_socket, (void *)net_message->data, net_message->maxsize, 0, (struct sockaddr *) &from, &fromlen);
+		ret = NET_RecvFrom( ip6_socket, net_message->data, net_message->maxsize, &from, &fromlen );
 
 		if (ret == SOCKET_ERROR)
 		{
@@ -796,6 +1786,13 @@ void Sys_SendPacket( int length, const void *data, const netadr_t *to ) {
 		return;
 #endif
 
+#ifdef USE_NET_THREAD
+	if ( netThread.running && ( to->type == NA_IP || to->type == NA_IP6 ) ) {
+		if ( NET_ThreadQueueSend( length, data, to ) )
+			return;
+	}
+#endif
+
 	NetadrToSockadr( to, &addr );
 
 	if ( usingSocks && to->type == NA_IP ) {
@@ -813,6 +1810,25 @@ void Sys_SendPacket( int length, const void *data, const netadr_t *to ) {
 		}
 	}
 	else {
+#ifdef USE_MMSG
+		if ( mmsgSending && to->type != NA_BROADCAST && to->type != NA_MULTICAST6 ) {
+			if ( length <= MAX_PACKETLEN ) {
+				if ( addr.ss.ss_family == AF_INET ) {
+					NET_QueueBatch( ip_socket, &ip_send, data, length, &addr, sizeof(struct sockaddr_in), NULL );
+					return;
+				}
+#ifdef USE_IPV6
+				if ( addr.ss.ss_family == AF_INET6 ) {
+					NET_QueueBatch( ip6_socket, &ip6_send, data, length, &addr, sizeof(struct sockaddr_in6), NULL );
+					return;
+				}
+#endif
+			}
+			// keep order with already queued packets
+			Sys_EndPacketBatch();
+			Sys_BeginPacketBatch();
+		}
+#endif
 		if ( addr.ss.ss_family == AF_INET )
 			ret = sendto( ip_socket, data, length, 0, (struct sockaddr *) &addr, sizeof(struct sockaddr_in) );
 #ifdef USE_IPV6
@@ -956,6 +1972,30 @@ void Sys_ShowIP( void ) {
 //=============================================================================
 
 
+#ifdef USE_REUSEPORT
+/*
+====================
+NET_PortInUse
+
+SO_REUSEPORT would let us silently join listeners of another process
+====================
+*/
+static qboolean NET_PortInUse( const struct sockaddr_in *address )
+{
+	SOCKET probe;
+	int ret;
+
+	if ( ( probe = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) == INVALID_SOCKET )
+		return qfalse;
+
+	ret = bind( probe, (const struct sockaddr *)address, sizeof( *address ) );
+	closesocket( probe );
+
+	return ( ret == SOCKET_ERROR ) ? qtrue : qfalse;
+}
+#endif
+
+
 /*
 ====================
 NET_IPSocket
@@ -1014,6 +2054,21 @@ static SOCKET NET_IPSocket( const char *net_interface, int port, int *err ) {
 		address.sin_port = htons( (short)port );
 	}
 
+#ifdef USE_REUSEPORT
+	if ( reusePort != REUSEPORT_NONE ) {
+		if ( reusePort == REUSEPORT_FIRST && NET_PortInUse( &address ) ) {
+			Com_Printf( "WARNING: NET_IPSocket: port %i is in use\n", port );
+			*err = EADDRINUSE;
+			closesocket( newsocket );
+			return INVALID_SOCKET;
+		}
+		// every listener of the group needs it before bind
+		if ( setsockopt( newsocket, SOL_SOCKET, SO_REUSEPORT, (char *) &i, sizeof(i) ) == SOCKET_ERROR ) {
+			Com_Printf( "WARNING: NET_IPSocket: setsockopt SO_REUSEPORT: %s\n", NET_ErrorString() );
+		}
+	}
+#endif
+
 	if( bind( newsocket, (void *)&address, sizeof(address) ) == SOCKET_ERROR ) {
 		Com_Printf( "WARNING: NET_IPSocket: bind: %s\n", NET_ErrorString() );
 		*err = socketError;
@@ -1511,6 +2566,190 @@ static void NET_GetLocalAddress( void ) {
 NET_OpenIP
 ====================
 */
+#ifdef USE_EPOLL
+static void NET_Event( const fd_set *fdr );
+
+/*
+====================
+NET_CloseEpoll
+====================
+*/
+static void NET_CloseEpoll( void )
+{
+	if ( timer_fd != -1 ) {
+		close( timer_fd );
+		timer_fd = -1;
+	}
+	if ( epoll_fd != -1 ) {
+		close( epoll_fd );
+		epoll_fd = -1;
+	}
+}
+
+
+/*
+====================
+NET_EpollAdd
+====================
+*/
+static qboolean NET_EpollAdd( int fd )
+{
+	struct epoll_event ev;
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	return epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev ) == 0 ? qtrue : qfalse;
+}
+
+
+/*
+====================
+NET_OpenEpoll
+
+Registers opened sockets and a timer for frame deadlines,
+NET_Sleep falls back to select() on any failure
+====================
+*/
+static void NET_OpenEpoll( void )
+{
+	NET_CloseEpoll();
+
+	epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+	if ( epoll_fd == -1 ) {
+		Com_Printf( "WARNING: epoll_create1: %s\n", NET_ErrorString() );
+		return;
+	}
+
+	timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	if ( timer_fd == -1 || !NET_EpollAdd( timer_fd ) ) {
+		Com_Printf( "WARNING: timerfd: %s\n", NET_ErrorString() );
+		NET_CloseEpoll();
+		return;
+	}
+
+#ifdef USE_NET_THREAD
+	// sockets are owned by network thread
+	if ( netThread.running ) {
+		if ( !NET_EpollAdd( netThread.wakeMain[0] ) ) {
+			Com_Printf( "WARNING: epoll_ctl: %s\n", NET_ErrorString() );
+			NET_CloseEpoll();
+		}
+		return;
+	}
+#endif
+
+	if ( ip_socket != INVALID_SOCKET && !NET_EpollAdd( ip_socket ) ) {
+		Com_Printf( "WARNING: epoll_ctl: %s\n", NET_ErrorString() );
+		NET_CloseEpoll();
+		return;
+	}
+
+#ifdef USE_IPV6
+	if ( ip6_socket != INVALID_SOCKET && !NET_EpollAdd( ip6_socket ) ) {
+		Com_Printf( "WARNING: epoll_ctl: %s\n", NET_ErrorString() );
+		NET_CloseEpoll();
+		return;
+	}
+#endif
+}
+
+
+/*
+====================
+NET_SleepEpoll
+
+Waits on the timer instead of epoll_wait() timeout
+to get microsecond wake-up precision
+====================
+*/
+static qboolean NET_SleepEpoll( int timeout )
+{
+	struct epoll_event events[4];
+	struct itimerspec its;
+	uint64_t expirations;
+	fd_set fdr;
+	int i, n;
+	qboolean readable;
+
+	if ( timeout > 0 ) {
+		memset( &its, 0, sizeof( its ) );
+		its.it_value.tv_sec = timeout / 1000000;
+		its.it_value.tv_nsec = ( timeout % 1000000 ) * 1000;
+		// resets pending expirations as well
+		timerfd_settime( timer_fd, 0, &its, NULL );
+		n = epoll_wait( epoll_fd, events, ARRAY_LEN( events ), -1 );
+	} else {
+		n = epoll_wait( epoll_fd, events, ARRAY_LEN( events ), 0 );
+	}
+
+	if ( n == -1 ) {
+		if ( errno != EINTR )
+			Com_Printf( S_COLOR_YELLOW "Warning: epoll_wait() syscall failed: %s\n", NET_ErrorString() );
+		return qtrue;
+	}
+
+	FD_ZERO( &fdr );
+	readable = qfalse;
+
+	for ( i = 0; i < n; i++ ) {
+		if ( events[i].data.fd == timer_fd ) {
+			if ( read( timer_fd, &expirations, sizeof( expirations ) ) < 0 ) {
+				// already consumed
+			}
+		}
+#ifdef USE_NET_THREAD
+		else if ( netThread.running && events[i].data.fd == netThread.wakeMain[0] ) {
+			NET_ThreadEvent();
+			return qfalse;
+		}
+#endif
+		else {
+			FD_SET( events[i].data.fd, &fdr );
+			readable = qtrue;
+		}
+	}
+
+	if ( readable ) {
+		NET_Event( &fdr );
+		return qfalse;
+	}
+
+	return qtrue;
+}
+#endif // USE_EPOLL
+
+
+#ifdef USE_REUSEPORT
+/*
+====================
+NET_OpenShards
+
+Binds additional IPv4 listeners to the port of ip_socket
+====================
+*/
+static void NET_OpenShards( int port )
+{
+	SOCKET s;
+	int err, count;
+
+	reusePort = REUSEPORT_JOIN;
+
+	count = net_shards->integer;
+	if ( count > NET_MAX_SHARDS )
+		count = NET_MAX_SHARDS;
+
+	while ( numShardSockets < count - 1 ) {
+		s = NET_IPSocket( net_ip->string, port, &err );
+		if ( s == INVALID_SOCKET )
+			break;
+		netShards[ ++numShardSockets ].socket = s;
+	}
+}
+#endif
+
+
 static void NET_OpenIP( void ) {
 	int		i;
 	int		err;
@@ -1553,6 +2792,10 @@ static void NET_OpenIP( void ) {
 
 	if(net_enabled->integer & NET_ENABLEV4)
 	{
+#ifdef USE_REUSEPORT
+		if ( net_thread->integer && net_shards->integer > 1 && !net_socksEnabled->integer )
+			reusePort = REUSEPORT_FIRST;
+#endif
 		for( i = 0 ; i < 10 ; i++ ) {
 			ip_socket = NET_IPSocket( net_ip->string, port + i, &err );
 			if (ip_socket != INVALID_SOCKET) {
@@ -1561,6 +2804,10 @@ static void NET_OpenIP( void ) {
 				if (net_socksEnabled->integer)
 					NET_OpenSocks( port + i );
 
+#ifdef USE_REUSEPORT
+				if ( reusePort != REUSEPORT_NONE )
+					NET_OpenShards( port + i );
+#endif
 				break;
 			}
 			else
@@ -1572,7 +2819,20 @@ static void NET_OpenIP( void ) {
 		
 		if(ip_socket == INVALID_SOCKET)
 			Com_Printf( "WARNING: Couldn't bind to a v4 ip address.\n");
+#ifdef USE_REUSEPORT
+		reusePort = REUSEPORT_NONE;
+#endif
 	}
+
+#ifdef USE_NET_THREAD
+	if ( net_thread->integer && !usingSocks )
+		NET_StartThread();
+#endif
+
+#ifdef USE_EPOLL
+	if ( net_epoll->integer )
+		NET_OpenEpoll();
+#endif
 }
 
 
@@ -1652,6 +2912,28 @@ static qboolean NET_GetCvars( void ) {
 
 	net_dropsim = Cvar_Get( "net_dropsim", "", 0 );
 
+#ifdef USE_MMSG
+	net_mmsg = Cvar_Get( "net_mmsg", "1", CVAR_ARCHIVE );
+#endif
+
+#ifdef USE_NET_THREAD
+	net_thread = Cvar_Get( "net_thread", "0", CVAR_LATCH | CVAR_ARCHIVE );
+	modified += net_thread->modified;
+	net_thread->modified = qfalse;
+#endif
+
+#ifdef USE_REUSEPORT
+	net_shards = Cvar_Get( "net_shards", "1", CVAR_LATCH | CVAR_ARCHIVE );
+	modified += net_shards->modified;
+	net_shards->modified = qfalse;
+#endif
+
+#ifdef USE_EPOLL
+	net_epoll = Cvar_Get( "net_epoll", "1", CVAR_LATCH | CVAR_ARCHIVE );
+	modified += net_epoll->modified;
+	net_epoll->modified = qfalse;
+#endif
+
 	return modified ? qtrue : qfalse;
 }
 
@@ -1701,6 +2983,16 @@ static void NET_Config( qboolean enableNetworking ) {
 	}
 
 	if( stop ) {
+#ifdef USE_NET_THREAD
+		NET_StopThread();
+		NET_CloseShards();
+#endif
+#ifdef USE_MMSG
+		NET_ResetBatches();
+#endif
+#ifdef USE_EPOLL
+		NET_CloseEpoll();
+#endif
 		if ( ip_socket != INVALID_SOCKET ) {
 			closesocket( ip_socket );
 			ip_socket = INVALID_SOCKET;
@@ -1761,6 +3053,9 @@ void NET_Init( void ) {
 	NET_Config( qtrue );
 	
 	Cmd_AddCommand( "net_restart", NET_Restart_f );
+#ifdef USE_NET_THREAD
+	Cmd_AddCommand( "net_threadstats", NET_ThreadStats_f );
+#endif
 }
 
 
@@ -1840,6 +3135,16 @@ qboolean NET_Sleep( int timeout )
 	if ( timeout < 0 )
 		timeout = 0;
 
+#ifdef USE_EPOLL
+	if ( epoll_fd != -1 )
+		return NET_SleepEpoll( timeout );
+#endif
+
+#ifdef USE_NET_THREAD
+	if ( netThread.running )
+		return NET_SleepThread( timeout );
+#endif
+
 	FD_ZERO( &fdr );
 
 	if ( ip_socket != INVALID_SOCKET )
@@ -1049,9 +1049,19 @@ typedef enum {
 #define	MAX_CUSTOMSTRINGS	128
 #define	MAX_MODELS			1024
 #define	MAX_SOUNDS			256
-#define	MAX_CLIENTS			128
+#ifndef MAX_CLIENTS
+#define	MAX_CLIENTS			128	// build with MAX_CLIENTS=256 for large servers
+#endif
+#if MAX_CLIENTS < 1 || MAX_CLIENTS > 256
+#error "MAX_CLIENTS must be in 1..256 range"	// clientNum is sent in 8 bits
+#endif
 #define MAX_LOCATIONS		64
-#define	GENTITYNUM_BITS		12
+#ifndef GENTITYNUM_BITS
+#define	GENTITYNUM_BITS		12	// build with GENTITYNUM_BITS=14 for 16384 entities
+#endif
+#if GENTITYNUM_BITS < 12 || GENTITYNUM_BITS > 14
+#error "GENTITYNUM_BITS must be in 12..14 range"
+#endif
 #define	MAX_GENTITIES		(1<<GENTITYNUM_BITS)
 
 // entitynums are communicated with GENTITY_BITS, so any reserved
@@ -1061,7 +1071,11 @@ typedef enum {
 #define	ENTITYNUM_WORLD		(MAX_GENTITIES-2)
 #define	ENTITYNUM_MAX_NORMAL	(MAX_GENTITIES-2)
 
+#if MAX_CLIENTS > 128
+#define	MAX_CONFIGSTRINGS	(1600+MAX_CLIENTS-128)	// room for CS_PLAYERS
+#else
 #define	MAX_CONFIGSTRINGS	1600
+#endif
 #define	MAX_GAMESTATE_CHARS	65535
 #define MAX_CVARS           131072
 
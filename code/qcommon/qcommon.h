@@ -85,6 +85,10 @@ struct entityState_s;
 struct playerState_s;
 
 void MSG_WriteBits( msg_t *msg, int value, int bits );
+void MSG_WriteBitStream( msg_t *msg, const byte *data, int bits );
+void MSG_WriteEntitynum( msg_t *msg, int num );
+int  MSG_EntitynumBits( int num );
+void MSG_HuffmanBench_f( void );
 
 void MSG_WriteChar (msg_t *sb, int c);
 void MSG_WriteByte (msg_t *sb, int c);
@@ -117,6 +121,17 @@ void MSG_ReadDeltaUsercmdKey( msg_t *msg, int key, const usercmd_t *from, usercm
 void MSG_WriteDeltaEntity( msg_t *msg, const entityState_t *from, const entityState_t *to, qboolean force );
 void MSG_ReadDeltaEntity( msg_t *msg, const entityState_t *from, entityState_t *to, int number );
 
+// circular buffer of parsed snapshot entities, used by the client
+// and the server load test
+typedef struct {
+	entityState_t		*entities;		// [mask+1]
+	int					mask;
+	int					num;			// states parsed so far, frames refer to this
+	const entityState_t	*baselines;		// [MAX_GENTITIES]
+} entityParse_t;
+
+int MSG_ParsePacketEntities( msg_t *msg, entityParse_t *parse, int oldFirst, int oldCount );
+
 void MSG_WriteDeltaPlayerstate( msg_t *msg, const playerState_t *from, const playerState_t *to );
 void MSG_ReadDeltaPlayerstate( msg_t *msg, const playerState_t *from, playerState_t *to );
 
@@ -131,6 +146,11 @@ NET
 */
 #define USE_IPV6
 
+#if defined (DEDICATED) && !defined (_WIN32)
+#define USE_NET_THREAD
+#define NET_MAX_SHARDS			8
+#endif
+
 #define NET_ENABLEV4            0x01
 #define NET_ENABLEV6            0x02
 // if this flag is set, always attempt ipv6 connections instead of ipv4 if a v6 address is found.
@@ -193,6 +213,8 @@ void		NET_Shutdown( void );
 void		NET_FlushPacketQueue( int time_diff );
 void		NET_QueuePacket( netsrc_t sock, int length, const void *data, const netadr_t *to, int offset );
 void		NET_SendPacket( netsrc_t sock, int length, const void *data, const netadr_t *to );
+typedef void (*netSendSink_t)( netsrc_t sock, int length, const void *data, const netadr_t *to );
+void		NET_SetSendSink( netSendSink_t sink );
 void		QDECL NET_OutOfBandPrint( netsrc_t net_socket, const netadr_t *adr, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
 void		NET_OutOfBandCompress( netsrc_t sock, const netadr_t *adr, const byte *data, int len );
 
@@ -211,6 +233,9 @@ void		NET_JoinMulticast6( void );
 void		NET_LeaveMulticast6( void );
 #endif
 qboolean	NET_Sleep( int timeout );
+#ifdef USE_NET_THREAD
+int			NET_ShardCount( void );
+#endif
 
 #define	MAX_PACKETLEN	5600*4	// max size of a network packet
 
@@ -245,14 +270,14 @@ typedef struct {
 	// incoming fragment assembly buffer
 	int			fragmentSequence;
 	int			fragmentLength;	
-	byte		fragmentBuffer[MAX_MSGLEN];
+	byte		*fragmentBuffer;	// borrowed from the fragment pool
 
 	// outgoing fragment buffer
 	// we need to space out the sending of large fragmented messages
 	qboolean	unsentFragments;
 	int			unsentFragmentStart;
 	int			unsentLength;
-	byte		unsentBuffer[MAX_MSGLEN];
+	byte		*unsentBuffer;		// borrowed from the fragment pool
 
 	int			challenge;
 	int			lastSentTime;
@@ -260,6 +285,11 @@ typedef struct {
 
 	qboolean	isLANAddress;
 
+	// totals since Netchan_Setup, for server telemetry
+	int			fragmentsSent;
+	int			droppedTotal;		// incoming packets missing from the sequence
+	int			outOfOrder;			// incoming packets discarded as late or duplicated
+
 } netchan_t;
 
 void Netchan_Init( int qport );
@@ -270,6 +300,7 @@ void Netchan_TransmitNextFragment( netchan_t *chan );
 void Netchan_Enqueue( netchan_t *chan, int length, const byte *data );
 
 qboolean Netchan_Process( netchan_t *chan, msg_t *msg );
+void Netchan_Release( netchan_t *chan );
 
 
 /*
@@ -1068,6 +1099,9 @@ void SV_PacketEvent( const netadr_t *from, msg_t *msg );
 int SV_FrameMsec( void );
 qboolean SV_GameCommand( void );
 int SV_SendQueuedPackets( void );
+#ifdef USE_NET_THREAD
+int SV_NetThreadPacket( int shard, const netadr_t *from, const byte *data, int len, byte *reply, int replySize );
+#endif
 
 
 //
@@ -1139,6 +1173,8 @@ qboolean Sys_RandomBytes( byte *string, int len );
 void	Sys_DisplaySystemConsole( qboolean show );
 
 void	Sys_SendPacket( int length, const void *data, const netadr_t *to );
+void	Sys_BeginPacketBatch( void );
+void	Sys_EndPacketBatch( void );
 
 qboolean	Sys_StringToAdr( const char *s, netadr_t *a, netadrtype_t family );
 //Does NOT parse port numbers, only base addresses.
@@ -1176,6 +1212,9 @@ void HuffmanPutBit( byte* fout, int32_t bitIndex, int bit );
 int HuffmanPutSymbol( byte* fout, uint32_t offset, int symbol );
 int HuffmanGetBit( const byte* buffer, int bitIndex );
 int HuffmanGetSymbol( unsigned int* symbol, const byte* buffer, int bitIndex );
+void HuffmanInitTables( void );
+int HuffmanPutBits( byte* fout, uint32_t offset, uint32_t value, int nbits, int symbols );
+int HuffmanGetBits( uint32_t* value, const byte* buffer, uint32_t offset, int nbits, int symbols );
 
 #define	SV_ENCODE_START		4
 #define	SV_DECODE_START		12
@@ -38,6 +38,12 @@ typedef struct svEntity_s {
 	struct worldSector_s *worldSector;
 	struct svEntity_s *nextEntityInWorldSector;
 
+	// with sv_areaGrid, entities are hashed into loose grid cells instead
+	struct svEntity_s *nextEntityInGrid;
+	struct svEntity_s **prevEntityInGrid;	// NULL if not in the grid
+	int			gridLevel;
+	unsigned int	areaQuery;		// used to prevent double listing from shared buckets
+
 	entityState_t	baseline;		// for delta compression of initial sighting
 	int			numClusters;		// if -1, use headnode instead
 	int			clusternums[MAX_ENT_CLUSTERS];
@@ -56,8 +62,16 @@ typedef enum {
 // so leave more room for slow-snaps clients etc.
 #define NUM_SNAPSHOT_FRAMES (PACKET_BACKUP*4)
 
+// common snapshot storage is sized for this many entities per frame and
+// grown on demand when a level really links more of them
+#if GENTITYNUM_BITS > 12
+#define SNAPSHOT_BASE_ENTITIES	4096
+#else
+#define SNAPSHOT_BASE_ENTITIES	MAX_GENTITIES
+#endif
+
+// entities of a frame are contiguous in svs.snapshotEntities ring
 typedef struct snapshotFrame_s {
-	entityState_t *ents[ MAX_GENTITIES ];
 	int	frameNum;
 	int start;
 	int count;
@@ -73,6 +87,9 @@ typedef struct {
 	int				snapshotCounter;	// incremented for each snapshot built
 	int				timeResidual;		// <= 1000 / sv_frame->value
 	char			*configstrings[MAX_CONFIGSTRINGS];
+	byte			csDirty[MAX_CONFIGSTRINGS];	// changed since last SV_FlushConfigstrings()
+	int				numCsDirty;
+	qboolean		csFlushing;
 	svEntity_t		svEntities[MAX_GENTITIES];
 
 	const char		*entityParsePoint;	// used during game VM init
@@ -101,7 +118,7 @@ typedef struct {
 	int				messageSize;		// used to rate drop packets
 
 	int				frameNum;			// from snapshot storage to compare with last valid
-	entityState_t	*ents[ MAX_SNAPSHOT_ENTITIES ];
+	unsigned int	first_entity;		// into the svs.snapshotIndexes ring
 } clientSnapshot_t;
 
 typedef enum {
@@ -149,11 +166,32 @@ typedef enum {
 	GSA_ACKED		// gamestate acknowledged, no retansmissions needed
 } gameStateAck_t;
 
+// reliable command text shared by every client window it was added to
+typedef struct {
+	int				refCount;
+	char			text[1];	// allocated to length
+} reliableCommand_t;
+
+// network counters shown by clientstats and written to sv_statsLog,
+// packet loss and fragments are counted by the netchan
+typedef struct {
+	int				startTime;			// svs.time when counting started
+	int				snapshots;
+	int				deltaSnapshots;		// delta compressed from an acknowledged frame
+	int64_t			snapshotBytes;
+	int				maxSnapshotBytes;
+	int64_t			entities;			// in all snapshots sent
+	int64_t			entityBits;			// spent on packetentities
+	int				newEntities;		// sent from the baseline
+	int				rateDelayed;		// snapshots held back by rate or unsent fragments
+	int				maxBacklog;			// reliable commands not acknowledged yet
+} clientStats_t;
+
 typedef struct client_s {
 	clientState_t	state;
 	char			userinfo[MAX_INFO_STRING];		// name, etc
 
-	char			reliableCommands[MAX_RELIABLE_COMMANDS][MAX_STRING_CHARS];
+	reliableCommand_t	*reliableCommands[MAX_RELIABLE_COMMANDS];	// use SV_ReliableCommand()
 	int				reliableSequence;		// last added reliable message, not necessarily sent or acknowledged yet
 	int				reliableAcknowledge;	// last acknowledged reliable message
 	int				messageAcknowledge;
@@ -190,8 +228,10 @@ typedef struct client_s {
 	int				lastSnapshotTime;	// svs.time of last sent snapshot
 	qboolean		rateDelayed;		// true if nextSnapshotTime was set based on rate instead of snapshotMsec
 	int				timeoutCount;		// must timeout a few frames in a row so debugging doesn't break
-	clientSnapshot_t	frames[PACKET_BACKUP];	// updates can be delta'd from here
+	clientSnapshot_t	*frames;		// [PACKET_BACKUP] updates can be delta'd from here, allocated on connect
 	int				ping;
+	int				pingTotal;			// sum of acked frame round trips in frames[]
+	int				pingCount;			// number of acked frames in frames[]
 	int				rate;				// bytes / second, 0 - unlimited
 	int				snapshotMsec;		// requests a snapshot every snapshotMsec unless rate choked
 	netchan_t		netchan;
@@ -203,18 +243,25 @@ typedef struct client_s {
 	netchan_buffer_t **netchan_end_queue;
 
 	int				oldServerTime;
-	qboolean		csUpdated[MAX_CONFIGSTRINGS];
+	byte			csUpdated[MAX_CONFIGSTRINGS];
 
 	qboolean		netError;
 	int				viewDistance;
 	int				dynamicViewDistance;
 
+	// accumulated by entities left out of a budgeted snapshot,
+	// grown with sv.num_entities
+	float			*entityPriority;
+	int				numEntityPriority;
+
 	// flood protection
 	rateLimit_t		cmd_rate;
 	rateLimit_t		info_rate;
 	rateLimit_t		gamestate_rate;
 
 	qboolean		justConnected;
+
+	clientStats_t	stats;
 } client_t;
 
 //=============================================================================
@@ -230,8 +277,11 @@ typedef struct {
 	int			snapFlagServerBit;			// ^= SNAPFLAG_SERVERCOUNT every SV_SpawnServer()
 
 	client_t	*clients;					// [MAX_CLIENTS];
-	int			numSnapshotEntities;		// PACKET_BACKUP*MAX_SNAPSHOT_ENTITIES
+	int			numSnapshotEntities;		// PACKET_BACKUP*SNAPSHOT_BASE_ENTITIES or more
 	entityState_t	*snapshotEntities;		// [numSnapshotEntities]
+	unsigned int	numSnapshotIndexes;		// power of two
+	unsigned int	nextSnapshotIndex;		// next snapshotIndexes to use, wraps
+	int			*snapshotIndexes;			// [numSnapshotIndexes] of client frames, into snapshotEntities
 	int			nextHeartbeatTime;
 
 	netadr_t	authorizeAddress;			// for rcon return messages
@@ -277,6 +327,14 @@ extern	cvar_t	*sv_anticheatengine;
 extern	cvar_t	*sv_ace_wallhack;
 
 extern	cvar_t *sv_filter;
+extern	cvar_t	*sv_deltaCache;
+extern	cvar_t	*sv_snapshotBudget;
+extern	cvar_t	*sv_snapshotTiers;
+extern	cvar_t	*sv_areaGrid;
+extern	cvar_t	*sv_autoRecord;
+extern	cvar_t	*sv_recordBuffer;
+extern	cvar_t	*sv_statsLog;
+extern	cvar_t	*sv_statsLogInterval;
 
 //===========================================================
 
@@ -288,6 +346,7 @@ qboolean SVC_RateLimitAddress( const netadr_t *from, int burst, int period );
 void SVC_RateRestoreBurstAddress( const netadr_t *from, int burst, int period );
 void SVC_RateRestoreToxicAddress( const netadr_t *from, int burst, int period );
 void SVC_RateDropAddress( const netadr_t *from, int burst, int period );
+void SV_InvalidateQueryCache( void );
 
 void QDECL SV_SendServerCommand( client_t *cl, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 
@@ -295,6 +354,7 @@ void SV_AddOperatorCommands( void );
 
 void SV_MasterShutdown( void );
 int SV_RateMsec( const client_t *client );
+void SV_CloseStatsLog( void );
 
 
 //
@@ -303,6 +363,7 @@ int SV_RateMsec( const client_t *client );
 void SV_SetConfigstring( int index, const char *val );
 void SV_GetConfigstring( int index, char *buffer, int bufferSize );
 void SV_UpdateConfigstrings( client_t *client );
+void SV_FlushConfigstrings( void );
 
 void SV_SetUserinfo( int index, const char *val );
 void SV_GetUserinfo( int index, char *buffer, int bufferSize );
@@ -322,6 +383,8 @@ void SV_UserinfoChanged( client_t *cl, qboolean updateUserinfo, qboolean runFilt
 
 void SV_ClientEnterWorld( client_t *client );
 void SV_FreeClient( client_t *client );
+void SV_AllocClientFrames( client_t *client );
+void SV_FreeClientFrames( client_t *client );
 void SV_DropClient( client_t *drop, const char *reason );
 
 qboolean SV_ExecuteClientCommand( client_t *cl, const char *s );
@@ -340,6 +403,8 @@ client_t *SV_GetPlayerByHandle( void );
 // sv_snapshot.c
 //
 void SV_AddServerCommand( client_t *client, const char *cmd );
+const char *SV_ReliableCommand( const client_t *client, int sequence );
+void SV_FreeReliableCommands( client_t *client );
 void SV_UpdateServerCommandsToClient( client_t *client, msg_t *msg );
 void SV_WriteFrameToClient( client_t *client, msg_t *msg );
 void SV_SendMessageToClient( msg_t *msg, client_t *client );
@@ -347,9 +412,16 @@ void SV_SendClientMessages( void );
 void SV_SendClientSnapshot( client_t *client );
 
 void SV_InitSnapshotStorage( void );
+void SV_FreeSnapshotStorage( void );
+void SV_FreeEntityPriority( client_t *client );
 void SV_IssueNewSnapshot( void );
+void SV_DeltaCacheStats_f( void );
+entityState_t *SV_SnapshotEntity( const clientSnapshot_t *frame, int index );
+int SV_CommonSnapshot( void );
+const entityState_t *SV_CommonSnapshotEntity( int index );
 
 int SV_RemainingGameState( void );
+void SV_InvalidateGameState( void );
 
 //
 // sv_game.c
@@ -389,6 +461,8 @@ void SV_BotInitBotLib(void);
 void SV_ClearWorld (void);
 // called after the world model has been loaded, before linking any entities
 
+void SV_AreaStats_f( void );
+
 void SV_UnlinkEntity( sharedEntity_t *ent );
 // call before removing an entity, and before trying to move one,
 // so it doesn't clip against itself
@@ -440,10 +514,57 @@ int SV_Netchan_TransmitNextFragment( client_t *client );
 qboolean SV_Netchan_Process( client_t *client, msg_t *msg );
 void SV_Netchan_FreeQueue( client_t *client );
 
+//
+// sv_capture.c
+//
+
+// measurements reported as percentiles by replay and loadtest
+typedef struct {
+	int64_t		*values;
+	int			count;
+	int			max;
+} sampleList_t;
+
+void SV_CaptureMap( void );
+void SV_CaptureFrame( int msec );
+void SV_CapturePacket( const netadr_t *from, const msg_t *msg );
+void SV_AddSample( sampleList_t *list, int64_t value );
+void SV_PrintSamples( sampleList_t *list, const char *label );
+void SV_FreeSamples( sampleList_t *list );
+qboolean SV_CaptureActive( void );
+void SV_ReplaySnapshot( int size );
+void SV_StopCapture( void );
+void SV_Capture_f( void );
+void SV_CaptureStop_f( void );
+void SV_Replay_f( void );
+
+//
+// sv_record.c
+//
+void SV_RecordMap( void );
+void SV_RecordFrame( void );
+void SV_RecordConfigstring( int index );
+void SV_RecordCommand( int clientNum, const char *text );
+void SV_StopRecord( void );
+void SV_Record_f( void );
+void SV_RecordStop_f( void );
+void SV_RecordInfo_f( void );
+
+//
+// sv_load.c
+//
+void SV_LoadFrame( void );
+void SV_LoadFrameEnd( void );
+qboolean SV_LoadActive( void );
+void SV_StopLoadTest( void );
+void SV_LoadTest_f( void );
+void SV_LoadTestStop_f( void );
+
 //
 // sv_filter.c
 //
 void SV_LoadFilters( const char *filename );
 const char *SV_RunFilters( const char *userinfo, const netadr_t *addr );
+void SV_FilterStats_f( void );
 void SV_AddFilter_f( void );
 void SV_AddFilterCmd_f( void );
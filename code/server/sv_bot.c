@@ -58,9 +58,11 @@ int SV_BotAllocateClient( void ) {
 		return -1;
 	}
 
+	SV_AllocClientFrames( cl );
 	cl->gentity = SV_GentityNum( i );
 	cl->gentity->s.number = i;
 	cl->state = CS_ACTIVE;
+	SV_InvalidateQueryCache();
 	cl->lastPacketTime = svs.time;
 	cl->snapshotMsec = 1000 / sv_fps->integer;
 	cl->netchan.remoteAddress.type = NA_BOT;
@@ -421,13 +423,13 @@ int SV_BotGetConsoleMessage( int client, char *buf, int size )
 		}
 
 		cl->reliableAcknowledge++;
-		index = cl->reliableAcknowledge & ( MAX_RELIABLE_COMMANDS - 1 );
+		index = cl->reliableAcknowledge;
 
-		if ( !cl->reliableCommands[index][0] ) {
+		if ( !SV_ReliableCommand( cl, index )[0] ) {
 			return qfalse;
 		}
 
-		Q_strncpyz( buf, cl->reliableCommands[index], size );
+		Q_strncpyz( buf, SV_ReliableCommand( cl, index ), size );
 		return qtrue;
 	} else {
 		return qfalse;
@@ -446,7 +448,7 @@ int SV_BotGetSnapshotEntity( int client, int sequence ) {
 		if ( (unsigned) sequence >= frame->num_entities ) {
 			return -1;
 		}
-		return frame->ents[sequence]->number;
+		return SV_SnapshotEntity( frame, sequence )->number;
 	} else {
 		return -1;
 	}
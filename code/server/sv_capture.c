@@ -0,0 +1,737 @@
+/*
+===========================================================================
+Copyright (C) 1999-2005 Id Software, Inc.
+
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+#include "server.h"
+
+/*
+=============================================================================
+
+PACKET CAPTURE AND REPLAY
+
+A capture records every datagram passed to SV_PacketEvent, every
+SV_Frame call and the state needed to respawn each map, so that a
+replay can drive the same server code without any sockets. While it
+runs the network threads pass queries on instead of answering them,
+so query floods are captured too.
+
+All integers are little endian, every record starts with a type byte
+and the capture time in msec:
+
+  header		"SVCP" version
+  CAP_MAP		mapname serverinfo systeminfo cvars serverId checksumFeed svs.time sv.time
+  CAP_FRAME		msec frameTime
+  CAP_PACKET	type address[16] port length data
+  CAP_END
+
+Strings are stored as a length followed by the characters.
+
+=============================================================================
+*/
+
+#define CAPTURE_MAGIC		0x50435653	// "SVCP"
+#define CAPTURE_VERSION		1
+
+typedef enum {
+	CAP_END,
+	CAP_MAP,
+	CAP_FRAME,
+	CAP_PACKET
+} captureRecord_t;
+
+// server cvars that change frame and snapshot behaviour but aren't serverinfo
+static const char *captureCvars[] = {
+	"sv_fps",
+	"sv_minRate",
+	"sv_maxRate",
+	"sv_lanForceRate",
+	"sv_padPackets",
+	"sv_deltaCache",
+	"sv_snapshotBudget",
+	"sv_snapshotTiers",
+	"sv_areaGrid"
+};
+
+typedef struct {
+	fileHandle_t	file;
+	int				running;		// read by the network threads
+	int				startTime;
+	int				records;
+	int				bytes;
+} capture_t;
+
+typedef struct {
+	fileHandle_t	file;
+	qboolean		active;
+
+	sampleList_t	frameTimes;		// usec spent in each SV_Frame
+	sampleList_t	snapshotSizes;
+
+	int64_t			packetTime;
+	int				numPackets;
+	int				numMaps;
+
+	int64_t			bytesSent;
+	int				packetsSent;
+} replay_t;
+
+static capture_t	capture;
+static replay_t		replay;
+
+
+/*
+==================
+SV_CaptureWrite
+==================
+*/
+static void SV_CaptureWrite( const void *data, int len ) {
+	FS_Write( data, len, capture.file );
+	capture.bytes += len;
+}
+
+
+static void SV_CaptureInt( int value ) {
+	value = LittleLong( value );
+	SV_CaptureWrite( &value, 4 );
+}
+
+
+static void SV_CaptureString( const char *s ) {
+	const int len = (int)strlen( s );
+
+	SV_CaptureInt( len );
+	SV_CaptureWrite( s, len );
+}
+
+
+static void SV_CaptureRecord( captureRecord_t type ) {
+	const byte b = type;
+
+	SV_CaptureWrite( &b, 1 );
+	SV_CaptureInt( Sys_Milliseconds() - capture.startTime );
+	capture.records++;
+}
+
+
+/*
+==================
+SV_CaptureMap
+
+Records everything needed to respawn the current map, called
+when a capture starts and at the end of SV_SpawnServer
+==================
+*/
+void SV_CaptureMap( void ) {
+	char	cvars[ BIG_INFO_STRING ];
+	int		i;
+
+	if ( !capture.file ) {
+		return;
+	}
+
+	cvars[0] = '\0';
+	for ( i = 0; i < ARRAY_LEN( captureCvars ); i++ ) {
+		Info_SetValueForKey_s( cvars, sizeof( cvars ), captureCvars[i], Cvar_VariableString( captureCvars[i] ) );
+	}
+
+	SV_CaptureRecord( CAP_MAP );
+	SV_CaptureString( sv_mapname->string );
+	SV_CaptureString( Cvar_InfoString( CVAR_SERVERINFO, NULL ) );
+	SV_CaptureString( Cvar_InfoString( CVAR_SYSTEMINFO, NULL ) );
+	SV_CaptureString( cvars );
+	SV_CaptureInt( sv.serverId );
+	SV_CaptureInt( sv.checksumFeed );
+	SV_CaptureInt( svs.time );
+	SV_CaptureInt( sv.time );
+}
+
+
+/*
+==================
+SV_CaptureFrame
+==================
+*/
+void SV_CaptureFrame( int msec ) {
+	if ( !capture.file ) {
+		return;
+	}
+
+	SV_CaptureRecord( CAP_FRAME );
+	SV_CaptureInt( msec );
+	SV_CaptureInt( com_frameTime );
+}
+
+
+/*
+==================
+SV_CapturePacket
+==================
+*/
+void SV_CapturePacket( const netadr_t *from, const msg_t *msg ) {
+	byte	address[16];
+	byte	type;
+
+	if ( !capture.file ) {
+		return;
+	}
+
+	type = from->type;
+	Com_Memset( address, 0, sizeof( address ) );
+#ifdef USE_IPV6
+	if ( from->type == NA_IP6 || from->type == NA_MULTICAST6 ) {
+		Com_Memcpy( address, from->ipv._6, 16 );
+	} else
+#endif
+	Com_Memcpy( address, from->ipv._4, 4 );
+
+	SV_CaptureRecord( CAP_PACKET );
+	SV_CaptureWrite( &type, 1 );
+	SV_CaptureWrite( address, sizeof( address ) );
+	SV_CaptureWrite( &from->port, 2 );	// already in network order
+	SV_CaptureInt( msg->cursize );
+	SV_CaptureWrite( msg->data, msg->cursize );
+}
+
+
+/*
+==================
+SV_CaptureActive
+
+Called from the network threads, which hand every datagram to
+SV_PacketEvent while a capture runs
+==================
+*/
+qboolean SV_CaptureActive( void ) {
+	return __atomic_load_n( &capture.running, __ATOMIC_ACQUIRE ) ? qtrue : qfalse;
+}
+
+
+/*
+==================
+SV_StopCapture
+
+Finishes a capture or aborts a replay, called on server shutdown
+==================
+*/
+void SV_StopCapture( void ) {
+	if ( capture.file ) {
+		__atomic_store_n( &capture.running, 0, __ATOMIC_RELEASE );
+		SV_CaptureRecord( CAP_END );
+		FS_FCloseFile( capture.file );
+		Com_Printf( "capture stopped: %i records, %i KB\n", capture.records, capture.bytes / 1024 );
+		Com_Memset( &capture, 0, sizeof( capture ) );
+	}
+
+	if ( replay.file ) {
+		FS_FCloseFile( replay.file );
+		replay.file = FS_INVALID_HANDLE;
+	}
+
+	if ( replay.active ) {
+		NET_SetSendSink( NULL );
+		SV_FreeSamples( &replay.frameTimes );
+		SV_FreeSamples( &replay.snapshotSizes );
+		Com_Memset( &replay, 0, sizeof( replay ) );
+	}
+}
+
+
+/*
+==================
+SV_Capture_f
+==================
+*/
+void SV_Capture_f( void ) {
+	char	filename[ MAX_QPATH ];
+	int		value, i, connected;
+
+	if ( Cmd_Argc() != 2 ) {
+		Com_Printf( "usage: capture <name>\n" );
+		return;
+	}
+
+	if ( capture.file || replay.active ) {
+		Com_Printf( "capture or replay already in progress\n" );
+		return;
+	}
+
+	Com_sprintf( filename, sizeof( filename ), "captures/%s", Cmd_Argv( 1 ) );
+	COM_DefaultExtension( filename, sizeof( filename ), ".svcap" );
+
+	capture.file = FS_FOpenFileWrite( filename );
+	if ( capture.file == FS_INVALID_HANDLE ) {
+		Com_Printf( "couldn't open %s\n", filename );
+		return;
+	}
+	capture.startTime = Sys_Milliseconds();
+
+	value = LittleLong( CAPTURE_MAGIC );
+	SV_CaptureWrite( &value, 4 );
+	SV_CaptureInt( CAPTURE_VERSION );
+	__atomic_store_n( &capture.running, 1, __ATOMIC_RELEASE );
+
+	Com_Printf( "capturing to %s\n", filename );
+
+	if ( !com_sv_running->integer || sv.state != SS_GAME ) {
+		return;
+	}
+
+	SV_CaptureMap();
+
+	connected = 0;
+	for ( i = 0; i < sv.maxclients; i++ ) {
+		if ( svs.clients[i].state >= CS_CONNECTED && svs.clients[i].netchan.remoteAddress.type != NA_BOT ) {
+			connected++;
+		}
+	}
+	if ( connected ) {
+		Com_Printf( S_COLOR_YELLOW "%i clients are already connected and won't be replayed, "
+			"start the capture before the map loads to record everything\n", connected );
+	}
+}
+
+
+/*
+==================
+SV_CaptureStop_f
+==================
+*/
+void SV_CaptureStop_f( void ) {
+	if ( !capture.file ) {
+		Com_Printf( "not capturing\n" );
+		return;
+	}
+	SV_StopCapture();
+}
+
+
+/*
+=============================================================================
+
+REPLAY
+
+=============================================================================
+*/
+
+/*
+==================
+SV_ReplaySend
+
+Replaces the sockets during a replay, outgoing packets are only counted
+==================
+*/
+static void SV_ReplaySend( netsrc_t sock, int length, const void *data, const netadr_t *to ) {
+	if ( sock == NS_SERVER ) {
+		replay.bytesSent += length;
+		replay.packetsSent++;
+	}
+}
+
+
+/*
+==================
+SV_AddSample
+
+Appends to a zone allocated list, used by replay and loadtest
+==================
+*/
+void SV_AddSample( sampleList_t *list, int64_t value ) {
+	int64_t	*grow;
+
+	if ( list->count == list->max ) {
+		list->max = list->max ? list->max * 2 : 4096;
+		grow = Z_Malloc( list->max * sizeof( int64_t ) );
+		if ( list->values ) {
+			Com_Memcpy( grow, list->values, list->count * sizeof( int64_t ) );
+			Z_Free( list->values );
+		}
+		list->values = grow;
+	}
+
+	list->values[ list->count++ ] = value;
+}
+
+
+static int QDECL SV_CompareSamples( const void *a, const void *b ) {
+	const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : ( x > y ? 1 : 0 );
+}
+
+
+#define PERCENTILE( list, p )	(list)->values[ (int)( ( (int64_t)(list)->count - 1 ) * (p) / 100 ) ]
+
+/*
+==================
+SV_PrintSamples
+
+Sorts the list and prints its average and percentiles
+==================
+*/
+void SV_PrintSamples( sampleList_t *list, const char *label ) {
+	int64_t	total;
+	int		i;
+
+	if ( !list->count ) {
+		return;
+	}
+
+	qsort( list->values, list->count, sizeof( int64_t ), SV_CompareSamples );
+	for ( total = 0, i = 0; i < list->count; i++ ) {
+		total += list->values[i];
+	}
+
+	Com_Printf( "%s: avg %i, p50 %i, p90 %i, p99 %i, max %i (%i samples)\n", label,
+		(int)( total / list->count ),
+		(int)PERCENTILE( list, 50 ),
+		(int)PERCENTILE( list, 90 ),
+		(int)PERCENTILE( list, 99 ),
+		(int)list->values[ list->count - 1 ], list->count );
+}
+
+
+/*
+==================
+SV_FreeSamples
+==================
+*/
+void SV_FreeSamples( sampleList_t *list ) {
+	if ( list->values ) {
+		Z_Free( list->values );
+	}
+	Com_Memset( list, 0, sizeof( *list ) );
+}
+
+
+/*
+==================
+SV_ReplaySnapshot
+
+Called for every snapshot message built for a client
+==================
+*/
+void SV_ReplaySnapshot( int size ) {
+	if ( !replay.active ) {
+		return;
+	}
+
+	SV_AddSample( &replay.snapshotSizes, size );
+}
+
+
+static qboolean SV_ReplayRead( void *data, int len ) {
+	return FS_Read( data, len, replay.file ) == len ? qtrue : qfalse;
+}
+
+
+static qboolean SV_ReplayInt( int *value ) {
+	if ( !SV_ReplayRead( value, 4 ) ) {
+		return qfalse;
+	}
+	*value = LittleLong( *value );
+	return qtrue;
+}
+
+
+static qboolean SV_ReplayString( char *s, int size ) {
+	int len;
+
+	if ( !SV_ReplayInt( &len ) || len < 0 || len >= size ) {
+		return qfalse;
+	}
+	s[ len ] = '\0';
+	return SV_ReplayRead( s, len );
+}
+
+
+/*
+==================
+SV_ReplaySetCvars
+==================
+*/
+static void SV_ReplaySetCvars( const char *info ) {
+	char	key[ BIG_INFO_KEY ];
+	char	value[ BIG_INFO_VALUE ];
+
+	while ( *info ) {
+		info = Info_NextPair( info, key, value );
+		if ( !key[0] ) {
+			break;
+		}
+		Cvar_Set( key, value );
+	}
+}
+
+
+/*
+==================
+SV_ReplayMap
+
+Spawns the recorded map unless the replayed commands already did,
+then restores the values that were random or time based
+==================
+*/
+static qboolean SV_ReplayMap( void ) {
+	char	mapname[ MAX_QPATH ];
+	char	info[ BIG_INFO_STRING ];
+	int		serverId, checksumFeed, svsTime, svTime;
+
+	if ( !SV_ReplayString( mapname, sizeof( mapname ) ) ) {
+		return qfalse;
+	}
+
+	if ( !SV_ReplayString( info, sizeof( info ) ) ) {
+		return qfalse;
+	}
+	SV_ReplaySetCvars( info );
+
+	if ( !SV_ReplayString( info, sizeof( info ) ) ) {
+		return qfalse;
+	}
+	SV_ReplaySetCvars( info );
+
+	if ( !SV_ReplayString( info, sizeof( info ) ) ) {
+		return qfalse;
+	}
+	SV_ReplaySetCvars( info );
+
+	if ( !SV_ReplayInt( &serverId ) || !SV_ReplayInt( &checksumFeed ) || !SV_ReplayInt( &svsTime ) || !SV_ReplayInt( &svTime ) ) {
+		return qfalse;
+	}
+
+	if ( !com_sv_running->integer || sv.state != SS_GAME || sv.serverId != serverId || Q_stricmp( sv_mapname->string, mapname ) ) {
+		// force latched values to get set
+		Cvar_Get( "g_gametype", "0", CVAR_SERVERINFO | CVAR_USERINFO | CVAR_LATCH );
+
+		// serverId is taken from com_frameTime
+		com_frameTime = serverId;
+		SV_SpawnServer( mapname );
+	}
+
+	sv.checksumFeed = checksumFeed;
+	svs.time = svsTime;
+	sv.time = svTime;
+
+	replay.numMaps++;
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_ReplayPacket
+==================
+*/
+static qboolean SV_ReplayPacket( void ) {
+	byte		data[ MAX_MSGLEN_BUF ];
+	byte		address[16];
+	byte		type;
+	netadr_t	from;
+	msg_t		msg;
+	int			length;
+	int64_t		start;
+
+	if ( !SV_ReplayRead( &type, 1 ) || !SV_ReplayRead( address, sizeof( address ) ) ) {
+		return qfalse;
+	}
+
+	Com_Memset( &from, 0, sizeof( from ) );
+	from.type = type;
+#ifdef USE_IPV6
+	if ( from.type == NA_IP6 || from.type == NA_MULTICAST6 ) {
+		Com_Memcpy( from.ipv._6, address, 16 );
+	} else
+#endif
+	Com_Memcpy( from.ipv._4, address, 4 );
+
+	if ( !SV_ReplayRead( &from.port, 2 ) || !SV_ReplayInt( &length ) ) {
+		return qfalse;
+	}
+
+	if ( length < 0 || length > MAX_MSGLEN ) {
+		return qfalse;
+	}
+
+	MSG_Init( &msg, data, MAX_MSGLEN );
+	if ( !SV_ReplayRead( data, length ) ) {
+		return qfalse;
+	}
+	msg.cursize = length;
+
+	if ( !com_sv_running->integer ) {
+		return qtrue;
+	}
+
+	start = Sys_Microseconds();
+	SV_PacketEvent( &from, &msg );
+	replay.packetTime += Sys_Microseconds() - start;
+	replay.numPackets++;
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_ReplayFrame
+==================
+*/
+static qboolean SV_ReplayFrame( void ) {
+	int		msec, frameTime;
+	int64_t	start;
+
+	if ( !SV_ReplayInt( &msec ) || !SV_ReplayInt( &frameTime ) ) {
+		return qfalse;
+	}
+
+	if ( !com_sv_running->integer ) {
+		return qtrue;
+	}
+
+	// same order as Com_Frame
+	com_frameTime = frameTime;
+	Cbuf_Execute();
+
+	start = Sys_Microseconds();
+	SV_Frame( msec );
+	SV_SendQueuedPackets();
+
+	SV_AddSample( &replay.frameTimes, Sys_Microseconds() - start );
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_ReplayReport
+==================
+*/
+static void SV_ReplayReport( int wallMsec ) {
+	Com_Printf( "replayed %i frames, %i packets, %i maps in %i msec\n",
+		replay.frameTimes.count, replay.numPackets, replay.numMaps, wallMsec );
+
+	SV_PrintSamples( &replay.frameTimes, "SV_Frame usec" );
+
+	if ( replay.numPackets ) {
+		Com_Printf( "SV_PacketEvent usec: total %i, avg %.2f\n",
+			(int)replay.packetTime, (double)replay.packetTime / replay.numPackets );
+	}
+
+	Com_Printf( "sent %i packets, %i KB\n", replay.packetsSent, (int)( replay.bytesSent / 1024 ) );
+
+	SV_PrintSamples( &replay.snapshotSizes, "snapshot bytes" );
+}
+
+
+/*
+==================
+SV_Replay_f
+
+Feeds a capture through the server without touching the network,
+speed 0 replays as fast as possible, 1 at the original rate
+==================
+*/
+void SV_Replay_f( void ) {
+	char		filename[ MAX_QPATH ];
+	float		speed;
+	int			value, time, startTime, now, target;
+	byte		type;
+	qboolean	ok;
+
+	if ( Cmd_Argc() < 2 ) {
+		Com_Printf( "usage: replay <name> [speed]\n" );
+		return;
+	}
+
+	if ( capture.file || replay.active ) {
+		Com_Printf( "capture or replay already in progress\n" );
+		return;
+	}
+
+	// both replace the sockets
+	if ( SV_LoadActive() ) {
+		Com_Printf( "can't replay during a load test\n" );
+		return;
+	}
+
+	speed = Cmd_Argc() > 2 ? atof( Cmd_Argv( 2 ) ) : 0.0f;
+
+	Com_sprintf( filename, sizeof( filename ), "captures/%s", Cmd_Argv( 1 ) );
+	COM_DefaultExtension( filename, sizeof( filename ), ".svcap" );
+
+	if ( FS_FOpenFileRead( filename, &replay.file, qtrue ) <= 0 ) {
+		replay.file = FS_INVALID_HANDLE;
+		Com_Printf( "couldn't open %s\n", filename );
+		return;
+	}
+
+	if ( !SV_ReplayRead( &value, 4 ) || LittleLong( value ) != CAPTURE_MAGIC || !SV_ReplayInt( &value ) || value != CAPTURE_VERSION ) {
+		Com_Printf( "%s is not a version %i capture\n", filename, CAPTURE_VERSION );
+		SV_StopCapture();
+		return;
+	}
+
+	replay.active = qtrue;
+	NET_SetSendSink( SV_ReplaySend );
+
+	Com_Printf( "replaying %s\n", filename );
+
+	startTime = Sys_Milliseconds();
+	ok = qtrue;
+
+	while ( ok && SV_ReplayRead( &type, 1 ) && type != CAP_END ) {
+		if ( !SV_ReplayInt( &time ) ) {
+			ok = qfalse;
+			break;
+		}
+
+		// keep the recorded pacing
+		if ( speed > 0.0f ) {
+			target = startTime + (int)( time / speed );
+			while ( ( now = Sys_Milliseconds() ) < target ) {
+				Sys_Sleep( target - now );
+			}
+		}
+
+		switch ( type ) {
+		case CAP_MAP:
+			ok = SV_ReplayMap();
+			break;
+		case CAP_FRAME:
+			ok = SV_ReplayFrame();
+			break;
+		case CAP_PACKET:
+			ok = SV_ReplayPacket();
+			break;
+		default:
+			ok = qfalse;
+			break;
+		}
+	}
+
+	if ( !ok ) {
+		Com_Printf( S_COLOR_YELLOW "%s is truncated or corrupt\n", filename );
+	}
+
+	SV_ReplayReport( Sys_Milliseconds() - startTime );
+	SV_StopCapture();
+}
@@ -632,6 +632,59 @@ static void SV_DumpUser_f( void ) {
 	Info_Print( cl->userinfo );
 }
 
+/*
+==================
+SV_ClientStats_f
+
+Prints network counters of each client since it connected
+==================
+*/
+static void SV_ClientStats_f( void ) {
+	const clientStats_t *st;
+	client_t	*cl;
+	int			i, msec, snaps;
+	qboolean	reset;
+
+	// make sure server is running
+	if ( !com_sv_running->integer ) {
+		Com_Printf( "Server is not running.\n" );
+		return;
+	}
+
+	reset = ( Cmd_Argc() > 1 && !Q_stricmp( Cmd_Argv( 1 ), "reset" ) );
+
+	// avgsz, ent/sn and entB/sn are per snapshot averages
+	Com_Printf( "cl ping snaps delta%% avgsz maxsz ent/sn entB/sn  KB/s frags delay drop  ooo relq maxq name\n" );
+	Com_Printf( "-- ---- ----- ------ ----- ----- ------ ------- ----- ----- ----- ---- ---- ---- ---- ----\n" );
+
+	for ( i = 0, cl = svs.clients; i < sv.maxclients; i++, cl++ ) {
+		if ( cl->state < CS_CONNECTED || cl->netchan.remoteAddress.type == NA_BOT ) {
+			continue;
+		}
+
+		st = &cl->stats;
+		snaps = MAX( st->snapshots, 1 );
+		msec = MAX( svs.time - st->startTime, 1 );
+
+		Com_Printf( "%2i %4i %5i %5.1f%% %5i %5i %6.1f %7i %5.1f %5i %5i %4i %4i %4i %4i %s\n",
+			i, cl->ping, st->snapshots, st->deltaSnapshots * 100.0 / snaps,
+			(int)( st->snapshotBytes / snaps ), st->maxSnapshotBytes,
+			(double)st->entities / snaps, (int)( st->entityBits / 8 / snaps ),
+			st->snapshotBytes * 1000.0 / 1024.0 / msec,
+			cl->netchan.fragmentsSent, st->rateDelayed,
+			cl->netchan.droppedTotal, cl->netchan.outOfOrder,
+			cl->reliableSequence - cl->reliableAcknowledge, st->maxBacklog, cl->name );
+
+		if ( reset ) {
+			Com_Memset( &cl->stats, 0, sizeof( cl->stats ) );
+			cl->stats.startTime = svs.time;
+			cl->netchan.fragmentsSent = 0;
+			cl->netchan.droppedTotal = 0;
+			cl->netchan.outOfOrder = 0;
+		}
+	}
+}
+
 /*
 =================
 SV_KillServer
@@ -661,10 +714,22 @@ void SV_AddOperatorCommands( void ) {
 	Cmd_AddCommand ("kicknum", SV_KickNum_f);
 	Cmd_AddCommand ("clientkick", SV_KickNum_f); // Legacy command
 	Cmd_AddCommand ("status", SV_Status_f);
+	Cmd_AddCommand( "clientstats", SV_ClientStats_f );
 	Cmd_AddCommand ("dumpuser", SV_DumpUser_f);
 	Cmd_AddCommand ("map_restart", SV_MapRestart_f);
 	Cmd_AddCommand ("map", SV_Map_f);
 	Cmd_AddCommand ("killserver", SV_KillServer_f);
 	Cmd_AddCommand( "filter", SV_AddFilter_f );
 	Cmd_AddCommand( "filtercmd", SV_AddFilterCmd_f );
+	Cmd_AddCommand( "filterstats", SV_FilterStats_f );
+	Cmd_AddCommand( "deltastats", SV_DeltaCacheStats_f );
+	Cmd_AddCommand( "areastats", SV_AreaStats_f );
+	Cmd_AddCommand( "capture", SV_Capture_f );
+	Cmd_AddCommand( "capturestop", SV_CaptureStop_f );
+	Cmd_AddCommand( "replay", SV_Replay_f );
+	Cmd_AddCommand( "svrecord", SV_Record_f );
+	Cmd_AddCommand( "svrecordstop", SV_RecordStop_f );
+	Cmd_AddCommand( "svrecordinfo", SV_RecordInfo_f );
+	Cmd_AddCommand( "loadtest", SV_LoadTest_f );
+	Cmd_AddCommand( "loadteststop", SV_LoadTestStop_f );
 }
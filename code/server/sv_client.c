@@ -378,8 +378,13 @@ gotnewcl:
 	// accept the new client
 	// this is the only place a client_t is ever initialized
 	// we got a newcl, so reset the reliableSequence and reliableAcknowledge
+	Netchan_Release( &newcl->netchan );
+	SV_FreeReliableCommands( newcl );
+	SV_FreeEntityPriority( newcl );
+	SV_FreeClientFrames( newcl );
 	Com_Memset( newcl, 0, sizeof( *newcl ) );
 	clientNum = newcl - svs.clients;
+	SV_AllocClientFrames( newcl );
 
 	// save the challenge
 	newcl->challenge = challenge;
@@ -412,10 +417,12 @@ gotnewcl:
 	SV_PrintClientStateChange( newcl, CS_CONNECTED );
 
 	newcl->state = CS_CONNECTED;
+	SV_InvalidateQueryCache();
 	newcl->lastSnapshotTime = svs.time - 9999; // generate a snapshot immediately
 	newcl->lastPacketTime = svs.time;
 	newcl->lastConnectTime = svs.time;
 	newcl->lastDisconnectTime = svs.time;
+	newcl->stats.startTime = svs.time;
 
 	SVC_RateRestoreToxicAddress( &newcl->netchan.remoteAddress, 10, 1000 );
 	newcl->justConnected = qtrue;
@@ -449,6 +456,39 @@ Destructor for data allocated in a client structure
 void SV_FreeClient(client_t *client)
 {
 	SV_Netchan_FreeQueue(client);
+	Netchan_Release(&client->netchan);
+}
+
+
+/*
+=====================
+SV_AllocClientFrames
+
+Snapshot history is only kept for slots that were ever used
+=====================
+*/
+void SV_AllocClientFrames( client_t *client )
+{
+	if ( !client->frames ) {
+		client->frames = Z_TagMalloc( PACKET_BACKUP * sizeof( clientSnapshot_t ), TAG_CLIENTS );
+		Com_Memset( client->frames, 0, PACKET_BACKUP * sizeof( clientSnapshot_t ) );
+	}
+}
+
+
+/*
+=====================
+SV_FreeClientFrames
+=====================
+*/
+void SV_FreeClientFrames( client_t *client )
+{
+	if ( client->frames ) {
+		Z_Free( client->frames );
+		client->frames = NULL;
+	}
+	client->pingTotal = 0;
+	client->pingCount = 0;
 }
 
 
@@ -511,6 +551,8 @@ void SV_DropClient( client_t *drop, const char *reason ) {
 		drop->state = CS_ZOMBIE;		// become free in a few seconds
 	}
 
+	SV_InvalidateQueryCache();
+
 	if ( !reason ) {
 		return;
 	}
@@ -579,7 +621,7 @@ int SV_RemainingGameState( void )
 
 	// write the baselines
 	Com_Memset( &nullstate, 0, sizeof( nullstate ) );
-	for ( start = 0 ; start < MAX_GENTITIES; start++ ) {
+	for ( start = 0 ; start < sv.num_entities; start++ ) {
 		if ( !sv.baselineUsed[ start ] ) {
 			continue;
 		}
@@ -607,6 +649,77 @@ int SV_RemainingGameState( void )
 }
 
 
+/*
+==============================================================================
+
+SHARED GAMESTATE
+
+configstrings and baselines are encoded once per map and configstring
+generation and spliced into each gamestate after the client's own header
+
+==============================================================================
+*/
+
+static struct {
+	qboolean	valid;
+	int			bits;
+	byte		data[ MAX_MSGLEN_BUF ];
+} gameState;
+
+
+/*
+================
+SV_InvalidateGameState
+
+Called when configstrings or baselines change
+================
+*/
+void SV_InvalidateGameState( void ) {
+	gameState.valid = qfalse;
+}
+
+
+/*
+================
+SV_BuildGameState
+================
+*/
+static void SV_BuildGameState( void ) {
+	int			start;
+	entityState_t nullstate;
+	const svEntity_t *svEnt;
+	msg_t		msg;
+
+	MSG_Init( &msg, gameState.data, MAX_MSGLEN );
+
+	// write the configstrings
+	for ( start = 0 ; start < MAX_CONFIGSTRINGS ; start++ ) {
+		if ( *sv.configstrings[ start ] != '\0' ) {
+			MSG_WriteByte( &msg, svc_configstring );
+			MSG_WriteShort( &msg, start );
+			MSG_WriteBigString( &msg, sv.configstrings[start] );
+		}
+	}
+
+	// write the baselines
+	Com_Memset( &nullstate, 0, sizeof( nullstate ) );
+	for ( start = 0 ; start < sv.num_entities; start++ ) {
+		if ( !sv.baselineUsed[ start ] ) {
+			continue;
+		}
+		svEnt = &sv.svEntities[ start ];
+		MSG_WriteByte( &msg, svc_baseline );
+		MSG_WriteDeltaEntity( &msg, &nullstate, &svEnt->baseline, qtrue );
+	}
+
+	// an overflowed body will overflow every gamestate it is spliced into
+	gameState.bits = msg.overflowed ? msg.maxbits + 1 : msg.bit;
+	gameState.valid = qtrue;
+
+	Com_DPrintf( "SV_BuildGameState: %i bytes\n", ( gameState.bits + 7 ) >> 3 );
+}
+
+
 /*
 ================
 SV_SendClientGameState
@@ -620,8 +733,6 @@ the wrong gamestate.
 */
 static void SV_SendClientGameState( client_t *client ) {
 	int			start;
-	entityState_t nullstate;
-	const svEntity_t *svEnt;
 	msg_t		msg;
 	byte		msgBuffer[ MAX_MSGLEN_BUF ];
 	qboolean	csUpdated;
@@ -660,14 +771,14 @@ static void SV_SendClientGameState( client_t *client ) {
 	MSG_WriteByte( &msg, svc_gamestate );
 	MSG_WriteLong( &msg, client->reliableSequence );
 
-	// write the configstrings
+	// write the configstrings and baselines
+	if ( !gameState.valid ) {
+		SV_BuildGameState();
+	}
+	MSG_WriteBitStream( &msg, gameState.data, gameState.bits );
+
 	csUpdated = qfalse;
 	for ( start = 0 ; start < MAX_CONFIGSTRINGS ; start++ ) {
-		if ( *sv.configstrings[ start ] != '\0' ) {
-			MSG_WriteByte( &msg, svc_configstring );
-			MSG_WriteShort( &msg, start );
-			MSG_WriteBigString( &msg, sv.configstrings[start] );
-		}
 		if ( client->csUpdated[start] ) {
 			csUpdated = qtrue;
 		}
@@ -686,17 +797,6 @@ static void SV_SendClientGameState( client_t *client ) {
 		}
 	}
 
-	// write the baselines
-	Com_Memset( &nullstate, 0, sizeof( nullstate ) );
-	for ( start = 0 ; start < MAX_GENTITIES; start++ ) {
-		if ( !sv.baselineUsed[ start ] ) {
-			continue;
-		}
-		svEnt = &sv.svEntities[ start ];
-		MSG_WriteByte( &msg, svc_baseline );
-		MSG_WriteDeltaEntity( &msg, &nullstate, &svEnt->baseline, qtrue );
-	}
-
 	MSG_WriteByte( &msg, svc_EOF );
 
 	MSG_WriteLong( &msg, client - svs.clients );
@@ -740,6 +840,10 @@ void SV_ClientEnterWorld( client_t *client ) {
 		// client->serverId = sv.serverId;
 	}
 
+	// broadcast pending configstrings while this client is still primed,
+	// it gets each of them once below through csUpdated
+	SV_FlushConfigstrings();
+
 	client->state = CS_ACTIVE;
 	client->gamestateAck = GSA_ACKED;
 
@@ -904,7 +1008,10 @@ void SV_UserinfoChanged( client_t *cl, qboolean updateUserinfo, qboolean runFilt
 		Info_SetValueForKey( cl->userinfo, "name", buf );
 		val = buf;
 	}
-	Q_strncpyz( cl->name, val, sizeof( cl->name ) );
+	if ( strcmp( cl->name, val ) ) {
+		Q_strncpyz( cl->name, val, sizeof( cl->name ) );
+		SV_InvalidateQueryCache();
+	}
 
 	val = Info_ValueForKey( cl->userinfo, "handicap" );
 	if ( val[0] ) {
@@ -1144,6 +1251,7 @@ static void SV_UserMove( client_t *cl, msg_t *msg, qboolean delta ) {
 	static const usercmd_t nullcmd = { 0 };
 	usercmd_t	cmds[MAX_PACKET_USERCMDS], *cmd;
 	const usercmd_t *oldcmd;
+	clientSnapshot_t *frame;
 
 	if ( delta ) {
 		cl->deltaMessage = cl->messageAcknowledge;
@@ -1168,7 +1276,7 @@ static void SV_UserMove( client_t *cl, msg_t *msg, qboolean delta ) {
 	// also use the message acknowledge
 	key ^= cl->messageAcknowledge;
 	// also use the last acknowledged server command in the key
-	key ^= MSG_HashKey(cl->reliableCommands[ cl->reliableAcknowledge & (MAX_RELIABLE_COMMANDS-1) ], 32);
+	key ^= MSG_HashKey(SV_ReliableCommand( cl, cl->reliableAcknowledge ), 32);
 
 	oldcmd = &nullcmd;
 	for ( i = 0 ; i < cmdCount ; i++ ) {
@@ -1178,8 +1286,11 @@ static void SV_UserMove( client_t *cl, msg_t *msg, qboolean delta ) {
 	}
 
 	// save time for ping calculation
-	if ( cl->frames[ cl->messageAcknowledge & PACKET_MASK ].messageAcked == 0 ) {
-		cl->frames[ cl->messageAcknowledge & PACKET_MASK ].messageAcked = Sys_Milliseconds();
+	frame = &cl->frames[ cl->messageAcknowledge & PACKET_MASK ];
+	if ( frame->messageAcked == 0 ) {
+		frame->messageAcked = Sys_Milliseconds();
+		cl->pingTotal += frame->messageAcked - frame->messageSent;
+		cl->pingCount++;
 	}
 
 	// if this is the first usercmd we have received
@@ -201,6 +201,42 @@ static int eval_node( const filter_node_t *node )
 }
 
 
+static int format_node( const filter_node_t *node, char *buf )
+{
+	const char *s;
+
+	if ( node->fop == FOP_DROP ) // final action
+	{
+		if ( *node->p1 )
+			return sprintf( buf, "drop \"%s\"", node->p1 );
+		else
+			return sprintf( buf, "drop" );
+	}
+
+	s = op2str( node->fop );
+
+	if ( node->is_date )
+	{
+		if ( node->fop == FOP_LT ) // do not print default action for dates
+			s = "";
+		return sprintf( buf, "date %s\"%s\"", s, node->p2.string );
+	}
+
+	if ( node->fop == FOP_EQ ) // do not print default action for strings
+		s = "";
+
+	if ( node->is_string )
+	{
+		if ( node->is_quoted )
+			return sprintf( buf, "%s %s\"%s\"", node->p1, s, node->p2.string );
+		else
+			return sprintf( buf, "%s %s%s", node->p1, s, node->p2.string );
+	}
+
+	return sprintf( buf, "%s %s%i", node->p1, s, node->p2.integer );
+}
+
+
 static void dump_nodes( const filter_node_t *node, int level, int skip_tagged, FILE *f )
 {
 	char buf[ MAX_TOKEN_CHARS + 32 ];
@@ -217,83 +253,549 @@ static void dump_nodes( const filter_node_t *node, int level, int skip_tagged, F
 		for ( i = 0; i < level ; i++ )
 			fwrite( "\t", 1, 1, f );
 
-		if ( node->fop == FOP_DROP ) // final action
+		n = format_node( node, buf );
+		fwrite( buf, n, 1, f );
+
+		if ( node->fop != FOP_DROP && node->child )
 		{
-			if ( *node->p1 )
-			{
-				n = sprintf( buf, "drop \"%s\"", node->p1 );
-				fwrite( buf, n, 1, f );
-			} else
-				fwrite( "drop", 4, 1, f );
+			fwrite( " {\n", 3, 1, f );
+
+			dump_nodes( node->child, level + 1, skip_tagged, f );
+
+			fwrite( "\n", 1, 1, f );
+
+			for ( i = 0; i < level; i++ )
+				fwrite( "\t", 1, 1, f );
+
+			fwrite( "}", 1, 1, f );
+
+			if ( node->next ) 
+				fwrite( "\n", 1, 1, f );
 		}
-		else
+
+		node = node->next;
+//		if ( node && level == 0 )
+//			fwrite( "\n", 1, 1, f );
+	}
+}
+
+
+/*
+==============================================================================
+
+COMPILED FILTERS
+
+The node tree is flattened in evaluation order, every instruction knows
+where its subtree ends so a failed test just jumps over it. Userinfo keys
+are looked up at most once per evaluation. Runs of sibling IPv4 "ip"
+rules get a prefix trie in front of them that selects the matching rules
+directly, other addresses fall through to the plain instructions.
+
+==============================================================================
+*/
+
+#define MAX_FILTER_KEYS		64
+#define MAX_IPSET_MATCHES	256
+
+typedef enum
+{
+	INSN_TEST,
+	INSN_DROP,
+	INSN_IPSET,		// ip rules up to skip, selected by the trie at root
+} insn_op;
+
+typedef struct
+{
+	const filter_node_t *node;
+	insn_op	op;
+	int		key;		// index in filterKeys, -1 to evaluate the node directly
+	int		skip;		// end of subtree, next instruction if the test fails
+	int		value2;		// atoi( p2.string ) for constant integer comparisons
+	int		root;		// INSN_IPSET trie root
+	int		rules;		// INSN_IPSET rule count
+
+	// top-level statistics
+	unsigned	hits;
+	unsigned	drops;
+	int64_t		usec;
+} filter_insn_t;
+
+typedef struct
+{
+	int		child[2];
+	int		rules;		// first filter_ipref_t
+} filter_trie_t;
+
+typedef struct
+{
+	int		insn;
+	int		next;
+} filter_ipref_t;
+
+static filter_insn_t	*program;
+static int				programCount;
+static qboolean			programValid;
+
+static filter_trie_t	*trie;
+static int				trieCount, trieSize;
+static filter_ipref_t	*ipRefs;
+static int				ipRefCount, ipRefSize;
+static int				ipSetCount;
+
+static const char	*filterKeys[ MAX_FILTER_KEYS ];
+static int			filterKeyCount;
+
+static struct
+{
+	int		stamp;
+	const char *value;
+	int		integer;
+} filterValues[ MAX_FILTER_KEYS ];
+static int	filterStamp;
+
+
+static void free_program( void )
+{
+	if ( program )
+		Z_Free( program );
+	if ( trie )
+		Z_Free( trie );
+	if ( ipRefs )
+		Z_Free( ipRefs );
+
+	program = NULL;
+	trie = NULL;
+	ipRefs = NULL;
+	programCount = 0;
+	trieCount = trieSize = 0;
+	ipRefCount = ipRefSize = 0;
+	ipSetCount = 0;
+	filterKeyCount = 0;
+	programValid = qfalse;
+}
+
+
+static void *grow_array( void *data, int *size, int count, int elemSize )
+{
+	void *newData;
+
+	if ( count < *size )
+		return data;
+
+	*size = *size ? *size * 2 : 256;
+	newData = Z_Malloc( *size * elemSize );
+	if ( data )
+	{
+		memcpy( newData, data, count * elemSize );
+		Z_Free( data );
+	}
+
+	return newData;
+}
+
+
+static int count_nodes( const filter_node_t *node )
+{
+	int n = 0;
+	while ( node != NULL )
+	{
+		n += 1 + count_nodes( node->child );
+		node = node->next;
+	}
+	return n;
+}
+
+
+static int find_key( const char *key )
+{
+	int i;
+
+	for ( i = 0; i < filterKeyCount; i++ )
+	{
+		if ( strcmp( filterKeys[ i ], key ) == 0 )
+			return i;
+	}
+
+	if ( filterKeyCount >= MAX_FILTER_KEYS )
+		return -1;
+
+	filterKeys[ filterKeyCount ] = key;
+	return filterKeyCount++;
+}
+
+
+// canonical dotted quad as printed by NET_AdrToString, with
+// optional trailing ".*" octet wildcard for match patterns
+static qboolean parse_ipv4( const char *s, uint32_t *addr, int *bits, qboolean pattern )
+{
+	uint32_t a = 0;
+	int n, digits, octets = 0;
+
+	if ( pattern && s[0] == '*' && s[1] == '\0' )
+	{
+		*addr = 0;
+		*bits = 0;
+		return qtrue;
+	}
+
+	for ( ;; )
+	{
+		if ( *s == '0' && s[1] >= '0' && s[1] <= '9' )
+			return qfalse; // leading zero
+
+		for ( n = 0, digits = 0; *s >= '0' && *s <= '9'; s++, digits++ )
 		{
-			const char *s = op2str( node->fop );
+			n = n * 10 + ( *s - '0' );
+			if ( n > 255 )
+				return qfalse;
+		}
 
-			if ( node->is_date )
-			{
-				if ( node->fop == FOP_LT ) // do not print default action for dates
-					s = "";
-				n = sprintf( buf, "date %s\"%s\"", s, node->p2.string );
-			}
-			else
-			{
-				if ( node->fop == FOP_EQ ) // do not print default action for strings
-					s = "";
+		if ( digits == 0 )
+			return qfalse;
 
-				if ( node->is_string )
-				{
-					if ( node->is_quoted )
-						n = sprintf( buf, "%s %s\"%s\"", node->p1, s, node->p2.string );
-					else
-						n = sprintf( buf, "%s %s%s", node->p1, s, node->p2.string );
-				}
-				else
-				{
-					n = sprintf( buf, "%s %s%i", node->p1, s, node->p2.integer );
-				}
-			}
+		a = ( a << 8 ) | n;
+		octets++;
 
-			fwrite( buf, n, 1, f );
+		if ( octets == 4 )
+		{
+			if ( *s != '\0' )
+				return qfalse;
+			*addr = a;
+			*bits = 32;
+			return qtrue;
+		}
 
-			if ( node->child )
-			{
-				fwrite( " {\n", 3, 1, f );
+		if ( *s++ != '.' )
+			return qfalse;
 
-				dump_nodes( node->child, level + 1, skip_tagged, f );
+		if ( pattern && s[0] == '*' && s[1] == '\0' )
+		{
+			*addr = a << ( 8 * ( 4 - octets ) );
+			*bits = 8 * octets;
+			return qtrue;
+		}
+	}
+}
 
-				fwrite( "\n", 1, 1, f );
 
-				for ( i = 0; i < level; i++ )
-					fwrite( "\t", 1, 1, f );
+// quoted "ip" equality or match that selects a whole address prefix
+static qboolean ip_rule( const filter_node_t *node, uint32_t *addr, int *bits )
+{
+	if ( node->fop != FOP_EQ && node->fop != FOP_MATCH )
+		return qfalse;
+
+	if ( node->is_date || node->is_fname || !node->is_string || !node->is_quoted || node->is_cvar )
+		return qfalse;
 
-				fwrite( "}", 1, 1, f );
+	if ( strcmp( node->p1, "ip" ) != 0 )
+		return qfalse;
 
-				if ( node->next ) 
-					fwrite( "\n", 1, 1, f );
-			}
+	return parse_ipv4( node->p2.string, addr, bits, node->fop == FOP_MATCH );
+}
+
+
+static int new_trie_node( void )
+{
+	filter_trie_t *t;
+
+	trie = grow_array( trie, &trieSize, trieCount, sizeof( *trie ) );
+	t = &trie[ trieCount ];
+	t->child[0] = t->child[1] = -1;
+	t->rules = -1;
 
+	return trieCount++;
+}
+
+
+static void trie_insert( int root, uint32_t addr, int bits, int insn )
+{
+	int i, node, next, bit;
+
+	node = root;
+	for ( i = 0; i < bits; i++ )
+	{
+		bit = ( addr >> ( 31 - i ) ) & 1;
+		next = trie[ node ].child[ bit ];
+		if ( next < 0 )
+		{
+			next = new_trie_node(); // may move trie
+			trie[ node ].child[ bit ] = next;
 		}
-		node = node->next;
-//		if ( node && level == 0 )
-//			fwrite( "\n", 1, 1, f );
+		node = next;
+	}
+
+	ipRefs = grow_array( ipRefs, &ipRefSize, ipRefCount, sizeof( *ipRefs ) );
+	ipRefs[ ipRefCount ].insn = insn;
+	ipRefs[ ipRefCount ].next = -1;
+
+	// append to keep rule order
+	if ( trie[ node ].rules < 0 )
+	{
+		trie[ node ].rules = ipRefCount;
 	}
+	else
+	{
+		for ( next = trie[ node ].rules; ipRefs[ next ].next >= 0; next = ipRefs[ next ].next )
+			;
+		ipRefs[ next ].next = ipRefCount;
+	}
+
+	ipRefCount++;
 }
 
 
-static int walk_nodes( const filter_node_t *node )
+static void emit_nodes( const filter_node_t *node );
+
+static void emit_node( const filter_node_t *node )
 {
+	filter_insn_t *insn;
+	int pc;
+
+	pc = programCount++;
+	insn = &program[ pc ];
+	insn->node = node;
+	insn->key = -1;
+
+	if ( node->fop == FOP_DROP )
+	{
+		insn->op = INSN_DROP;
+		insn->skip = programCount;
+		return;
+	}
+
+	insn->op = INSN_TEST;
+	if ( !node->is_date && !node->is_fname )
+		insn->key = find_key( node->p1 );
+	if ( node->is_string && !node->is_quoted && !node->is_cvar )
+		insn->value2 = atoi( node->p2.string );
+
+	emit_nodes( node->child );
+
+	program[ pc ].skip = programCount;
+}
+
+
+static void emit_nodes( const filter_node_t *node )
+{
+	const filter_node_t *n;
+	uint32_t addr;
+	int bits, run, pc, i;
+
 	while ( node != NULL )
 	{
-		int res;
-		if ( ( res = eval_node( node ) ) != 0 ) // evaluate current node
+		for ( run = 0, n = node; n != NULL && ip_rule( n, &addr, &bits ); n = n->next )
+			run++;
+
+		if ( run < 2 || find_key( "ip" ) < 0 )
 		{
-			if ( res < 0 || ( res = walk_nodes( node->child ) ) < 0 )
-			{
-				return res;
-			}
+			emit_node( node );
+			node = node->next;
+			continue;
+		}
+
+		pc = programCount++;
+		program[ pc ].node = node;
+		program[ pc ].op = INSN_IPSET;
+		program[ pc ].key = find_key( "ip" );
+		program[ pc ].root = new_trie_node();
+		program[ pc ].rules = run;
+		ipSetCount++;
+
+		for ( i = 0; i < run; i++, node = node->next )
+		{
+			ip_rule( node, &addr, &bits );
+			trie_insert( program[ pc ].root, addr, bits, programCount );
+			emit_node( node );
+		}
+
+		program[ pc ].skip = programCount;
+	}
+}
+
+
+static void compile_nodes( void )
+{
+	int count;
+
+	free_program();
+
+	count = count_nodes( nodes );
+	if ( count )
+	{
+		// every ip set covers at least two nodes
+		program = Z_Malloc( ( count + count / 2 + 1 ) * sizeof( *program ) );
+		emit_nodes( nodes );
+	}
+
+	programValid = qtrue;
+
+	Com_DPrintf( "...%i filter nodes compiled into %i instructions, %i ip sets\n",
+		count, programCount, ipSetCount );
+}
+
+
+static const char *insn_value( int key )
+{
+	if ( filterValues[ key ].stamp != filterStamp )
+	{
+		filterValues[ key ].stamp = filterStamp;
+		filterValues[ key ].value = Info_ValueForKeyToken( filterKeys[ key ] );
+		filterValues[ key ].integer = atoi( filterValues[ key ].value );
+	}
+
+	return filterValues[ key ].value;
+}
+
+
+// same results as eval_node() with cached userinfo values
+static int eval_insn( const filter_insn_t *insn )
+{
+	const filter_node_t *node = insn->node;
+	const char *value, *value2;
+	int v1, v2;
+
+	if ( insn->key < 0 )
+		return eval_node( node );
+
+	value = insn_value( insn->key );
+
+	if ( node->is_string )
+	{
+		value2 = node->p2.string;
+		if ( node->is_cvar ) // dereference value2
+			value2 = Cvar_VariableString( value2 + 1 );
+
+		if ( node->fop == FOP_MATCH )
+			return Com_FilterExt( value2, value );
+
+		if ( node->is_quoted ) // forced string comparison
+		{
+			v1 = Q_stricmp( value, value2 );
+			v2 = 0;
+		}
+		else // integer comparison
+		{
+			v1 = filterValues[ insn->key ].integer;
+			v2 = node->is_cvar ? atoi( value2 ) : insn->value2;
+		}
+	}
+	else
+	{
+		v1 = filterValues[ insn->key ].integer;
+		v2 = node->p2.integer;
+	}
+
+	switch ( node->fop )
+	{
+		case FOP_EQ:   return (v1 == v2);
+		case FOP_NEQ:  return (v1 != v2);
+		case FOP_LT:   return (v1 <  v2);
+		case FOP_LTE:  return (v1 <= v2);
+		case FOP_GT:   return (v1 >  v2);
+		case FOP_GTE:  return (v1 >= v2);
+		default:       return 0;
+	}
+}
+
+
+static int exec_insns( int pc, int end );
+
+// returns -1 on drop, 1 if the set was handled by the trie
+static int exec_ipset( const filter_insn_t *set )
+{
+	int matches[ MAX_IPSET_MATCHES ];
+	int i, j, n, node, depth, ref, res;
+	uint32_t addr;
+
+	if ( !parse_ipv4( insn_value( set->key ), &addr, &i, qfalse ) )
+		return 0;
+
+	// collect rules of all matching prefixes
+	n = 0;
+	node = set->root;
+	for ( depth = 0; ; depth++ )
+	{
+		for ( ref = trie[ node ].rules; ref >= 0; ref = ipRefs[ ref ].next )
+		{
+			if ( n >= MAX_IPSET_MATCHES )
+				return 0;
+			// keep source order
+			for ( j = n; j > 0 && matches[ j - 1 ] > ipRefs[ ref ].insn; j-- )
+				matches[ j ] = matches[ j - 1 ];
+			matches[ j ] = ipRefs[ ref ].insn;
+			n++;
+		}
+		if ( depth == 32 )
+			break;
+		node = trie[ node ].child[ ( addr >> ( 31 - depth ) ) & 1 ];
+		if ( node < 0 )
+			break;
+	}
+
+	for ( i = 0; i < n; i++ )
+	{
+		res = exec_insns( matches[ i ] + 1, program[ matches[ i ] ].skip );
+		if ( res < 0 )
+			return res;
+	}
+
+	return 1;
+}
+
+
+static int exec_insns( int pc, int end )
+{
+	const filter_insn_t *insn;
+	int res;
+
+	while ( pc < end )
+	{
+		insn = &program[ pc ];
+		switch ( insn->op )
+		{
+			case INSN_DROP:
+				Q_strncpyz( filterMessage, insn->node->p1, sizeof( filterMessage ) );
+				return -1;
+
+			case INSN_IPSET:
+				res = exec_ipset( insn );
+				if ( res < 0 )
+					return res;
+				pc = res ? insn->skip : pc + 1;
+				break;
+
+			default:
+				pc = eval_insn( insn ) ? pc + 1 : insn->skip;
+				break;
+		}
+	}
+
+	return 0;
+}
+
+
+static int run_program( void )
+{
+	filter_insn_t *insn;
+	int64_t start;
+	int pc, res;
+
+	filterStamp++;
+
+	for ( pc = 0; pc < programCount; pc = insn->skip )
+	{
+		insn = &program[ pc ];
+
+		start = Sys_Microseconds();
+		res = exec_insns( pc, insn->skip );
+		insn->usec += Sys_Microseconds() - start;
+		insn->hits++;
+
+		if ( res < 0 )
+		{
+			insn->drops++;
+			return res;
 		}
-		node = node->next;
 	}
 
 	return 0;
@@ -671,6 +1173,7 @@ static qboolean parse_file( const char *filename )
 	int size;
 	
 	// unconditionally release old filters
+	free_program();
 	free_nodes( nodes );
 	nodes = NULL;
 
@@ -772,6 +1275,7 @@ static void SV_ReloadFilters( const char *filename, filter_node_t *new_node )
 			// link new new node
 			new_node->next = nodes;
 			nodes = new_node;
+			programValid = qfalse;
 			dump = qtrue;
 		}
 
@@ -843,7 +1347,10 @@ const char *SV_RunFilters( const char *userinfo, const netadr_t *addr )
 	filterMessage[0] = '\0';
 	filterCurrMsec = Sys_Milliseconds();
 
-	if ( walk_nodes( nodes ) != 0 )
+	if ( !programValid )
+		compile_nodes();
+
+	if ( run_program() != 0 )
 	{
 		if ( filterMessage[0] )
 			return filterMessage;
@@ -855,6 +1362,43 @@ const char *SV_RunFilters( const char *userinfo, const netadr_t *addr )
 }
 
 
+/*
+===============
+SV_FilterStats_f
+
+Prints evaluation cost of every top-level rule
+===============
+*/
+void SV_FilterStats_f( void )
+{
+	char buf[ MAX_TOKEN_CHARS + 32 ];
+	const filter_insn_t *insn;
+	int pc;
+
+	if ( !programValid )
+	{
+		Com_Printf( "No compiled filters.\n" );
+		return;
+	}
+
+	Com_Printf( "%i instructions, %i keys, %i ip sets, %i trie nodes\n",
+		programCount, filterKeyCount, ipSetCount, trieCount );
+	Com_Printf( "    hits    drops     usec  avg usec  rule\n" );
+
+	for ( pc = 0; pc < programCount; pc = insn->skip )
+	{
+		insn = &program[ pc ];
+		if ( insn->op == INSN_IPSET )
+			Com_sprintf( buf, sizeof( buf ), "ip set of %i rules", insn->rules );
+		else
+			format_node( insn->node, buf );
+
+		Com_Printf( "%8u %8u %8i %9.2f  %s\n", insn->hits, insn->drops, (int)insn->usec,
+			insn->hits ? (double)insn->usec / insn->hits : 0.0, buf );
+	}
+}
+
+
 #define IS_LEAP(year) ( ( ( (year) % 4 == 0 ) && ( (year) % 100 != 0 ) ) || ( (year) % 400 == 0 ) )
 
 /* Add hours to specified date */
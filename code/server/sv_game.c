@@ -42,6 +42,7 @@ sharedEntity_t* SV_GEntityForSvEntity(svEntity_t* svEnt) {
 }
 
 static void SV_GameSendServerCommand(int clientNum, const char* text) {
+	SV_RecordCommand(clientNum, text);
 	if(clientNum == -1) {
 		SV_SendServerCommand(NULL, "%s", text);
 	} else {
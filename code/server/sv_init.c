@@ -75,7 +75,8 @@ static void SV_SendConfigstring(client_t *client, int index)
 SV_UpdateConfigstrings
 
 Called when a client goes from CS_PRIMED to CS_ACTIVE.  Updates all
-Configstring indexes that have changed while the client was in CS_PRIMED
+Configstring indexes that have changed while the client was in CS_PRIMED,
+pending broadcasts must have been flushed before the state change
 ===============
 */
 void SV_UpdateConfigstrings(client_t *client)
@@ -97,6 +98,52 @@ void SV_UpdateConfigstrings(client_t *client)
 	}
 }
 
+/*
+===============
+SV_FlushConfigstrings
+
+Sends configstrings changed since the last flush to all active clients.
+Called once per frame and before any other reliable command is added,
+so only the final value of an index rewritten in between goes out
+===============
+*/
+void SV_FlushConfigstrings( void ) {
+	int		index, i;
+	client_t	*client;
+
+	if ( !sv.numCsDirty || sv.csFlushing ) {
+		return;
+	}
+
+	sv.csFlushing = qtrue;
+
+	// sending may drop clients and the game may set more configstrings
+	while ( sv.numCsDirty ) {
+		for ( index = 0; index < MAX_CONFIGSTRINGS && sv.numCsDirty; index++ ) {
+			if ( !sv.csDirty[ index ] ) {
+				continue;
+			}
+			sv.csDirty[ index ] = 0;
+			sv.numCsDirty--;
+
+			for ( i = 0, client = svs.clients; i < sv.maxclients; i++, client++ ) {
+				if ( client->state < CS_ACTIVE ) {
+					continue;
+				}
+				// do not always send server info to all clients
+				if ( index == CS_SERVERINFO && ( SV_GentityNum( i )->r.svFlags & SVF_NOSERVERINFO ) ) {
+					continue;
+				}
+
+				SV_SendConfigstring( client, index );
+			}
+		}
+	}
+
+	sv.csFlushing = qfalse;
+}
+
+
 /*
 ===============
 SV_SetConfigstring
@@ -124,25 +171,26 @@ void SV_SetConfigstring (int index, const char *val) {
 	Z_Free( sv.configstrings[index] );
 	sv.configstrings[index] = CopyString( val );
 
+	SV_RecordConfigstring( index );
+
+	SV_InvalidateQueryCache();
+	SV_InvalidateGameState();
+
 	// send it to all the clients if we aren't
 	// spawning a new server
 	if ( sv.state == SS_GAME || sv.restarting ) {
 
-		// send the data to all relevant clients
+		// active clients get it on next flush
+		if ( !sv.csDirty[ index ] ) {
+			sv.csDirty[ index ] = 1;
+			sv.numCsDirty++;
+		}
+
 		for (i = 0, client = svs.clients; i < sv.maxclients; i++, client++) {
-			if ( client->state < CS_ACTIVE ) {
-				if ( client->state == CS_PRIMED || client->state == CS_CONNECTED ) {
-					// track CS_CONNECTED clients as well to optimize gamestate acknowledge after downloading/retransmission
-					client->csUpdated[index] = qtrue;
-				}
-				continue;
-			}
-			// do not always send server info to all clients
-			if ( index == CS_SERVERINFO && ( SV_GentityNum( i )->r.svFlags & SVF_NOSERVERINFO ) ) {
-				continue;
+			if ( client->state == CS_PRIMED || client->state == CS_CONNECTED ) {
+				// track CS_CONNECTED clients as well to optimize gamestate acknowledge after downloading/retransmission
+				client->csUpdated[index] = qtrue;
 			}
-
-			SV_SendConfigstring(client, index);
 		}
 	}
 }
@@ -233,6 +281,8 @@ static void SV_CreateBaseline( void ) {
 		sv.svEntities[ entnum ].baseline = ent->s;
 		sv.baselineUsed[ entnum ] = 1;
 	}
+
+	SV_InvalidateGameState();
 }
 
 /*
@@ -243,7 +293,16 @@ SV_SetSnapshotParams
 static void SV_SetSnapshotParams( void )
 {
 	// PACKET_BACKUP frames is just about 6.67MB so use that even on listen servers
-	svs.numSnapshotEntities = PACKET_BACKUP * MAX_GENTITIES;
+	// and grow later only if the level links more entities
+	svs.numSnapshotEntities = PACKET_BACKUP * SNAPSHOT_BASE_ENTITIES;
+
+	// client frames reference common snapshot entities by index, start
+	// with about SNAPSHOT_BASE_ENTITIES/16 entities per client frame,
+	// SV_BuildClientSnapshot grows the ring when a delta window doesn't fit
+	svs.numSnapshotIndexes = PACKET_BACKUP * MAX_SNAPSHOT_ENTITIES;
+	while ( svs.numSnapshotIndexes < sv.maxclients * PACKET_BACKUP * ( SNAPSHOT_BASE_ENTITIES / 16 ) ) {
+		svs.numSnapshotIndexes <<= 1;
+	}
 }
 
 
@@ -302,6 +361,8 @@ static void SV_ClearServer( void ) {
 		}
 	}
 
+	SV_InvalidateGameState();
+
 	i = sv.time;
 	Com_Memset( &sv, 0, sizeof( sv ) );
 	sv.time = i;
@@ -323,6 +384,8 @@ void SV_SpawnServer( const char *mapname ) {
 	qboolean	isBot;
 	const char	*p;
 
+	SV_InvalidateQueryCache();
+
 	// shut down the existing game if it is running
 	SV_ShutdownGameProgs();
 	JS_Restart();
@@ -348,7 +411,9 @@ void SV_SpawnServer( const char *mapname ) {
 	if ( !com_sv_running->integer ) SV_Startup();
 
 	// allocate the snapshot entities on the hunk
+	SV_FreeSnapshotStorage();
 	svs.snapshotEntities = Hunk_Alloc( sizeof(entityState_t)*svs.numSnapshotEntities );
+	svs.snapshotIndexes = Hunk_Alloc( sizeof(int)*svs.numSnapshotIndexes );
 
 	// initialize snapshot storage
 	SV_InitSnapshotStorage();
@@ -481,6 +546,9 @@ void SV_SpawnServer( const char *mapname ) {
 
 	Hunk_SetMark();
 
+	SV_CaptureMap();
+	SV_RecordMap();
+
 	Com_Printf ("-----------------------------------\n");
 
 	// suppress hitch warning
@@ -528,6 +596,14 @@ void SV_Init( void )
 	sv_anticheatengine = Cvar_Get( "sv_anticheatengine", "0", CVAR_ARCHIVE | CVAR_SERVERINFO );
 	sv_ace_wallhack = Cvar_Get( "sv_ace_wallhack", "2", CVAR_ARCHIVE );
 	sv_filter = Cvar_Get( "sv_filter", "filter.txt", CVAR_ARCHIVE );
+	sv_deltaCache = Cvar_Get( "sv_deltaCache", "1", 0 );
+	sv_snapshotBudget = Cvar_Get( "sv_snapshotBudget", "0", CVAR_ARCHIVE );
+	sv_snapshotTiers = Cvar_Get( "sv_snapshotTiers", "0", CVAR_ARCHIVE );
+	sv_areaGrid = Cvar_Get( "sv_areaGrid", "0", CVAR_ARCHIVE );
+	sv_autoRecord = Cvar_Get( "sv_autoRecord", "0", CVAR_ARCHIVE );
+	sv_recordBuffer = Cvar_Get( "sv_recordBuffer", "8192", CVAR_ARCHIVE );
+	sv_statsLog = Cvar_Get( "sv_statsLog", "", CVAR_ARCHIVE );
+	sv_statsLogInterval = Cvar_Get( "sv_statsLogInterval", "10", CVAR_ARCHIVE );
 
 	SV_BotInitCvars();
 	SV_BotInitBotLib();
@@ -585,12 +661,18 @@ before Sys_Quit or Sys_Error
 ================
 */
 void SV_Shutdown( const char *finalmsg ) {
+	SV_StopCapture();
+	SV_StopRecord();
+	SV_CloseStatsLog();
+
 	if ( !com_sv_running || !com_sv_running->integer ) {
 		return;
 	}
 
 	Com_Printf( "Server shutdown... (%s)\n", finalmsg );
 
+	SV_InvalidateQueryCache();
+
 #ifdef USE_IPV6
 	NET_LeaveMulticast6();
 #endif
@@ -599,18 +681,26 @@ void SV_Shutdown( const char *finalmsg ) {
 		SV_FinalMessage( finalmsg );
 	}
 
+	// after the final message so it isn't sent to simulated clients
+	SV_StopLoadTest();
+
 	SV_MasterShutdown();
 	SV_ShutdownGameProgs();
 
 	// free current level
 	SV_ClearServer();
+	SV_FreeSnapshotStorage();
 
 	// free server static data
 	if ( svs.clients ) {
 		int index;
 
-		for ( index = 0; index < sv.maxclients; index++ )
+		for ( index = 0; index < sv.maxclients; index++ ) {
 			SV_FreeClient( &svs.clients[ index ] );
+			SV_FreeReliableCommands( &svs.clients[ index ] );
+			SV_FreeEntityPriority( &svs.clients[ index ] );
+			SV_FreeClientFrames( &svs.clients[ index ] );
+		}
 
 		Z_Free( svs.clients );
 	}
@@ -0,0 +1,1139 @@
+/*
+===========================================================================
+Copyright (C) 1999-2005 Id Software, Inc.
+
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+#include "server.h"
+
+/*
+=============================================================================
+
+SIMULATED CLIENT LOAD TEST
+
+Headless clients connect to the running server the same way real ones
+do: getchallenge, connect, a netchan carrying the gamestate and delta
+snapshots, and usercmds that go through SV_UserMove.  No sockets are
+used, their packets are handed to SV_PacketEvent at the start of every
+SV_Frame and the replies are caught by the send sink, then decoded with
+the packetentities parser shared with the client.
+
+Simulated clients get addresses from the 198.18.0.0/15 benchmarking
+range, packets to those addresses never reach the network.
+
+=============================================================================
+*/
+
+#define LOAD_PORT				27960
+#define LOAD_PARSE_ENTITIES		( MAX_SNAPSHOT_ENTITIES * 2 )	// smallest ring that can always delta
+#define LOAD_RESEND_MSEC		1000	// getchallenge and connect retransmit
+#define LOAD_CONNECT_STAGGER	20		// msec between client connects
+#define LOAD_CMD_MSEC			8		// usercmd interval, like com_maxfps 125
+#define LOAD_RATE				25000
+
+typedef enum {
+	LS_WAITING,			// not started yet
+	LS_CHALLENGING,
+	LS_CONNECTING,
+	LS_CONNECTED,		// netchan is up, waiting for the gamestate
+	LS_PRIMED,			// sending usercmds, waiting for a snapshot
+	LS_ACTIVE,
+	LS_DISCONNECTED
+} loadState_t;
+
+typedef struct {
+	qboolean		valid;
+	int				messageNum;
+	int				serverTime;
+	int				parseEntitiesNum;
+	int				numEntities;
+	playerState_t	ps;
+} loadSnapshot_t;
+
+typedef struct {
+	int				realtime;
+	int				serverTime;		// of the last usercmd in the packet
+} loadOutPacket_t;
+
+typedef struct {
+	loadState_t		state;
+	netadr_t		address;
+	netchan_t		netchan;
+	int				connectTime;	// last getchallenge or connect
+	int				clientChallenge;
+	int				challenge;
+
+	int				serverId;
+	int				checksumFeed;
+	int				serverMessageSequence;
+	int				serverCommandSequence;
+	int				commandHash[ MAX_RELIABLE_COMMANDS ];	// MSG_HashKey of each server command
+
+	entityParse_t	parse;
+	loadSnapshot_t	snap;			// latest valid snapshot
+	int				snapRealtime;
+	loadSnapshot_t	snapshots[ PACKET_BACKUP ];
+	loadOutPacket_t	outPackets[ PACKET_BACKUP ];
+
+	// input
+	int				seed;
+	usercmd_t		cmd;
+	float			yaw, pitch;
+	float			yawSpeed;
+	int				moveButtons;
+	int				nextMoveChange;
+	int				lastCmdTime;
+
+	// totals
+	int64_t			bytes;
+	int				snapshotCount;
+	int				deltaSnapshots;
+	int				invalidSnapshots;
+	int64_t			entityCount;
+	char			message[ 64 ];	// last print or disconnect reason
+} loadClient_t;
+
+typedef struct {
+	byte			*data;
+	int				size;
+	int				used;
+} loadQueue_t;
+
+// queued packet, followed by length bytes of data
+typedef struct {
+	int				client;
+	int				length;
+} loadPacket_t;
+
+typedef struct {
+	qboolean		active;
+	qboolean		draining;		// stopped, waiting for the server to free the slots
+	loadClient_t	*clients;
+	int				numClients;
+	netadr_t		serverAddress;
+	int				qport;
+	entityState_t	*baselines;		// gamestates are the same for every client
+	int				baselineServerId;
+
+	int				startTime;
+	int				endTime;		// 0 runs until loadteststop
+	int				sender;			// client transmitting, -1 for none
+	loadQueue_t		toServer;
+	loadQueue_t		toClients;
+
+	// measurements
+	int64_t			frameStart;
+	sampleList_t	frameTimes;		// usec
+	sampleList_t	latencies;		// msec
+	int64_t			packetTime;
+	int				numPackets;
+	int64_t			decodeTime;
+	int				failedClients;	// stopped on a decode error
+
+	fileHandle_t	dump;			// server messages to the first client, for huffbench
+	int				dumpMessages;
+	char			dumpName[ MAX_QPATH ];
+} load_t;
+
+static load_t	load;
+static byte		loadMsgBuf[ MAX_MSGLEN_BUF ];
+
+
+/*
+==================
+SV_LoadAddress
+
+Returns the simulated client index for an address in the benchmarking
+range, -1 if none, -2 if it is in the range but unused
+==================
+*/
+static int SV_LoadAddress( const netadr_t *adr ) {
+	int index;
+
+	if ( adr->type != NA_IP || adr->ipv._4[0] != 198 || ( adr->ipv._4[1] & 0xfe ) != 18 ) {
+		return -1;
+	}
+
+	index = ( ( adr->ipv._4[1] & 1 ) << 16 | adr->ipv._4[2] << 8 | adr->ipv._4[3] ) - 1;
+	if ( !load.active || index < 0 || index >= load.numClients ) {
+		return -2;
+	}
+
+	return index;
+}
+
+
+/*
+==================
+SV_LoadQueue
+==================
+*/
+static void SV_LoadQueue( loadQueue_t *q, int client, int length, const void *data ) {
+	loadPacket_t	*p;
+	int				need;
+	byte			*grow;
+
+	need = sizeof( *p ) + PAD( length, 4 );
+	if ( q->used + need > q->size ) {
+		int size = q->size ? q->size : 64 * 1024;
+		while ( q->used + need > size ) {
+			size *= 2;
+		}
+		grow = realloc( q->data, size );
+		if ( !grow ) {
+			return;
+		}
+		q->data = grow;
+		q->size = size;
+	}
+
+	p = (loadPacket_t *)( q->data + q->used );
+	p->client = client;
+	p->length = length;
+	Com_Memcpy( p + 1, data, length );
+	q->used += need;
+}
+
+
+/*
+==================
+SV_LoadSend
+
+Replaces the sockets while a load test runs, packets to and from
+simulated clients are queued and everything else is sent as usual,
+without sv_packetdelay
+==================
+*/
+static void SV_LoadSend( netsrc_t sock, int length, const void *data, const netadr_t *to ) {
+	int index;
+
+	if ( sock == NS_CLIENT ) {
+		if ( load.sender >= 0 ) {
+			SV_LoadQueue( &load.toServer, load.sender, length, data );
+		}
+		return;
+	}
+
+	index = SV_LoadAddress( to );
+	if ( index == -1 ) {
+		Sys_SendPacket( length, data, to );
+	} else if ( index >= 0 ) {
+		SV_LoadQueue( &load.toClients, index, length, data );
+	}
+}
+
+
+/*
+=============================================================================
+
+SIMULATED CLIENT MESSAGE PARSING
+
+=============================================================================
+*/
+
+/*
+==================
+SV_LoadClientFailed
+
+A simulated client that can't decode what the server sent stops and
+gives up its slot, instead of a Com_Error that would drop the server
+==================
+*/
+static qboolean SV_LoadClientFailed( loadClient_t *lc, const char *reason ) {
+	client_t	*cl;
+	int			i;
+
+	Q_strncpyz( lc->message, reason, sizeof( lc->message ) );
+	lc->state = LS_DISCONNECTED;
+	load.failedClients++;
+
+	for ( i = 0, cl = svs.clients; i < sv.maxclients; i++, cl++ ) {
+		if ( cl->state != CS_FREE && SV_LoadAddress( &cl->netchan.remoteAddress ) == lc - load.clients ) {
+			SV_DropClient( cl, "load client decode error" );
+		}
+	}
+
+	return qfalse;
+}
+
+
+/*
+==================
+SV_LoadParseGamestate
+==================
+*/
+static qboolean SV_LoadParseGamestate( loadClient_t *lc, msg_t *msg ) {
+	entityState_t	nullstate;
+	qboolean		baselines;
+	const char		*s;
+	int				cmd, i;
+
+	Com_Memset( &nullstate, 0, sizeof( nullstate ) );
+	baselines = qfalse;
+
+	lc->serverCommandSequence = MSG_ReadLong( msg );
+
+	while ( 1 ) {
+		cmd = MSG_ReadByte( msg );
+
+		if ( cmd == svc_EOF ) {
+			break;
+		}
+
+		if ( cmd == svc_configstring ) {
+			i = MSG_ReadShort( msg );
+			s = MSG_ReadBigString( msg );
+			if ( i == CS_SYSTEMINFO ) {
+				lc->serverId = atoi( Info_ValueForKey( s, "sv_serverid" ) );
+			}
+		} else if ( cmd == svc_baseline ) {
+			// systeminfo comes first, a new serverId means stale baselines
+			if ( !baselines && lc->serverId != load.baselineServerId ) {
+				Com_Memset( load.baselines, 0, MAX_GENTITIES * sizeof( entityState_t ) );
+				load.baselineServerId = lc->serverId;
+			}
+			baselines = qtrue;
+
+			i = MSG_ReadEntitynum( msg );
+			if ( i < 0 || i >= MAX_GENTITIES ) {
+				return SV_LoadClientFailed( lc, va( "baseline number out of range: %i", i ) );
+			}
+			MSG_ReadDeltaEntity( msg, &nullstate, &load.baselines[ i ], i );
+		} else {
+			return SV_LoadClientFailed( lc, va( "bad gamestate command byte %i", cmd ) );
+		}
+	}
+
+	MSG_ReadLong( msg );	// clientNum
+	lc->checksumFeed = MSG_ReadLong( msg );
+
+	for ( i = 0; i < PACKET_BACKUP; i++ ) {
+		lc->snapshots[ i ].valid = qfalse;
+	}
+	lc->snap.valid = qfalse;
+	lc->snap.serverTime = 0;
+
+	lc->state = LS_PRIMED;
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_LoadParseCommand
+==================
+*/
+static void SV_LoadParseCommand( loadClient_t *lc, msg_t *msg ) {
+	const char	*s;
+	int			seq;
+
+	seq = MSG_ReadLong( msg );
+	s = MSG_ReadString( msg );
+
+	if ( lc->serverCommandSequence - seq >= 0 ) {
+		return;
+	}
+	lc->serverCommandSequence = seq;
+	lc->commandHash[ seq & ( MAX_RELIABLE_COMMANDS - 1 ) ] = MSG_HashKey( s, 32 );
+
+	Cmd_TokenizeString( s );
+	if ( !strcmp( Cmd_Argv( 0 ), "disconnect" ) ) {
+		Q_strncpyz( lc->message, Cmd_Argv( 1 ), sizeof( lc->message ) );
+		lc->state = LS_DISCONNECTED;
+	} else if ( !strcmp( Cmd_Argv( 0 ), "cs" ) && atoi( Cmd_Argv( 1 ) ) == CS_SYSTEMINFO ) {
+		// map_restart changes the serverId without a new gamestate
+		lc->serverId = atoi( Info_ValueForKey( Cmd_Argv( 2 ), "sv_serverid" ) );
+	}
+}
+
+
+/*
+==================
+SV_LoadParseSnapshot
+
+Same validation as CL_ParseSnapshot
+==================
+*/
+static qboolean SV_LoadParseSnapshot( loadClient_t *lc, msg_t *msg, int now ) {
+	const loadSnapshot_t *old;
+	loadSnapshot_t	newSnap;
+	byte			areamask[ MAX_MAP_AREA_BYTES ];
+	int				deltaNum, areabytes;
+	int				oldMessageNum;
+	int				i, n, packetNum;
+
+	Com_Memset( &newSnap, 0, sizeof( newSnap ) );
+
+	newSnap.serverTime = MSG_ReadLong( msg );
+	newSnap.messageNum = lc->serverMessageSequence;
+
+	deltaNum = MSG_ReadByte( msg );
+	MSG_ReadByte( msg );	// snapFlags
+
+	if ( !deltaNum ) {
+		newSnap.valid = qtrue;
+		old = NULL;
+	} else {
+		old = &lc->snapshots[ ( newSnap.messageNum - deltaNum ) & PACKET_MASK ];
+		if ( old->valid && old->messageNum == newSnap.messageNum - deltaNum
+			&& lc->parse.num - old->parseEntitiesNum <= LOAD_PARSE_ENTITIES - MAX_SNAPSHOT_ENTITIES ) {
+			newSnap.valid = qtrue;
+		}
+	}
+
+	areabytes = MSG_ReadByte( msg );
+	if ( areabytes > sizeof( areamask ) ) {
+		return SV_LoadClientFailed( lc, va( "invalid size %d for areamask", areabytes ) );
+	}
+	MSG_ReadData( msg, areamask, areabytes );
+
+	MSG_ReadDeltaPlayerstate( msg, old ? &old->ps : NULL, &newSnap.ps );
+
+	newSnap.parseEntitiesNum = lc->parse.num;
+	if ( old ) {
+		newSnap.numEntities = MSG_ParsePacketEntities( msg, &lc->parse, old->parseEntitiesNum, old->numEntities );
+	} else {
+		newSnap.numEntities = MSG_ParsePacketEntities( msg, &lc->parse, 0, 0 );
+	}
+
+	if ( newSnap.numEntities < 0 ) {
+		return SV_LoadClientFailed( lc, "packet entities end early" );
+	}
+
+	if ( !newSnap.valid ) {
+		lc->invalidSnapshots++;
+		return qtrue;
+	}
+
+	// drop frames that were skipped so they can't be used as a delta base
+	oldMessageNum = lc->snap.messageNum + 1;
+	if ( newSnap.messageNum - oldMessageNum >= PACKET_BACKUP ) {
+		oldMessageNum = newSnap.messageNum - ( PACKET_BACKUP - 1 );
+	}
+	for ( i = 0, n = newSnap.messageNum - oldMessageNum; i < n; i++ ) {
+		lc->snapshots[ ( oldMessageNum + i ) & PACKET_MASK ].valid = qfalse;
+	}
+
+	lc->snap = newSnap;
+	lc->snapRealtime = now;
+	lc->snapshots[ newSnap.messageNum & PACKET_MASK ] = newSnap;
+
+	lc->snapshotCount++;
+	lc->entityCount += newSnap.numEntities;
+	if ( old ) {
+		lc->deltaSnapshots++;
+	}
+	lc->state = LS_ACTIVE;
+
+	// time from sending a usercmd to seeing it executed, like cl.snap.ping
+	for ( i = 0; i < PACKET_BACKUP; i++ ) {
+		packetNum = ( lc->netchan.outgoingSequence - 1 - i ) & PACKET_MASK;
+		if ( !lc->outPackets[ packetNum ].realtime ) {
+			break;
+		}
+		if ( newSnap.ps.commandTime - lc->outPackets[ packetNum ].serverTime >= 0 ) {
+			SV_AddSample( &load.latencies, now - lc->outPackets[ packetNum ].realtime );
+			break;
+		}
+	}
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_LoadParseServerMessage
+==================
+*/
+static void SV_LoadParseServerMessage( loadClient_t *lc, msg_t *msg, int now ) {
+	int cmd;
+
+	MSG_Bitstream( msg );
+	MSG_ReadLong( msg );	// reliableAcknowledge, there is nothing to resend
+
+	while ( lc->state != LS_DISCONNECTED ) {
+		if ( msg->readcount > msg->cursize ) {
+			SV_LoadClientFailed( lc, "read past end of server message" );
+			break;
+		}
+
+		cmd = MSG_ReadByte( msg );
+		if ( cmd == svc_EOF ) {
+			break;
+		}
+
+		switch ( cmd ) {
+		case svc_nop:
+			break;
+		case svc_serverCommand:
+			SV_LoadParseCommand( lc, msg );
+			break;
+		case svc_gamestate:
+			SV_LoadParseGamestate( lc, msg );
+			break;
+		case svc_snapshot:
+			SV_LoadParseSnapshot( lc, msg, now );
+			break;
+		default:
+			SV_LoadClientFailed( lc, va( "illegible server message %i", cmd ) );
+			break;
+		}
+	}
+}
+
+
+/*
+==================
+SV_LoadConnectionless
+==================
+*/
+static void SV_LoadConnectionless( loadClient_t *lc, msg_t *msg, int now ) {
+	const char *c;
+
+	MSG_BeginReadingOOB( msg );
+	MSG_ReadLong( msg );	// skip the -1
+
+	Cmd_TokenizeString( MSG_ReadStringLine( msg ) );
+	c = Cmd_Argv( 0 );
+
+	if ( !Q_stricmp( c, "challengeResponse" ) ) {
+		if ( lc->state == LS_CHALLENGING && atoi( Cmd_Argv( 2 ) ) == lc->clientChallenge ) {
+			lc->challenge = atoi( Cmd_Argv( 1 ) );
+			lc->state = LS_CONNECTING;
+			lc->connectTime = now - LOAD_RESEND_MSEC;
+		}
+	} else if ( !Q_stricmp( c, "connectResponse" ) ) {
+		if ( lc->state == LS_CONNECTING && atoi( Cmd_Argv( 1 ) ) == lc->challenge ) {
+			Netchan_Setup( NS_CLIENT, &lc->netchan, &load.serverAddress, load.qport, lc->challenge );
+			lc->serverMessageSequence = 0;
+			lc->serverCommandSequence = 0;
+			Com_Memset( lc->commandHash, 0, sizeof( lc->commandHash ) );
+			Com_Memset( lc->outPackets, 0, sizeof( lc->outPackets ) );
+			lc->state = LS_CONNECTED;
+		}
+	} else if ( !Q_stricmp( c, "print" ) ) {
+		char *nl;
+		Q_strncpyz( lc->message, MSG_ReadString( msg ), sizeof( lc->message ) );
+		if ( ( nl = strchr( lc->message, '\n' ) ) != NULL ) {
+			*nl = '\0';
+		}
+	} else if ( !Q_stricmp( c, "disconnect" ) ) {
+		lc->state = LS_DISCONNECTED;
+	}
+}
+
+
+/*
+==================
+SV_LoadDumpMessage
+
+Writes a server message without its netchan header as a sequence
+number and a length followed by the payload, the input of huffbench
+==================
+*/
+static void SV_LoadDumpMessage( const msg_t *msg, int sequence ) {
+	int header[2];
+
+	header[0] = LittleLong( sequence );
+	header[1] = LittleLong( msg->cursize - msg->readcount );
+	FS_Write( header, sizeof( header ), load.dump );
+	FS_Write( msg->data + msg->readcount, msg->cursize - msg->readcount, load.dump );
+	load.dumpMessages++;
+}
+
+
+/*
+==================
+SV_LoadClientPacket
+==================
+*/
+static void SV_LoadClientPacket( loadClient_t *lc, const byte *data, int length, int now ) {
+	msg_t	msg;
+	int64_t	start;
+
+	lc->bytes += length;
+
+	MSG_Init( &msg, loadMsgBuf, MAX_MSGLEN );
+	Com_Memcpy( loadMsgBuf, data, length );
+	msg.cursize = length;
+
+	if ( *(int32_t *)loadMsgBuf == -1 ) {
+		SV_LoadConnectionless( lc, &msg, now );
+		return;
+	}
+
+	if ( lc->state < LS_CONNECTED || lc->state == LS_DISCONNECTED ) {
+		return;
+	}
+
+	if ( !Netchan_Process( &lc->netchan, &msg ) ) {
+		return;		// out of order, duplicated or a partial fragment
+	}
+
+	lc->serverMessageSequence = LittleLong( *(int32_t *)msg.data );
+
+	if ( load.dump != FS_INVALID_HANDLE && lc == load.clients ) {
+		SV_LoadDumpMessage( &msg, lc->serverMessageSequence );
+	}
+
+	start = Sys_Microseconds();
+	SV_LoadParseServerMessage( lc, &msg, now );
+	load.decodeTime += Sys_Microseconds() - start;
+}
+
+
+/*
+=============================================================================
+
+SIMULATED CLIENT INPUT
+
+=============================================================================
+*/
+
+/*
+==================
+SV_LoadNextCommand
+
+Wanders around: mostly forward with some strafing, turning at a
+random rate, jumping now and then
+==================
+*/
+static void SV_LoadNextCommand( loadClient_t *lc, int serverTime, int now ) {
+	static const int moves[] = {
+		BMOVE_W, BMOVE_W, BMOVE_W, BMOVE_W | BMOVE_A, BMOVE_W | BMOVE_D,
+		BMOVE_A, BMOVE_D, BMOVE_S, 0
+	};
+	int buttons;
+
+	if ( now - lc->nextMoveChange >= 0 ) {
+		lc->moveButtons = moves[ Q_rand( &lc->seed ) % ARRAY_LEN( moves ) ];
+		lc->yawSpeed = Q_crandom( &lc->seed ) * 180.0f;
+		lc->pitch = Q_crandom( &lc->seed ) * 30.0f;
+		lc->nextMoveChange = now + 500 + Q_rand( &lc->seed ) % 1500;
+	}
+
+	lc->yaw += lc->yawSpeed * LOAD_CMD_MSEC * 0.001f;
+	if ( lc->yaw >= 360.0f ) {
+		lc->yaw -= 360.0f;
+	} else if ( lc->yaw < 0.0f ) {
+		lc->yaw += 360.0f;
+	}
+
+	buttons = lc->moveButtons;
+	if ( ( Q_rand( &lc->seed ) & 127 ) == 0 ) {
+		buttons |= BMOVE_J;
+	}
+
+	lc->cmd.serverTime = serverTime;
+	lc->cmd.angles[ PITCH ] = ANGLE2SHORT( lc->pitch );
+	lc->cmd.angles[ YAW ] = ANGLE2SHORT( lc->yaw );
+	lc->cmd.buttons = buttons;
+}
+
+
+/*
+==================
+SV_LoadWritePacket
+
+Same layout as CL_WritePacket, one packet per server frame carrying
+the usercmds generated since the last one
+==================
+*/
+static void SV_LoadWritePacket( loadClient_t *lc, int now ) {
+	static const usercmd_t nullcmd = { 0 };
+	usercmd_t	cmds[ MAX_PACKET_USERCMDS ];
+	const usercmd_t *oldcmd;
+	byte		data[ MAX_PACKETLEN ];
+	msg_t		buf;
+	int			i, count, key, serverTime;
+	loadOutPacket_t *out;
+
+	MSG_Init( &buf, data, sizeof( data ) - 8 );
+
+	MSG_Bitstream( &buf );
+	MSG_WriteLong( &buf, lc->serverId );
+	MSG_WriteLong( &buf, lc->serverMessageSequence );
+	MSG_WriteLong( &buf, lc->serverCommandSequence );
+
+	oldcmd = &nullcmd;
+	if ( lc->state >= LS_PRIMED ) {
+		count = lc->lastCmdTime ? ( now - lc->lastCmdTime ) / LOAD_CMD_MSEC : 1;
+		if ( count < 1 ) {
+			count = 1;
+		} else if ( count > MAX_PACKET_USERCMDS ) {
+			count = MAX_PACKET_USERCMDS;
+		}
+		lc->lastCmdTime = now;
+
+		// commands are ignored until the first snapshot sets the time
+		serverTime = lc->snap.serverTime ? lc->snap.serverTime + now - lc->snapRealtime : 0;
+
+		for ( i = 0; i < count; i++ ) {
+			SV_LoadNextCommand( lc, serverTime ? serverTime - ( count - 1 - i ) * LOAD_CMD_MSEC : 0, now );
+			cmds[ i ] = lc->cmd;
+		}
+
+		if ( !lc->snap.valid || lc->serverMessageSequence != lc->snap.messageNum ) {
+			MSG_WriteByte( &buf, clc_moveNoDelta );
+		} else {
+			MSG_WriteByte( &buf, clc_move );
+		}
+		MSG_WriteByte( &buf, count );
+
+		key = lc->checksumFeed;
+		key ^= lc->serverMessageSequence;
+		key ^= lc->commandHash[ lc->serverCommandSequence & ( MAX_RELIABLE_COMMANDS - 1 ) ];
+
+		for ( i = 0; i < count; i++ ) {
+			MSG_WriteDeltaUsercmdKey( &buf, key, oldcmd, &cmds[ i ] );
+			oldcmd = &cmds[ i ];
+		}
+	}
+
+	out = &lc->outPackets[ lc->netchan.outgoingSequence & PACKET_MASK ];
+	out->realtime = now;
+	out->serverTime = oldcmd->serverTime;
+
+	MSG_WriteByte( &buf, clc_EOF );
+
+	Netchan_Transmit( &lc->netchan, buf.cursize, buf.data );
+}
+
+
+/*
+==================
+SV_LoadClientFrame
+==================
+*/
+static void SV_LoadClientFrame( loadClient_t *lc, int index, int now ) {
+	char	info[ MAX_INFO_STRING ];
+	char	data[ MAX_INFO_STRING + 16 ];
+	int		len;
+
+	switch ( lc->state ) {
+	case LS_WAITING:
+		if ( now - load.startTime < index * LOAD_CONNECT_STAGGER ) {
+			break;
+		}
+		lc->state = LS_CHALLENGING;
+		lc->connectTime = now - LOAD_RESEND_MSEC;
+		// fall through
+
+	case LS_CHALLENGING:
+		if ( now - lc->connectTime >= LOAD_RESEND_MSEC ) {
+			lc->connectTime = now;
+			NET_OutOfBandPrint( NS_CLIENT, &load.serverAddress, "getchallenge %d %s", lc->clientChallenge, GAMENAME_FOR_MASTER );
+		}
+		break;
+
+	case LS_CONNECTING:
+		if ( now - lc->connectTime >= LOAD_RESEND_MSEC ) {
+			lc->connectTime = now;
+
+			info[0] = '\0';
+			Info_SetValueForKey( info, "name", va( "load%03i", index ) );
+			Info_SetValueForKey( info, "rate", va( "%i", LOAD_RATE ) );
+			Info_SetValueForKey( info, "snaps", va( "%i", sv_fps->integer ) );
+			Info_SetValueForKey( info, "qport", va( "%i", load.qport ) );
+			Info_SetValueForKey( info, "challenge", va( "%i", lc->challenge ) );
+			Info_SetValueForKey( info, "client", ENGINE_VERSION );
+
+			len = Com_sprintf( data, sizeof( data ), "connect \"%s\"", info );
+			NET_OutOfBandCompress( NS_CLIENT, &load.serverAddress, (byte *)data, len );
+		}
+		break;
+
+	case LS_CONNECTED:
+	case LS_PRIMED:
+	case LS_ACTIVE:
+		SV_LoadWritePacket( lc, now );
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/*
+=============================================================================
+
+LOAD TEST CONTROL
+
+=============================================================================
+*/
+
+/*
+==================
+SV_LoadReport
+==================
+*/
+static void SV_LoadReport( void ) {
+	const loadClient_t *lc;
+	const char	*message;
+	int64_t		bytes, minBytes, maxBytes;
+	int64_t		entities;
+	int			i, msec, active, failed, snapshots, deltas, invalid;
+
+	msec = Sys_Milliseconds() - load.startTime;
+	if ( msec < 1 ) {
+		msec = 1;
+	}
+
+	active = failed = snapshots = deltas = invalid = 0;
+	bytes = entities = 0;
+	minBytes = maxBytes = -1;
+	message = NULL;
+
+	for ( i = 0, lc = load.clients; i < load.numClients; i++, lc++ ) {
+		if ( lc->snapshotCount ) {
+			active++;
+		} else {
+			failed++;
+			if ( lc->message[0] && !message ) {
+				message = lc->message;
+			}
+		}
+		snapshots += lc->snapshotCount;
+		deltas += lc->deltaSnapshots;
+		invalid += lc->invalidSnapshots;
+		entities += lc->entityCount;
+		bytes += lc->bytes;
+		if ( minBytes < 0 || lc->bytes < minBytes ) {
+			minBytes = lc->bytes;
+		}
+		if ( lc->bytes > maxBytes ) {
+			maxBytes = lc->bytes;
+		}
+	}
+
+	Com_Printf( "load test: %i clients for %i msec, %i got snapshots\n", load.numClients, msec, active );
+	if ( failed ) {
+		Com_Printf( "%i clients never got a snapshot%s%s\n", failed, message ? ": " : "", message ? message : "" );
+	}
+	if ( load.failedClients ) {
+		Com_Printf( S_COLOR_YELLOW "%i clients stopped on a decode error\n", load.failedClients );
+	}
+
+	SV_PrintSamples( &load.frameTimes, "SV_Frame usec" );
+
+	if ( load.numPackets ) {
+		Com_Printf( "SV_PacketEvent usec: total %i, avg %.2f (%i packets)\n",
+			(int)load.packetTime, (double)load.packetTime / load.numPackets, load.numPackets );
+	}
+
+	if ( load.numClients ) {
+		Com_Printf( "bytes/sec per client: avg %i, min %i, max %i\n",
+			(int)( bytes * 1000 / msec / load.numClients ),
+			(int)( minBytes * 1000 / msec ), (int)( maxBytes * 1000 / msec ) );
+	}
+
+	if ( snapshots ) {
+		Com_Printf( "%i snapshots, %i delta, %i undecodable, %.1f entities avg, decode usec avg %.2f\n",
+			snapshots, deltas, invalid, (double)entities / snapshots,
+			(double)load.decodeTime / snapshots );
+	}
+
+	SV_PrintSamples( &load.latencies, "snapshot latency msec" );
+}
+
+
+/*
+==================
+SV_LoadRelease
+==================
+*/
+static void SV_LoadRelease( void ) {
+	int i;
+
+	if ( load.clients ) {
+		for ( i = 0; i < load.numClients; i++ ) {
+			Netchan_Release( &load.clients[i].netchan );
+			free( load.clients[i].parse.entities );
+		}
+		free( load.clients );
+	}
+	free( load.baselines );
+	free( load.toServer.data );
+	free( load.toClients.data );
+	SV_FreeSamples( &load.frameTimes );
+	SV_FreeSamples( &load.latencies );
+	if ( load.dump != FS_INVALID_HANDLE ) {
+		FS_FCloseFile( load.dump );
+		Com_Printf( "wrote %i server messages to %s\n", load.dumpMessages, load.dumpName );
+	}
+
+	Com_Memset( &load, 0, sizeof( load ) );
+	NET_SetSendSink( NULL );
+}
+
+
+/*
+==================
+SV_LoadFinish
+
+Reports and drops the simulated clients, the sink stays until the
+server has freed their slots so nothing is sent to their addresses
+==================
+*/
+static void SV_LoadFinish( void ) {
+	client_t	*cl;
+	int			i;
+
+	SV_LoadReport();
+
+	for ( i = 0, cl = svs.clients; i < sv.maxclients; i++, cl++ ) {
+		if ( cl->state != CS_FREE && SV_LoadAddress( &cl->netchan.remoteAddress ) >= 0 ) {
+			SV_DropClient( cl, "load test finished" );
+		}
+	}
+
+	load.active = qfalse;
+	load.draining = qtrue;
+}
+
+
+/*
+==================
+SV_LoadActive
+==================
+*/
+qboolean SV_LoadActive( void ) {
+	return load.active || load.draining;
+}
+
+
+/*
+==================
+SV_LoadFrame
+
+Called at the start of SV_Frame: runs the simulated clients and
+feeds their packets to the server
+==================
+*/
+void SV_LoadFrame( void ) {
+	const loadPacket_t *p;
+	client_t	*cl;
+	netadr_t	from;
+	msg_t		msg;
+	int64_t		start;
+	int			i, now, offset;
+
+	load.frameStart = 0;
+
+	if ( load.draining ) {
+		for ( i = 0, cl = svs.clients; i < sv.maxclients; i++, cl++ ) {
+			if ( cl->state != CS_FREE && SV_LoadAddress( &cl->netchan.remoteAddress ) != -1 ) {
+				return;
+			}
+		}
+		SV_LoadRelease();
+		return;
+	}
+
+	if ( !load.active ) {
+		return;
+	}
+
+	now = Sys_Milliseconds();
+
+	// what the server sent since the last frame
+	for ( offset = 0; offset < load.toClients.used; offset += sizeof( *p ) + PAD( p->length, 4 ) ) {
+		p = (const loadPacket_t *)( load.toClients.data + offset );
+		SV_LoadClientPacket( &load.clients[ p->client ], (const byte *)( p + 1 ), p->length, now );
+	}
+	load.toClients.used = 0;
+
+	for ( i = 0; i < load.numClients; i++ ) {
+		load.sender = i;
+		SV_LoadClientFrame( &load.clients[i], i, now );
+	}
+	load.sender = -1;
+
+	// replies go to toClients, so this queue doesn't grow while it is read
+	for ( offset = 0; offset < load.toServer.used; offset += sizeof( *p ) + PAD( p->length, 4 ) ) {
+		p = (const loadPacket_t *)( load.toServer.data + offset );
+		from = load.clients[ p->client ].address;
+
+		MSG_Init( &msg, loadMsgBuf, MAX_MSGLEN );
+		Com_Memcpy( loadMsgBuf, p + 1, p->length );
+		msg.cursize = p->length;
+
+		start = Sys_Microseconds();
+		SV_PacketEvent( &from, &msg );
+		load.packetTime += Sys_Microseconds() - start;
+		load.numPackets++;
+	}
+	load.toServer.used = 0;
+
+	if ( load.endTime && now - load.endTime >= 0 ) {
+		SV_LoadFinish();
+		return;
+	}
+
+	load.frameStart = Sys_Microseconds();
+}
+
+
+/*
+==================
+SV_LoadFrameEnd
+
+Called at the end of SV_Frame
+==================
+*/
+void SV_LoadFrameEnd( void ) {
+	if ( !load.frameStart ) {
+		return;
+	}
+
+	SV_AddSample( &load.frameTimes, Sys_Microseconds() - load.frameStart );
+	load.frameStart = 0;
+}
+
+
+/*
+==================
+SV_StopLoadTest
+
+Called on server shutdown, the slots are gone so nothing has to drain
+==================
+*/
+void SV_StopLoadTest( void ) {
+	if ( load.active ) {
+		SV_LoadReport();
+	}
+	if ( load.active || load.draining ) {
+		SV_LoadRelease();
+	}
+}
+
+
+/*
+==================
+SV_LoadTest_f
+
+loadtest <clients> [seconds] [dumpfile]
+==================
+*/
+void SV_LoadTest_f( void ) {
+	loadClient_t	*lc;
+	int				i, count, seconds;
+
+	if ( Cmd_Argc() < 2 ) {
+		Com_Printf( "usage: loadtest <clients> [seconds] [dumpfile]\n" );
+		return;
+	}
+
+#ifndef DEDICATED
+	Com_Printf( "loadtest needs a dedicated server\n" );
+	return;
+#endif
+
+	if ( !com_sv_running->integer ) {
+		Com_Printf( "Server is not running.\n" );
+		return;
+	}
+
+	if ( SV_LoadActive() ) {
+		Com_Printf( "load test already running\n" );
+		return;
+	}
+
+	count = atoi( Cmd_Argv( 1 ) );
+	if ( count < 1 || count > sv.maxclients ) {
+		Com_Printf( "clients must be between 1 and %i\n", sv.maxclients );
+		return;
+	}
+	seconds = Cmd_Argc() > 2 ? atoi( Cmd_Argv( 2 ) ) : 30;
+
+	load.clients = calloc( count, sizeof( loadClient_t ) );
+	load.baselines = calloc( MAX_GENTITIES, sizeof( entityState_t ) );
+	if ( !load.clients || !load.baselines ) {
+		Com_Printf( "couldn't allocate %i clients\n", count );
+		SV_LoadRelease();
+		return;
+	}
+	load.numClients = count;
+
+	for ( i = 0, lc = load.clients; i < count; i++, lc++ ) {
+		lc->parse.entities = malloc( LOAD_PARSE_ENTITIES * sizeof( entityState_t ) );
+		if ( !lc->parse.entities ) {
+			Com_Printf( "couldn't allocate %i clients\n", count );
+			SV_LoadRelease();
+			return;
+		}
+		lc->parse.mask = LOAD_PARSE_ENTITIES - 1;
+		lc->parse.baselines = load.baselines;
+
+		lc->address.type = NA_IP;
+		lc->address.ipv._4[0] = 198;
+		lc->address.ipv._4[1] = 18 | ( ( i + 1 ) >> 16 );
+		lc->address.ipv._4[2] = ( ( i + 1 ) >> 8 ) & 255;
+		lc->address.ipv._4[3] = ( i + 1 ) & 255;
+		lc->address.port = BigShort( LOAD_PORT );
+
+		lc->seed = i * 7919 + 1;
+		lc->clientChallenge = Q_rand( &lc->seed ) & 0x7fffffff;
+		lc->yaw = Q_random( &lc->seed ) * 360.0f;
+	}
+
+	load.serverAddress.type = NA_IP;
+	load.serverAddress.ipv._4[0] = 127;
+	load.serverAddress.ipv._4[3] = 1;
+	load.serverAddress.port = BigShort( LOAD_PORT );
+	load.qport = Cvar_VariableIntegerValue( "net_qport" ) & 0xffff;
+	load.sender = -1;
+
+	if ( Cmd_Argc() > 3 ) {
+		Com_sprintf( load.dumpName, sizeof( load.dumpName ), "loadtest/%s", Cmd_Argv( 3 ) );
+		COM_DefaultExtension( load.dumpName, sizeof( load.dumpName ), ".svmsg" );
+		load.dump = FS_FOpenFileWrite( load.dumpName );
+		if ( load.dump == FS_INVALID_HANDLE ) {
+			Com_Printf( "couldn't open %s\n", load.dumpName );
+			SV_LoadRelease();
+			return;
+		}
+	}
+
+	load.startTime = Sys_Milliseconds();
+	load.endTime = seconds > 0 ? load.startTime + seconds * 1000 : 0;
+	load.active = qtrue;
+	NET_SetSendSink( SV_LoadSend );
+
+	Com_Printf( "load test: %i clients, %i MB of decode buffers\n", count,
+		(int)( (int64_t)count * LOAD_PARSE_ENTITIES * sizeof( entityState_t ) >> 20 ) );
+}
+
+
+/*
+==================
+SV_LoadTestStop_f
+==================
+*/
+void SV_LoadTestStop_f( void ) {
+	if ( !load.active ) {
+		Com_Printf( "no load test running\n" );
+		return;
+	}
+
+	SV_LoadFinish();
+}
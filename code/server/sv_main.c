@@ -49,6 +49,14 @@ cvar_t	*sv_anticheatengine;
 cvar_t	*sv_ace_wallhack;
 
 cvar_t *sv_filter;
+cvar_t	*sv_deltaCache;			// share encoded entity deltas between clients
+cvar_t	*sv_snapshotBudget;		// fill snapshots by entity priority up to client rate
+cvar_t	*sv_snapshotTiers;		// refresh interval of far entities, in snapshots
+cvar_t	*sv_areaGrid;			// hash entities into a loose grid instead of the sector tree
+cvar_t	*sv_autoRecord;			// record every map to records/
+cvar_t	*sv_recordBuffer;		// recorder write-behind buffer, in KB
+cvar_t	*sv_statsLog;			// file to append client network counters to
+cvar_t	*sv_statsLogInterval;	// seconds between sv_statsLog entries
 
 /*
 =============================================================================
@@ -60,15 +68,82 @@ EVENT MESSAGES
 
 /*
 ======================
-SV_AddServerCommand
+SV_AllocReliableCommand
 
-The given command will be transmitted to the client, and is guaranteed to
-not have future snapshot_t executed before it is executed
+Reliable commands are stored once and referenced from the
+per-client windows, broadcasts share a single copy
 ======================
 */
-void SV_AddServerCommand( client_t *client, const char *cmd ) {
+static reliableCommand_t *SV_AllocReliableCommand( const char *cmd ) {
+	reliableCommand_t *rc;
+	int		len;
+
+	len = strlen( cmd );
+	if ( len > MAX_STRING_CHARS - 1 )
+		len = MAX_STRING_CHARS - 1;
+
+	rc = Z_Malloc( offsetof( reliableCommand_t, text ) + len + 1 );
+	rc->refCount = 1;	// held by the caller until SV_ReleaseReliableCommand
+	Com_Memcpy( rc->text, cmd, len );
+	rc->text[ len ] = '\0';
+
+	return rc;
+}
+
+
+/*
+======================
+SV_ReleaseReliableCommand
+======================
+*/
+static void SV_ReleaseReliableCommand( reliableCommand_t *rc ) {
+	if ( rc && --rc->refCount == 0 ) {
+		Z_Free( rc );
+	}
+}
+
+
+/*
+======================
+SV_ReliableCommand
+
+Text of the command stored for the given sequence, empty if none
+======================
+*/
+const char *SV_ReliableCommand( const client_t *client, int sequence ) {
+	const reliableCommand_t *rc = client->reliableCommands[ sequence & ( MAX_RELIABLE_COMMANDS - 1 ) ];
+	return rc ? rc->text : "";
+}
+
+
+/*
+======================
+SV_FreeReliableCommands
+
+Drops all references held by the client window
+======================
+*/
+void SV_FreeReliableCommands( client_t *client ) {
+	int		i;
+
+	for ( i = 0; i < MAX_RELIABLE_COMMANDS; i++ ) {
+		SV_ReleaseReliableCommand( client->reliableCommands[ i ] );
+		client->reliableCommands[ i ] = NULL;
+	}
+}
+
+
+/*
+======================
+SV_AddReliableCommand
+======================
+*/
+static void SV_AddReliableCommand( client_t *client, reliableCommand_t *rc ) {
 	int		index, i, n;
 
+	// keep configstring updates ahead of commands issued after them
+	SV_FlushConfigstrings();
+
 	// this is very ugly but it's also a waste to for instance send multiple config string updates
 	// for the same config string index in one snapshot
 //	if ( SV_ReplacePendingServerCommands( client, cmd ) ) {
@@ -89,14 +164,37 @@ void SV_AddServerCommand( client_t *client, const char *cmd ) {
 		n = client->reliableSequence - client->reliableAcknowledge;
 		for ( i = 0; i < n; i++ ) {
 			const int idx = client->reliableAcknowledge + 1 + i;
-			Com_Printf( "cmd %5d: %s\n", i, client->reliableCommands[ idx & ( MAX_RELIABLE_COMMANDS - 1 ) ] );
+			Com_Printf( "cmd %5d: %s\n", i, SV_ReliableCommand( client, idx ) );
 		}
-		Com_Printf( "cmd %5d: %s\n", i, cmd );
+		Com_Printf( "cmd %5d: %s\n", i, rc->text );
 		SV_DropClient( client, "Server command overflow" );
 		return;
 	}
 	index = client->reliableSequence & ( MAX_RELIABLE_COMMANDS - 1 );
-	Q_strncpyz( client->reliableCommands[ index ], cmd, sizeof( client->reliableCommands[ index ] ) );
+	SV_ReleaseReliableCommand( client->reliableCommands[ index ] );
+	client->reliableCommands[ index ] = rc;
+	rc->refCount++;
+}
+
+
+/*
+======================
+SV_AddServerCommand
+
+The given command will be transmitted to the client, and is guaranteed to
+not have future snapshot_t executed before it is executed
+======================
+*/
+void SV_AddServerCommand( client_t *client, const char *cmd ) {
+	reliableCommand_t *rc;
+
+	// do not send commands until the gamestate has been sent
+	if ( client->state < CS_PRIMED )
+		return;
+
+	rc = SV_AllocReliableCommand( cmd );
+	SV_AddReliableCommand( client, rc );
+	SV_ReleaseReliableCommand( rc );
 }
 
 
@@ -112,6 +210,7 @@ A NULL client will broadcast to all clients
 void QDECL SV_SendServerCommand( client_t *cl, const char *fmt, ... ) {
 	va_list		argptr;
 	char		message[MAX_STRING_CHARS+128]; // slightly larger than allowed, to detect overflows
+	reliableCommand_t *rc;
 	client_t	*client;
 	int			j, len;
 
@@ -128,12 +227,20 @@ void QDECL SV_SendServerCommand( client_t *cl, const char *fmt, ... ) {
 		return;
 	}
 
+	if ( len > 1022 )
+		return;
+
 	// send the data to all relevant clients
+	rc = NULL;
 	for ( j = 0, client = svs.clients; j < sv.maxclients; j++, client++ ) {
-		if ( len <= 1022 ){
-			SV_AddServerCommand( client, message );
-		}
+		if ( client->state < CS_PRIMED )
+			continue;
+		if ( rc == NULL )
+			rc = SV_AllocReliableCommand( message );
+		SV_AddReliableCommand( client, rc );
 	}
+
+	SV_ReleaseReliableCommand( rc );
 }
 
 
@@ -277,8 +384,22 @@ CONNECTIONLESS COMMANDS
 #define MAX_BUCKETS        16384
 #define MAX_HASHES          1024
 
-static leakyBucket_t buckets[ MAX_BUCKETS ];
-static leakyBucket_t *bucketHashes[ MAX_HASHES ];
+// per-address connectionless budget enforced by the network thread
+#define NET_FILTER_BURST      20
+#define NET_FILTER_PERIOD    100
+
+typedef struct {
+	leakyBucket_t	buckets[ MAX_BUCKETS ];
+	leakyBucket_t	*hashes[ MAX_HASHES ];
+	leakyBucket_t	dummy;
+	int				start;
+} bucketTable_t;
+
+static bucketTable_t svcBuckets;
+#ifdef USE_NET_THREAD
+static bucketTable_t netBuckets;	// shared by the network threads
+static char netLimitLock;			// guards netBuckets and outboundRateLimit
+#endif
 static rateLimit_t outboundRateLimit;
 
 /*
@@ -316,7 +437,7 @@ static int SVC_HashForAddress( const netadr_t *address ) {
 SVC_RelinkToHead
 ================
 */
-static void SVC_RelinkToHead( leakyBucket_t *bucket, int hash ) {
+static void SVC_RelinkToHead( bucketTable_t *table, leakyBucket_t *bucket, int hash ) {
 
 	if ( bucket->prev != NULL ) {
 		bucket->prev->next = bucket->next;
@@ -328,37 +449,35 @@ static void SVC_RelinkToHead( leakyBucket_t *bucket, int hash ) {
 		bucket->next->prev = bucket->prev;
 	}
 
-	bucket->next = bucketHashes[ hash ];
-	if ( bucketHashes[ hash ] != NULL ) {
-		bucketHashes[ hash ]->prev = bucket;
+	bucket->next = table->hashes[ hash ];
+	if ( table->hashes[ hash ] != NULL ) {
+		table->hashes[ hash ]->prev = bucket;
 	}
 
 	bucket->prev = NULL;
-	bucketHashes[ hash ] = bucket;
+	table->hashes[ hash ] = bucket;
 }
 
 
 /*
 ================
-SVC_BucketForAddress
+SVC_BucketForTable
 
 Find or allocate a bucket for an address
 ================
 */
-static leakyBucket_t *SVC_BucketForAddress( const netadr_t *address, int burst, int period ) {
-	static leakyBucket_t dummy = { 0 };
-	static int		start = 0;
+static leakyBucket_t *SVC_BucketForTable( bucketTable_t *table, const netadr_t *address, int burst, int period ) {
 	const int		hash = SVC_HashForAddress( address );
 	const int		now = Sys_Milliseconds();
 	leakyBucket_t	*bucket;
 	int				i, n;
 
-	for ( bucket = bucketHashes[ hash ], n = 0; bucket; bucket = bucket->next, n++ ) {
+	for ( bucket = table->hashes[ hash ], n = 0; bucket; bucket = bucket->next, n++ ) {
 		switch ( bucket->type ) {
 			case NA_IP:
 				if ( memcmp( bucket->ipv._4, address->ipv._4, 4 ) == 0 ) {
 					if ( n > 8 ) {
-						SVC_RelinkToHead( bucket, hash );
+						SVC_RelinkToHead( table, bucket, hash );
 					}
 					return bucket;
 				}
@@ -367,23 +486,23 @@ static leakyBucket_t *SVC_BucketForAddress( const netadr_t *address, int burst,
 			case NA_IP6:
 				if ( memcmp( bucket->ipv._6, address->ipv._6, 16 ) == 0 ) {
 					if ( n > 8 ) {
-						SVC_RelinkToHead( bucket, hash );
+						SVC_RelinkToHead( table, bucket, hash );
 					}
 					return bucket;
 				}
 				break;
 #endif
 			default:
-				return &dummy;
+				return &table->dummy;
 		}
 	}
 
 	for ( i = 0; i < MAX_BUCKETS; i++ ) {
 		int interval;
 
-		if ( start >= MAX_BUCKETS )
-			start = 0;
-		bucket = &buckets[ start++ ];
+		if ( table->start >= MAX_BUCKETS )
+			table->start = 0;
+		bucket = &table->buckets[ table->start++ ];
 		interval = now - bucket->rate.lastTime;
 
 		// Reclaim expired buckets
@@ -391,7 +510,7 @@ static leakyBucket_t *SVC_BucketForAddress( const netadr_t *address, int burst,
 			if ( bucket->prev != NULL ) {
 				bucket->prev->next = bucket->next;
 			} else {
-				bucketHashes[ bucket->hash ] = bucket->next;
+				table->hashes[ bucket->hash ] = bucket->next;
 			}
 			
 			if ( bucket->next != NULL ) {
@@ -417,13 +536,13 @@ static leakyBucket_t *SVC_BucketForAddress( const netadr_t *address, int burst,
 			bucket->toxic = 0;
 
 			// Add to the head of the relevant hash chain
-			bucket->next = bucketHashes[ hash ];
-			if ( bucketHashes[ hash ] != NULL ) {
-				bucketHashes[ hash ]->prev = bucket;
+			bucket->next = table->hashes[ hash ];
+			if ( table->hashes[ hash ] != NULL ) {
+				table->hashes[ hash ]->prev = bucket;
 			}
 
 			bucket->prev = NULL;
-			bucketHashes[ hash ] = bucket;
+			table->hashes[ hash ] = bucket;
 
 			return bucket;
 		}
@@ -434,6 +553,16 @@ static leakyBucket_t *SVC_BucketForAddress( const netadr_t *address, int burst,
 }
 
 
+/*
+================
+SVC_BucketForAddress
+================
+*/
+static leakyBucket_t *SVC_BucketForAddress( const netadr_t *address, int burst, int period ) {
+	return SVC_BucketForTable( &svcBuckets, address, burst, period );
+}
+
+
 /*
 ================
 SVC_RateLimit
@@ -519,6 +648,50 @@ qboolean SVC_RateLimitAddress( const netadr_t *from, int burst, int period ) {
 }
 
 
+#ifdef USE_NET_THREAD
+/*
+================
+SVC_LockLimits
+
+The network shards share one address table and the outbound limit
+with the main thread, so spreading a flood over the shards doesn't
+multiply what the server answers
+================
+*/
+static void SVC_LockLimits( void ) {
+	while ( __atomic_test_and_set( &netLimitLock, __ATOMIC_ACQUIRE ) )
+		;
+}
+
+
+static void SVC_UnlockLimits( void ) {
+	__atomic_clear( &netLimitLock, __ATOMIC_RELEASE );
+}
+#endif
+
+
+/*
+================
+SVC_RateLimitOutbound
+
+Limits getstatus and getinfo replies from all threads together
+================
+*/
+static qboolean SVC_RateLimitOutbound( void ) {
+	qboolean limited;
+
+#ifdef USE_NET_THREAD
+	SVC_LockLimits();
+#endif
+	limited = SVC_RateLimit( &outboundRateLimit, 10, 100 );
+#ifdef USE_NET_THREAD
+	SVC_UnlockLimits();
+#endif
+
+	return limited;
+}
+
+
 /*
 ================
 SVC_RateRestoreAddress
@@ -559,6 +732,166 @@ void SVC_RateDropAddress( const netadr_t *from, int burst, int period ) {
 }
 
 
+/*
+================
+SV_InfoKeys
+
+Appends everything infoResponse carries besides the challenge
+================
+*/
+static void SV_InfoKeys( char *infostring ) {
+	int		i, count, humans;
+	const char	*addondir;
+
+	// don't count privateclients
+	count = humans = 0;
+	for ( i = sv_privateClients->integer; i < sv.maxclients; i++ ) {
+		if ( svs.clients[i].state >= CS_CONNECTED ) {
+			count++;
+			if (svs.clients[i].netchan.remoteAddress.type != NA_BOT) {
+				humans++;
+			}
+		}
+	}
+
+	Info_SetValueForKey( infostring, "hostname", sv_hostname->string );
+	Info_SetValueForKey( infostring, "mapname", sv_mapname->string );
+	Info_SetValueForKey( infostring, "clients", va("%i", count) );
+	Info_SetValueForKey( infostring, "g_humanplayers", va( "%i", humans ) );
+	Info_SetValueForKey( infostring, "g_maxClients", va( "%i", sv.maxclients - sv_privateClients->integer ) );
+	Info_SetValueForKey( infostring, "gametype", va( "%i", sv_gametype->integer ) );
+	Info_SetValueForKey( infostring, "g_needpass", va( "%d", Cvar_VariableIntegerValue( "g_needpass" ) ) );
+	
+	addondir = Cvar_VariableString( "cl_selectedmod" );
+	Info_SetValueForKey( infostring, "addonname", addondir );
+}
+
+
+/*
+==============================================================================
+
+QUERY CACHE
+
+getstatus and getinfo bodies are formatted once and reused until a
+serverinfo cvar, configstring, client slot or score changes, pings
+and non-serverinfo keys are allowed to age up to QUERY_CACHE_MSEC
+
+==============================================================================
+*/
+
+#define QUERY_CACHE_MSEC	500
+
+typedef struct {
+	qboolean	valid;
+	int			serverinfoLength;
+	int			infoLength;
+	int			numPlayers;
+	int			playersLength;
+	int			playerLength[ MAX_CLIENTS ];
+	char		serverinfo[ MAX_INFO_STRING ];	// without challenge
+	char		info[ MAX_INFO_STRING ];		// infoResponse keys after the challenge
+	char		players[ MAX_PACKETLEN ];		// must be last
+} queryTemplate_t;
+
+static queryTemplate_t	queryCache;
+static int				queryCacheTime;
+static int				queryCacheCount;	// bumped on every rebuild
+static int				queryCacheClient[ MAX_CLIENTS ];
+static int				queryCacheScore[ MAX_CLIENTS ];
+
+
+/*
+================
+SV_BuildQueryCache
+================
+*/
+static void SV_BuildQueryCache( void ) {
+	queryTemplate_t *t = &queryCache;
+	char	player[MAX_NAME_LENGTH + 32]; // score + ping + name
+	const playerState_t *ps;
+	const client_t *cl;
+	int		i, n;
+
+	Q_strncpyz( t->serverinfo, Cvar_InfoString( CVAR_SERVERINFO, NULL ), sizeof( t->serverinfo ) );
+	Info_RemoveKey( t->serverinfo, "challenge" );
+
+	t->info[0] = '\0';
+	SV_InfoKeys( t->info );
+
+	t->numPlayers = 0;
+	t->playersLength = 0;
+
+	for ( i = 0; i < sv.maxclients; i++ ) {
+		cl = &svs.clients[i];
+		if ( cl->state >= CS_CONNECTED ) {
+			ps = SV_GameClientNum( i );
+			n = Com_sprintf( player, sizeof( player ), "%i %i \"%s\"\n",
+				ps->persistant[ PERS_SCORE ], cl->ping, cl->name );
+			if ( t->playersLength + n >= sizeof( t->players ) )
+				break;
+			memcpy( t->players + t->playersLength, player, n );
+			queryCacheClient[ t->numPlayers ] = i;
+			queryCacheScore[ t->numPlayers ] = ps->persistant[ PERS_SCORE ];
+			t->playerLength[ t->numPlayers++ ] = n;
+			t->playersLength += n;
+		}
+	}
+
+	t->serverinfoLength = strlen( t->serverinfo );
+	t->infoLength = strlen( t->info );
+	t->valid = qtrue;
+
+	queryCacheTime = Sys_Milliseconds();
+	queryCacheCount++;
+}
+
+
+/*
+================
+SV_QueryCache
+
+Returns up to date response bodies, rebuilding them if needed
+================
+*/
+static const queryTemplate_t *SV_QueryCache( void ) {
+	int		i;
+
+	if ( !queryCache.valid || ( cvar_modifiedFlags & CVAR_SERVERINFO )
+		|| Sys_Milliseconds() - queryCacheTime >= QUERY_CACHE_MSEC ) {
+		SV_BuildQueryCache();
+		return &queryCache;
+	}
+
+	for ( i = 0; i < queryCache.numPlayers; i++ ) {
+		if ( SV_GameClientNum( queryCacheClient[i] )->persistant[ PERS_SCORE ] != queryCacheScore[i] ) {
+			SV_BuildQueryCache();
+			break;
+		}
+	}
+
+	return &queryCache;
+}
+
+
+#ifdef USE_NET_THREAD
+static void SV_InvalidateQueryTemplate( void );
+#endif
+
+/*
+================
+SV_InvalidateQueryCache
+
+Called when configstrings or client slots change
+================
+*/
+void SV_InvalidateQueryCache( void ) {
+	queryCache.valid = qfalse;
+#ifdef USE_NET_THREAD
+	SV_InvalidateQueryTemplate();
+#endif
+}
+
+
 /*
 ================
 SVC_Status
@@ -569,14 +902,11 @@ the simple info query.
 ================
 */
 static void SVC_Status( const netadr_t *from ) {
-	char	player[MAX_NAME_LENGTH + 32]; // score + ping + name
+	const queryTemplate_t *t;
 	char	status[MAX_PACKETLEN];
 	char	*s;
-	int		i;
-	client_t	*cl;
-	playerState_t	*ps;
+	int		i, n;
 	int		statusLength;
-	int		playerLength;
 	char	infostring[MAX_INFO_STRING+160]; // add some space for challenge string
 
 	// Prevent using getstatus as an amplifier
@@ -590,7 +920,7 @@ static void SVC_Status( const netadr_t *from ) {
 
 	// Allow getstatus to be DoSed relatively easily, but prevent
 	// excess outbound bandwidth usage when being flooded inbound
-	if ( SVC_RateLimit( &outboundRateLimit, 10, 100 ) ) {
+	if ( SVC_RateLimitOutbound() ) {
 		Com_DPrintf( "SVC_Status: rate limit exceeded, dropping request\n" );
 		return;
 	}
@@ -599,31 +929,25 @@ static void SVC_Status( const netadr_t *from ) {
 	if ( strlen( Cmd_Argv( 1 ) ) > 128 )
 		return;
 
-	Q_strncpyz( infostring, Cvar_InfoString( CVAR_SERVERINFO, NULL ), sizeof( infostring ) );
+	t = SV_QueryCache();
+
+	memcpy( infostring, t->serverinfo, t->serverinfoLength + 1 );
 
 	// echo back the parameter to status. so master servers can use it as a challenge
 	// to prevent timed spoofed reply packets that add ghost servers
 	Info_SetValueForKey( infostring, "challenge", Cmd_Argv( 1 ) );
 
 	s = status;
-	status[0] = '\0';
 	statusLength = strlen( infostring ) + 16; // strlen( "statusResponse\n\n" )
 
-	for ( i = 0; i < sv.maxclients; i++ ) {
-		cl = &svs.clients[i];
-		if ( cl->state >= CS_CONNECTED ) {
-
-			ps = SV_GameClientNum( i );
-			playerLength = Com_sprintf( player, sizeof( player ), "%i %i \"%s\"\n", 
-				ps->persistant[ PERS_SCORE ], cl->ping, cl->name );
-			
-			if ( statusLength + playerLength >= MAX_PACKETLEN-4 )
-				break; // can't hold any more
-			
-			s = Q_stradd( s, player );
-			statusLength += playerLength;
-		}
+	for ( i = 0, n = 0; i < t->numPlayers; n += t->playerLength[ i ], i++ ) {
+		if ( statusLength + t->playerLength[ i ] >= MAX_PACKETLEN-4 )
+			break; // can't hold any more
+		memcpy( s, t->players + n, t->playerLength[ i ] );
+		s += t->playerLength[ i ];
+		statusLength += t->playerLength[ i ];
 	}
+	*s = '\0';
 
 	NET_OutOfBandPrint( NS_SERVER, from, "statusResponse\n%s\n%s", infostring, status );
 }
@@ -638,9 +962,9 @@ if a user is interested in a server to do a full status
 ================
 */
 static void SVC_Info( const netadr_t *from ) {
-	int		i, count, humans;
-    const char	*addondir;
+	const queryTemplate_t *t;
 	char	infostring[MAX_INFO_STRING];
+	int		len;
 
 	// Prevent using getinfo as an amplifier
 	if ( SVC_RateLimitAddress( from, 10, 1000 ) ) {
@@ -653,7 +977,7 @@ static void SVC_Info( const netadr_t *from ) {
 
 	// Allow getinfo to be DoSed relatively easily, but prevent
 	// excess outbound bandwidth usage when being flooded inbound
-	if ( SVC_RateLimit( &outboundRateLimit, 10, 100 ) ) {
+	if ( SVC_RateLimitOutbound() ) {
 		Com_DPrintf( "SVC_Info: rate limit exceeded, dropping request\n" );
 		return;
 	}
@@ -667,38 +991,279 @@ static void SVC_Info( const netadr_t *from ) {
 	if ( strlen( Cmd_Argv( 1 ) ) > 128 )
 		return;
 
-	// don't count privateclients
-	count = humans = 0;
-	for ( i = sv_privateClients->integer; i < sv.maxclients; i++ ) {
-		if ( svs.clients[i].state >= CS_CONNECTED ) {
-			count++;
-			if (svs.clients[i].netchan.remoteAddress.type != NA_BOT) {
-				humans++;
-			}
-		}
-	}
-
 	infostring[0] = '\0';
 
 	// echo back the parameter to status. so servers can use it as a challenge
 	// to prevent timed spoofed reply packets that add ghost servers
 	Info_SetValueForKey( infostring, "challenge", Cmd_Argv(1) );
 
-	Info_SetValueForKey( infostring, "hostname", sv_hostname->string );
-	Info_SetValueForKey( infostring, "mapname", sv_mapname->string );
-	Info_SetValueForKey( infostring, "clients", va("%i", count) );
-	Info_SetValueForKey( infostring, "g_humanplayers", va( "%i", humans ) );
-	Info_SetValueForKey( infostring, "g_maxClients", va( "%i", sv.maxclients - sv_privateClients->integer ) );
-	Info_SetValueForKey( infostring, "gametype", va( "%i", sv_gametype->integer ) );
-	Info_SetValueForKey( infostring, "g_needpass", va( "%d", Cvar_VariableIntegerValue( "g_needpass" ) ) );
-	
-	addondir = Cvar_VariableString( "cl_selectedmod" );
-	Info_SetValueForKey( infostring, "addonname", addondir );
+	t = SV_QueryCache();
+	len = strlen( infostring );
+
+	if ( len + t->infoLength < MAX_INFO_STRING ) {
+		memcpy( infostring + len, t->info, t->infoLength + 1 );
+	} else {
+		// some keys won't fit, let Info_SetValueForKey pick them
+		SV_InfoKeys( infostring );
+	}
 
 	NET_OutOfBandPrint( NS_SERVER, from, "infoResponse\n%s", infostring );
 }
 
 
+#ifdef USE_NET_THREAD
+/*
+==============================================================================
+
+NETWORK THREAD QUERIES
+
+getstatus and getinfo are answered by the network threads from a copy
+of the query cache the main thread republishes under a sequence lock,
+anything else connectionless is only rate limited there and forwarded
+to the frame
+
+==============================================================================
+*/
+
+typedef enum {
+	QUERY_NONE,
+	QUERY_STATUS,
+	QUERY_INFO
+} queryType_t;
+
+static queryTemplate_t	queryTemplate;
+static unsigned int		querySequence;	// odd while queryTemplate is written
+static int				queryPublishCount;
+
+
+/*
+================
+SV_PublishQueryTemplate
+================
+*/
+static void SV_PublishQueryTemplate( const queryTemplate_t *t ) {
+	static const queryTemplate_t invalid;
+
+	if ( t == NULL )
+		t = &invalid;
+
+	__atomic_store_n( &querySequence, querySequence + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	memcpy( &queryTemplate, t, offsetof( queryTemplate_t, players ) + t->playersLength );
+	__atomic_store_n( &querySequence, querySequence + 1, __ATOMIC_RELEASE );
+}
+
+
+/*
+================
+SV_UpdateQueryTemplate
+================
+*/
+static void SV_UpdateQueryTemplate( void ) {
+	const queryTemplate_t *t = SV_QueryCache();
+
+	if ( !queryTemplate.valid || queryPublishCount != queryCacheCount ) {
+		SV_PublishQueryTemplate( t );
+		queryPublishCount = queryCacheCount;
+	}
+}
+
+
+/*
+================
+SV_InvalidateQueryTemplate
+
+Network threads forward queries to the frame until next publish
+================
+*/
+static void SV_InvalidateQueryTemplate( void ) {
+	if ( queryTemplate.valid ) {
+		SV_PublishQueryTemplate( NULL );
+	}
+}
+
+
+/*
+================
+SV_ReadQueryTemplate
+
+Network thread, copies consistent template
+================
+*/
+static qboolean SV_ReadQueryTemplate( queryTemplate_t *t ) {
+	unsigned int seq;
+	int tries;
+
+	for ( tries = 0; tries < 4; tries++ ) {
+		seq = __atomic_load_n( &querySequence, __ATOMIC_ACQUIRE );
+		if ( seq & 1 )
+			continue;
+
+		memcpy( t, &queryTemplate, offsetof( queryTemplate_t, players ) );
+		if ( (unsigned)t->playersLength >= sizeof( t->players ) || (unsigned)t->numPlayers > MAX_CLIENTS )
+			continue;
+		memcpy( t->players, queryTemplate.players, t->playersLength );
+
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		if ( __atomic_load_n( &querySequence, __ATOMIC_RELAXED ) == seq )
+			return t->valid;
+	}
+
+	return qfalse;
+}
+
+
+/*
+================
+SV_ParseQuery
+
+Recognizes getstatus/getinfo lines that Cmd_TokenizeString
+would split the same way, everything unusual goes to the frame
+================
+*/
+static queryType_t SV_ParseQuery( const byte *data, int len, char *challenge, int challengeSize ) {
+	queryType_t type;
+	int i, start, n;
+
+	for ( i = 0; i < len && data[i] != '\n' && data[i] != '\0'; i++ ) {
+		if ( data[i] > 127 || data[i] == '%' || data[i] == '"' || data[i] == '/' )
+			return QUERY_NONE;
+	}
+
+	if ( i >= MAX_STRING_CHARS - 1 )
+		return QUERY_NONE;
+	len = i;
+
+	for ( i = 0; i < len && data[i] <= ' '; i++ )
+		;
+	for ( start = i; i < len && data[i] > ' '; i++ )
+		;
+	n = i - start;
+
+	if ( n == 9 && !Q_stricmpn( (const char *)data + start, "getstatus", 9 ) )
+		type = QUERY_STATUS;
+	else if ( n == 7 && !Q_stricmpn( (const char *)data + start, "getinfo", 7 ) )
+		type = QUERY_INFO;
+	else
+		return QUERY_NONE;
+
+	for ( ; i < len && data[i] <= ' '; i++ )
+		;
+	for ( start = i; i < len && data[i] > ' '; i++ ) {
+		// rejected by Info_SetValueForKey
+		if ( data[i] == '\\' || data[i] == ';' )
+			return QUERY_NONE;
+	}
+	n = i - start;
+
+	if ( n >= challengeSize )
+		return QUERY_NONE;
+
+	memcpy( challenge, data + start, n );
+	challenge[n] = '\0';
+
+	return type;
+}
+
+
+/*
+================
+SV_NetThreadPacket
+
+Called from network threads for every inbound datagram.
+Returns -1 to drop it, 0 to pass it to the frame
+or length of the reply written to the buffer
+================
+*/
+int SV_NetThreadPacket( int shard, const netadr_t *from, const byte *data, int len, byte *reply, int replySize ) {
+	static queryTemplate_t templates[ NET_MAX_SHARDS ];
+	char	challenge[ 256 ];
+	char	infostring[ MAX_INFO_STRING + 160 ];
+	queryTemplate_t *t;
+	leakyBucket_t *bucket;
+	queryType_t type;
+	qboolean limited;
+	int		infoLength, statusLength, i, n;
+	byte	*s;
+
+	if ( len < 4 || *(const int32_t *)data != -1 )
+		return 0; // sequenced packets are validated by netchan
+
+	if ( SV_CaptureActive() )
+		return 0; // the capture must see every datagram
+
+	type = SV_ParseQuery( data + 4, len - 4, challenge, sizeof( challenge ) );
+	t = &templates[ shard ];
+
+	if ( type == QUERY_NONE || !SV_ReadQueryTemplate( t ) ) {
+		SVC_LockLimits();
+		bucket = SVC_BucketForTable( &netBuckets, from, NET_FILTER_BURST, NET_FILTER_PERIOD );
+		limited = bucket == NULL || SVC_RateLimit( &bucket->rate, NET_FILTER_BURST, NET_FILTER_PERIOD );
+		SVC_UnlockLimits();
+		return limited ? -1 : 0;
+	}
+
+	// same text Info_SetValueForKey would produce
+	infostring[0] = '\0';
+	infoLength = 0;
+	if ( challenge[0] ) {
+		n = strlen( challenge );
+		if ( type == QUERY_INFO || t->serverinfoLength + 11 + n < MAX_INFO_STRING ) {
+			infoLength = Com_sprintf( infostring, sizeof( infostring ), "\\challenge\\%s", challenge );
+		}
+	}
+
+	if ( type == QUERY_INFO && infoLength + t->infoLength >= MAX_INFO_STRING )
+		return 0; // keys would be dropped differently
+
+	// same limits as SVC_Status and SVC_Info, shared with them
+	SVC_LockLimits();
+	bucket = SVC_BucketForTable( &netBuckets, from, 10, 1000 );
+	limited = bucket == NULL || SVC_RateLimit( &bucket->rate, 10, 1000 ) || SVC_RateLimit( &outboundRateLimit, 10, 100 );
+	SVC_UnlockLimits();
+	if ( limited )
+		return -1;
+
+	if ( strlen( challenge ) > 128 )
+		return -1;
+
+	s = reply;
+	*s++ = 0xFF; *s++ = 0xFF; *s++ = 0xFF; *s++ = 0xFF;
+
+	if ( type == QUERY_INFO ) {
+		if ( 4 + 13 + infoLength + t->infoLength > replySize )
+			return -1;
+		memcpy( s, "infoResponse\n", 13 ); s += 13;
+		memcpy( s, infostring, infoLength ); s += infoLength;
+		memcpy( s, t->info, t->infoLength ); s += t->infoLength;
+		return s - reply;
+	}
+
+	infoLength += t->serverinfoLength;
+	statusLength = infoLength + 16; // strlen( "statusResponse\n\n" )
+	if ( 4 + statusLength > replySize )
+		return -1;
+
+	memcpy( s, "statusResponse\n", 15 ); s += 15;
+	memcpy( s, t->serverinfo, t->serverinfoLength ); s += t->serverinfoLength;
+	memcpy( s, infostring, infoLength - t->serverinfoLength ); s += infoLength - t->serverinfoLength;
+	*s++ = '\n';
+
+	for ( i = 0, n = 0; i < t->numPlayers; n += t->playerLength[ i ], i++ ) {
+		if ( statusLength + t->playerLength[ i ] >= MAX_PACKETLEN-4 )
+			break; // can't hold any more
+		if ( ( s - reply ) + t->playerLength[ i ] > replySize )
+			break;
+		memcpy( s, t->players + n, t->playerLength[ i ] );
+		s += t->playerLength[ i ];
+		statusLength += t->playerLength[ i ];
+	}
+
+	return s - reply;
+}
+#endif // USE_NET_THREAD
+
+
 /*
 ================
 SV_FlushRedirect
@@ -875,6 +1440,8 @@ void SV_PacketEvent( const netadr_t *from, msg_t *msg ) {
 	if ( msg->cursize < 6 ) // too short for anything
 		return;
 
+	SV_CapturePacket( from, msg );
+
 	// check for connectionless packet (0xffffffff) first
 	if ( *(int32_t *)msg->data == -1 ) {
 		SV_ConnectionlessPacket( from, msg );
@@ -935,10 +1502,8 @@ Updates the cl->ping variables
 ===================
 */
 static void SV_CalcPings( void ) {
-	int			i, j;
+	int			i;
 	client_t	*cl;
-	int			total, count;
-	int			delta;
 	playerState_t	*ps;
 
 	for ( i = 0; i < sv.maxclients; i++ ) {
@@ -956,20 +1521,11 @@ static void SV_CalcPings( void ) {
 			continue;
 		}
 
-		total = 0;
-		count = 0;
-		for ( j = 0 ; j < PACKET_BACKUP ; j++ ) {
-			if ( cl->frames[j].messageAcked == 0 ) {
-				continue;
-			}
-			delta = cl->frames[j].messageAcked - cl->frames[j].messageSent;
-			count++;
-			total += delta;
-		}
-		if (!count) {
+		// acked frames are summed up as they are sent and acked
+		if ( !cl->pingCount ) {
 			cl->ping = 999;
 		} else {
-			cl->ping = total/count;
+			cl->ping = cl->pingTotal / cl->pingCount;
 			if ( cl->ping > 999 ) {
 				cl->ping = 999;
 			}
@@ -1038,6 +1594,89 @@ static void SV_CheckTimeouts( void ) {
 	}
 }
 
+/*
+==================
+SV_CloseStatsLog
+==================
+*/
+static fileHandle_t	statsLog = FS_INVALID_HANDLE;
+static int			statsLogTime;
+
+void SV_CloseStatsLog( void ) {
+	if ( statsLog != FS_INVALID_HANDLE ) {
+		FS_FCloseFile( statsLog );
+		statsLog = FS_INVALID_HANDLE;
+	}
+	statsLogTime = 0;
+}
+
+/*
+==================
+SV_LogClientStats
+
+Appends the counters of every connected client to sv_statsLog
+each sv_statsLogInterval seconds, one comma separated line per
+client with totals since it connected
+==================
+*/
+static void SV_LogClientStats( void ) {
+	const clientStats_t *st;
+	const client_t	*cl;
+	char		name[ MAX_NAME_LENGTH ], *s;
+	qtime_t		t;
+	int			i, elapsed;
+
+	if ( sv_statsLog->modified ) {
+		sv_statsLog->modified = qfalse;
+		SV_CloseStatsLog();
+	}
+
+	// svs.time restarts on a server restart, a negative delta is due
+	elapsed = svs.time - statsLogTime;
+	if ( !sv_statsLog->string[0] || ( elapsed >= 0 && elapsed < MAX( sv_statsLogInterval->integer, 1 ) * 1000 ) ) {
+		return;
+	}
+	statsLogTime = svs.time;
+
+	if ( statsLog == FS_INVALID_HANDLE ) {
+		statsLog = FS_FOpenFileAppend( sv_statsLog->string );
+		if ( statsLog == FS_INVALID_HANDLE ) {
+			Com_Printf( S_COLOR_YELLOW "couldn't open %s, client stats logging disabled\n", sv_statsLog->string );
+			Cvar_Set( "sv_statsLog", "" );
+			return;
+		}
+		FS_Printf( statsLog, "time,map,client,name,ping,rate,connected,snapshots,deltaSnapshots,snapshotBytes,"
+			"maxSnapshotBytes,entities,entityBytes,newEntities,rateDelayed,fragments,dropped,outOfOrder,"
+			"backlog,maxBacklog\n" );
+	}
+
+	Com_RealTime( &t );
+
+	for ( i = 0, cl = svs.clients; i < sv.maxclients; i++, cl++ ) {
+		if ( cl->state < CS_CONNECTED || cl->netchan.remoteAddress.type == NA_BOT ) {
+			continue;
+		}
+
+		// keep the name a single field
+		Q_strncpyz( name, cl->name, sizeof( name ) );
+		Q_CleanStr( name );
+		for ( s = name; *s; s++ ) {
+			if ( *s == ',' || *s == '"' ) {
+				*s = '_';
+			}
+		}
+
+		st = &cl->stats;
+		FS_Printf( statsLog, "%04i-%02i-%02i %02i:%02i:%02i,%s,%i,%s,%i,%i,%i,%i,%i,%lli,%i,%lli,%lli,%i,%i,%i,%i,%i,%i,%i\n",
+			1900 + t.tm_year, 1 + t.tm_mon, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, sv_mapname->string,
+			i, name, cl->ping, cl->rate, ( svs.time - st->startTime ) / 1000,
+			st->snapshots, st->deltaSnapshots, (long long)st->snapshotBytes, st->maxSnapshotBytes,
+			(long long)st->entities, (long long)( st->entityBits / 8 ), st->newEntities, st->rateDelayed,
+			cl->netchan.fragmentsSent, cl->netchan.droppedTotal, cl->netchan.outOfOrder,
+			cl->reliableSequence - cl->reliableAcknowledge, st->maxBacklog );
+	}
+}
+
 /*
 ==================
 SV_FrameMsec
@@ -1149,6 +1788,11 @@ void SV_Frame( int msec ) {
 
 	if(sv_paused->integer) return;
 
+	// simulated clients send before the frame is captured, like real packets
+	SV_LoadFrame();
+
+	SV_CaptureFrame( msec );
+
 	frameMsec = 1000 / sv_fps->integer * com_timescale->value;
 	// don't let it scale below 1ms
 	if(frameMsec < 1)
@@ -1211,11 +1855,29 @@ void SV_Frame( int msec ) {
 	// reset current and build new snapshot on first query
 	SV_IssueNewSnapshot();
 
+	// send coalesced configstring changes
+	SV_FlushConfigstrings();
+
 	// send messages back to the clients
+	Sys_BeginPacketBatch();
 	SV_SendClientMessages();
+	Sys_EndPacketBatch();
+
+	// queue the frame for the match recorder
+	SV_RecordFrame();
+
+	SV_LogClientStats();
+
+	SV_LoadFrameEnd();
 
 	// send a heartbeat to the master if needed
 	SV_MasterHeartbeat(HEARTBEAT_FOR_MASTER);
+
+#ifdef USE_NET_THREAD
+	// let network threads answer queries
+	if ( NET_ShardCount() )
+		SV_UpdateQueryTemplate();
+#endif
 }
 
 
@@ -1262,7 +1924,9 @@ int SV_SendQueuedPackets( void ) {
 	int timeVal = INT_MAX;
 
 	// Send out fragmented packets now that we're idle
+	Sys_BeginPacketBatch();
 	delayT = SV_SendQueuedMessages();
+	Sys_EndPacketBatch();
 	if(delayT >= 0)
 		timeVal = delayT;
 
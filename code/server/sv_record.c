@@ -0,0 +1,924 @@
+/*
+===========================================================================
+Copyright (C) 1999-2005 Id Software, Inc.
+
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+#include "server.h"
+
+#ifndef _WIN32
+#define USE_RECORD_THREAD
+#include <pthread.h>
+#endif
+
+/*
+=============================================================================
+
+MATCH RECORDING
+
+A recording holds what every client could have seen: the common snapshot
+entities, all active player states, configstring changes and game server
+commands, encoded once per server frame regardless of the client count.
+
+Blocks are encoded on the server thread into a bounded ring buffer and
+written out by a background thread, so a slow disk never stalls SV_Frame.
+When the ring is full the block is dropped and the next one is written as
+a keyframe, so a recording stays decodable from that point on.
+
+All integers in the file are little endian:
+
+  header		"SVRC" version GENTITYNUM_BITS MAX_CLIENTS
+  block			length, then a huffman message of length bytes
+  ...
+  end			zero length
+
+A block is sv.time, a keyframe byte and a list of ops terminated by
+REC_END. Keyframes carry every configstring and full entity and player
+states, other blocks only what changed since the previous block:
+
+  REC_CONFIGSTRING	index string
+  REC_COMMAND		clientNum (-1 for everyone) string
+  REC_ENTITIES		entity deltas as in packetentities
+  REC_PLAYER		clientNum, playerstate delta from the previous block
+
+=============================================================================
+*/
+
+#define RECORD_MAGIC		0x43525653	// "SVRC"
+#define RECORD_VERSION		1
+
+#define RECORD_KEYFRAME_MSEC	10000
+#define RECORD_EVENT_BYTES		(64*1024)
+#define RECORD_BLOCK_BYTES		(MAX_MSGLEN + RECORD_EVENT_BYTES + MAX_GENTITIES*128 + MAX_CLIENTS*1024)
+#define RECORD_SLACK			64		// huffman writes may touch a few bytes past the end
+#define RECORD_MAX_RING			(256*1024*1024)
+
+typedef enum {
+	REC_END,
+	REC_CONFIGSTRING,
+	REC_COMMAND,
+	REC_ENTITIES,
+	REC_PLAYER
+} recordOp_t;
+
+typedef struct {
+	qboolean		active;
+	qboolean		automatic;		// started by sv_autoRecord
+	char			filename[ MAX_QPATH ];
+	FILE			*file;
+
+	// write-behind ring, head is only moved by the server thread
+	// and tail by the writer, both under the lock
+	byte			*ring;
+	unsigned		ringSize;		// power of two
+	unsigned		head;
+	unsigned		tail;
+	qboolean		writeError;
+	int64_t			written;
+#ifdef USE_RECORD_THREAD
+	qboolean		threaded;
+	qboolean		quit;
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+#endif
+
+	// encoder state
+	byte			*block;
+	byte			*eventData;
+	msg_t			events;			// commands since the last block
+	int				numEvents;
+	entityState_t	*prevEnts;
+	int				numPrevEnts;
+	playerState_t	prevPs[ MAX_CLIENTS ];
+	byte			havePs[ MAX_CLIENTS ];
+	byte			csDirty[ MAX_CONFIGSTRINGS ];
+	int				numCsDirty;
+	int				lastTime;
+	int				keyframeTime;
+	qboolean		forceKeyframe;
+
+	int				startTime;
+	int				blocks;
+	int				keyframes;
+	int				dropped;
+	int				lostCommands;
+} record_t;
+
+static record_t		record;
+
+
+/*
+==================
+SV_RecordLock
+==================
+*/
+static void SV_RecordLock( void ) {
+#ifdef USE_RECORD_THREAD
+	if ( record.threaded ) {
+		pthread_mutex_lock( &record.lock );
+	}
+#endif
+}
+
+
+static void SV_RecordUnlock( void ) {
+#ifdef USE_RECORD_THREAD
+	if ( record.threaded ) {
+		pthread_mutex_unlock( &record.lock );
+	}
+#endif
+}
+
+
+/*
+==================
+SV_RecordWrite
+
+Writes out the ring up to head, on the writer thread
+when there is one. After a write error data is discarded
+so the server side never sees a full ring because of it.
+==================
+*/
+static void SV_RecordWrite( unsigned head ) {
+	unsigned	tail, offset, n;
+
+	tail = record.tail;
+	while ( tail != head ) {
+		offset = tail & ( record.ringSize - 1 );
+		n = head - tail;
+		if ( n > record.ringSize - offset ) {
+			n = record.ringSize - offset;
+		}
+
+		if ( !record.writeError ) {
+			if ( fwrite( record.ring + offset, 1, n, record.file ) != n ) {
+				record.writeError = qtrue;
+			} else {
+				record.written += n;
+			}
+		}
+
+		tail += n;
+		SV_RecordLock();
+		record.tail = tail;
+		SV_RecordUnlock();
+	}
+}
+
+
+#ifdef USE_RECORD_THREAD
+/*
+==================
+SV_RecordThread
+==================
+*/
+static void *SV_RecordThread( void *arg ) {
+	unsigned	head;
+
+	pthread_mutex_lock( &record.lock );
+	for ( ;; ) {
+		while ( record.head == record.tail && !record.quit ) {
+			pthread_cond_wait( &record.wake, &record.lock );
+		}
+		if ( record.head == record.tail ) {
+			break;	// asked to quit and everything is written
+		}
+		head = record.head;
+		pthread_mutex_unlock( &record.lock );
+
+		SV_RecordWrite( head );
+
+		pthread_mutex_lock( &record.lock );
+	}
+	pthread_mutex_unlock( &record.lock );
+
+	return NULL;
+}
+#endif
+
+
+/*
+==================
+SV_RecordCopy
+==================
+*/
+static void SV_RecordCopy( unsigned pos, const void *data, unsigned len ) {
+	const unsigned offset = pos & ( record.ringSize - 1 );
+	const unsigned n = MIN( len, record.ringSize - offset );
+
+	Com_Memcpy( record.ring + offset, data, n );
+	Com_Memcpy( record.ring, (const byte *)data + n, len - n );
+}
+
+
+/*
+==================
+SV_RecordQueue
+
+Appends a length prefixed block to the ring, fails instead
+of waiting when the writer is behind
+==================
+*/
+static qboolean SV_RecordQueue( const byte *data, int len ) {
+	unsigned	used;
+	int			length;
+
+	SV_RecordLock();
+	used = record.head - record.tail;
+	SV_RecordUnlock();
+
+	if ( used + 4 + len > record.ringSize ) {
+		return qfalse;
+	}
+
+	// the writer never reads past head, so the free space can be filled unlocked
+	length = LittleLong( len );
+	SV_RecordCopy( record.head, &length, 4 );
+	SV_RecordCopy( record.head + 4, data, len );
+
+	SV_RecordLock();
+	record.head += 4 + len;
+#ifdef USE_RECORD_THREAD
+	if ( record.threaded ) {
+		pthread_cond_signal( &record.wake );
+	}
+#endif
+	SV_RecordUnlock();
+
+#ifdef USE_RECORD_THREAD
+	if ( !record.threaded )
+#endif
+	SV_RecordWrite( record.head );
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_RecordConfigstring
+
+Called from SV_SetConfigstring, the string itself is
+taken when the next block is written
+==================
+*/
+void SV_RecordConfigstring( int index ) {
+	if ( !record.active || record.csDirty[ index ] ) {
+		return;
+	}
+	record.csDirty[ index ] = 1;
+	record.numCsDirty++;
+}
+
+
+/*
+==================
+SV_RecordCommand
+
+Called for every server command issued by the game
+==================
+*/
+void SV_RecordCommand( int clientNum, const char *text ) {
+	int		bit;
+
+	if ( !record.active || clientNum < -1 || clientNum >= sv.maxclients ) {
+		return;
+	}
+
+	bit = record.events.bit;
+
+	MSG_WriteByte( &record.events, REC_COMMAND );
+	MSG_WriteShort( &record.events, clientNum );
+	MSG_WriteBigString( &record.events, text );
+
+	// keep the events that fit
+	if ( record.events.overflowed ) {
+		record.events.overflowed = qfalse;
+		record.events.bit = bit;
+		record.lostCommands++;
+	} else {
+		record.numEvents++;
+	}
+}
+
+
+/*
+==================
+SV_RecordEntities
+
+Emits the common snapshot as a delta from the previous block
+==================
+*/
+static void SV_RecordEntities( msg_t *msg ) {
+	static const entityState_t	nullstate;
+	const entityState_t	*oldent, *newent;
+	int		oldindex, newindex;
+	int		oldnum, newnum;
+	int		count;
+
+	count = SV_CommonSnapshot();
+
+	MSG_WriteByte( msg, REC_ENTITIES );
+
+	newent = NULL;
+	oldent = NULL;
+	newindex = 0;
+	oldindex = 0;
+	while ( newindex < count || oldindex < record.numPrevEnts ) {
+		if ( newindex >= count ) {
+			newnum = MAX_GENTITIES+1;
+		} else {
+			newent = SV_CommonSnapshotEntity( newindex );
+			newnum = newent->number;
+		}
+
+		if ( oldindex >= record.numPrevEnts ) {
+			oldnum = MAX_GENTITIES+1;
+		} else {
+			oldent = &record.prevEnts[ oldindex ];
+			oldnum = oldent->number;
+		}
+
+		if ( newnum == oldnum ) {
+			MSG_WriteDeltaEntity( msg, oldent, newent, qfalse );
+			oldindex++;
+			newindex++;
+		} else if ( newnum < oldnum ) {
+			MSG_WriteDeltaEntity( msg, &nullstate, newent, qtrue );
+			newindex++;
+		} else {
+			MSG_WriteDeltaEntity( msg, oldent, NULL, qtrue );
+			oldindex++;
+		}
+	}
+
+	MSG_WriteEntitynum( msg, MAX_GENTITIES-1 );
+
+	for ( newindex = 0; newindex < count; newindex++ ) {
+		record.prevEnts[ newindex ] = *SV_CommonSnapshotEntity( newindex );
+	}
+	record.numPrevEnts = count;
+}
+
+
+/*
+==================
+SV_RecordFrame
+
+Encodes one block after the clients were sent their snapshots,
+at most once per game time
+==================
+*/
+void SV_RecordFrame( void ) {
+	const playerState_t	*ps;
+	qboolean	keyframe;
+	msg_t		msg;
+	int			i, commands;
+
+	if ( !record.active || sv.state != SS_GAME || sv.time == record.lastTime ) {
+		return;
+	}
+
+	keyframe = record.forceKeyframe || sv.time - record.keyframeTime >= RECORD_KEYFRAME_MSEC
+		|| sv.time < record.keyframeTime;
+
+	MSG_Init( &msg, record.block, RECORD_BLOCK_BYTES );
+	MSG_WriteLong( &msg, sv.time );
+	MSG_WriteByte( &msg, keyframe );
+
+	if ( keyframe ) {
+		record.numPrevEnts = 0;
+		Com_Memset( record.havePs, 0, sizeof( record.havePs ) );
+	}
+
+	// configstrings
+	if ( keyframe || record.numCsDirty ) {
+		for ( i = 0; i < MAX_CONFIGSTRINGS; i++ ) {
+			if ( keyframe ? !sv.configstrings[ i ][0] : !record.csDirty[ i ] ) {
+				continue;
+			}
+			MSG_WriteByte( &msg, REC_CONFIGSTRING );
+			MSG_WriteShort( &msg, i );
+			MSG_WriteBigString( &msg, sv.configstrings[ i ] );
+		}
+		Com_Memset( record.csDirty, 0, sizeof( record.csDirty ) );
+		record.numCsDirty = 0;
+	}
+
+	// commands
+	MSG_WriteBitStream( &msg, record.eventData, record.events.bit );
+	MSG_Init( &record.events, record.eventData, RECORD_EVENT_BYTES );
+	commands = record.numEvents;
+	record.numEvents = 0;
+
+	SV_RecordEntities( &msg );
+
+	// player states
+	for ( i = 0; i < sv.maxclients; i++ ) {
+		if ( svs.clients[ i ].state != CS_ACTIVE ) {
+			record.havePs[ i ] = 0;
+			continue;
+		}
+		ps = SV_GameClientNum( i );
+		MSG_WriteByte( &msg, REC_PLAYER );
+		MSG_WriteByte( &msg, i );
+		MSG_WriteDeltaPlayerstate( &msg, record.havePs[ i ] ? &record.prevPs[ i ] : NULL, ps );
+		record.prevPs[ i ] = *ps;
+		record.havePs[ i ] = 1;
+	}
+
+	MSG_WriteByte( &msg, REC_END );
+
+	record.lastTime = sv.time;
+
+	if ( msg.overflowed || !SV_RecordQueue( record.block, msg.cursize ) ) {
+		// a keyframe restores state but not the commands of this block
+		record.dropped++;
+		record.lostCommands += commands;
+		record.forceKeyframe = qtrue;
+		return;
+	}
+
+	record.blocks++;
+	if ( keyframe ) {
+		record.keyframes++;
+		record.keyframeTime = sv.time;
+		record.forceKeyframe = qfalse;
+	}
+}
+
+
+/*
+==================
+SV_StopRecord
+
+Waits until everything queued is on disk, called on server shutdown
+==================
+*/
+void SV_StopRecord( void ) {
+	int		end;
+
+	if ( !record.active ) {
+		return;
+	}
+
+#ifdef USE_RECORD_THREAD
+	if ( record.threaded ) {
+		pthread_mutex_lock( &record.lock );
+		record.quit = qtrue;
+		pthread_cond_signal( &record.wake );
+		pthread_mutex_unlock( &record.lock );
+		pthread_join( record.thread, NULL );
+		pthread_cond_destroy( &record.wake );
+		pthread_mutex_destroy( &record.lock );
+		record.threaded = qfalse;
+	}
+#endif
+
+	end = 0;
+	if ( fwrite( &end, 4, 1, record.file ) != 1 || fclose( record.file ) != 0 ) {
+		record.writeError = qtrue;
+	}
+
+	Com_Printf( "recording %s stopped: %i:%02i, %i blocks, %i keyframes, %i KB\n", record.filename,
+		( Sys_Milliseconds() - record.startTime ) / 60000, ( ( Sys_Milliseconds() - record.startTime ) / 1000 ) % 60,
+		record.blocks, record.keyframes, (int)( record.written / 1024 ) );
+	if ( record.dropped || record.lostCommands ) {
+		Com_Printf( S_COLOR_YELLOW "%i blocks and %i commands were dropped, raise sv_recordBuffer\n",
+			record.dropped, record.lostCommands );
+	}
+	if ( record.writeError ) {
+		Com_Printf( S_COLOR_YELLOW "error writing %s, the recording is incomplete\n", record.filename );
+	}
+
+	Z_Free( record.ring );
+	Z_Free( record.block );
+	Z_Free( record.eventData );
+	Z_Free( record.prevEnts );
+	Com_Memset( &record, 0, sizeof( record ) );
+}
+
+
+/*
+==================
+SV_StartRecord
+==================
+*/
+static void SV_StartRecord( const char *name, qboolean automatic ) {
+	fileHandle_t	f;
+	unsigned		size, want;
+	int				header[4];
+
+	Com_sprintf( record.filename, sizeof( record.filename ), "records/%s", name );
+	COM_DefaultExtension( record.filename, sizeof( record.filename ), ".svrec" );
+
+	// let the filesystem create the directory, the writer uses stdio directly
+	f = FS_FOpenFileWrite( record.filename );
+	if ( f == FS_INVALID_HANDLE ) {
+		Com_Printf( "couldn't open %s\n", record.filename );
+		return;
+	}
+	FS_FCloseFile( f );
+
+	record.file = Sys_FOpen( FS_BuildPath( record.filename ), "wb" );
+	if ( !record.file ) {
+		Com_Printf( "couldn't open %s\n", record.filename );
+		return;
+	}
+
+	// the ring must hold at least two worst-case blocks
+	if ( sv_recordBuffer->integer < 0 || sv_recordBuffer->integer > RECORD_MAX_RING / 1024 ) {
+		Com_Printf( S_COLOR_YELLOW "sv_recordBuffer must be between 0 and %i KB\n", RECORD_MAX_RING / 1024 );
+		Cvar_Set( "sv_recordBuffer", va( "%i", sv_recordBuffer->integer < 0 ? 0 : RECORD_MAX_RING / 1024 ) );
+	}
+	want = MAX( (unsigned)sv_recordBuffer->integer * 1024, 2 * RECORD_BLOCK_BYTES );
+	for ( size = 1; size < want && size < RECORD_MAX_RING; size <<= 1 )
+		;
+
+	record.ringSize = size;
+	record.ring = Z_Malloc( size );
+	record.block = Z_Malloc( RECORD_BLOCK_BYTES + RECORD_SLACK );
+	record.eventData = Z_Malloc( RECORD_EVENT_BYTES + RECORD_SLACK );
+	record.prevEnts = Z_Malloc( MAX_GENTITIES * sizeof( entityState_t ) );
+
+	header[0] = LittleLong( RECORD_MAGIC );
+	header[1] = LittleLong( RECORD_VERSION );
+	header[2] = LittleLong( GENTITYNUM_BITS );
+	header[3] = LittleLong( MAX_CLIENTS );
+	if ( fwrite( header, sizeof( header ), 1, record.file ) != 1 ) {
+		record.writeError = qtrue;
+	}
+
+	MSG_Init( &record.events, record.eventData, RECORD_EVENT_BYTES );
+	record.forceKeyframe = qtrue;
+	record.lastTime = -1;
+	record.startTime = Sys_Milliseconds();
+	record.automatic = automatic;
+	record.active = qtrue;
+
+#ifdef USE_RECORD_THREAD
+	if ( pthread_mutex_init( &record.lock, NULL ) == 0 ) {
+		if ( pthread_cond_init( &record.wake, NULL ) == 0 ) {
+			if ( pthread_create( &record.thread, NULL, SV_RecordThread, NULL ) == 0 ) {
+				record.threaded = qtrue;
+			} else {
+				pthread_cond_destroy( &record.wake );
+				pthread_mutex_destroy( &record.lock );
+			}
+		} else {
+			pthread_mutex_destroy( &record.lock );
+		}
+	}
+	if ( !record.threaded ) {
+		Com_Printf( S_COLOR_YELLOW "couldn't start the writer thread, recording synchronously\n" );
+	}
+#endif
+
+	Com_Printf( "recording to %s\n", record.filename );
+}
+
+
+/*
+==================
+SV_RecordMap
+
+Called at the end of SV_SpawnServer, sv_autoRecord
+starts a new file for every map
+==================
+*/
+void SV_RecordMap( void ) {
+	char	name[ MAX_QPATH ];
+	qtime_t	t;
+
+	if ( sv_autoRecord->integer && ( !record.active || record.automatic ) ) {
+		SV_StopRecord();
+		Com_RealTime( &t );
+		Com_sprintf( name, sizeof( name ), "%04i%02i%02i-%02i%02i%02i-%s", 1900 + t.tm_year, 1 + t.tm_mon,
+			t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, sv_mapname->string );
+		SV_StartRecord( name, qtrue );
+		return;
+	}
+
+	if ( record.active ) {
+		record.forceKeyframe = qtrue;
+		record.lastTime = -1;
+	}
+}
+
+
+/*
+==================
+SV_Record_f
+==================
+*/
+void SV_Record_f( void ) {
+	if ( Cmd_Argc() != 2 ) {
+		Com_Printf( "usage: svrecord <name>\n" );
+		return;
+	}
+
+	if ( record.active ) {
+		Com_Printf( "already recording to %s\n", record.filename );
+		return;
+	}
+
+	SV_StartRecord( Cmd_Argv( 1 ), qfalse );
+}
+
+
+/*
+==================
+SV_RecordStop_f
+==================
+*/
+void SV_RecordStop_f( void ) {
+	if ( !record.active ) {
+		Com_Printf( "not recording\n" );
+		return;
+	}
+	SV_StopRecord();
+}
+
+
+/*
+=============================================================================
+
+RECORDING INFO
+
+Decodes a whole recording to check it and print a summary,
+optionally with every server command for moderation.
+
+=============================================================================
+*/
+
+typedef struct {
+	fileHandle_t	file;
+	byte			*data;
+	entityState_t	*ents[2];
+	int				numEnts[2];
+	playerState_t	*ps;
+	byte			havePs[ MAX_CLIENTS ];
+	byte			seenPs[ MAX_CLIENTS ];
+	qboolean		showCommands;
+
+	int				firstTime;
+	int				lastTime;
+	int				blocks;
+	int				keyframes;
+	int				configstrings;
+	int				commands;
+	int				maxEntities;
+	int				maxPlayers;
+} recordInfo_t;
+
+
+/*
+==================
+SV_RecordInfoEntities
+==================
+*/
+static qboolean SV_RecordInfoEntities( recordInfo_t *info, msg_t *msg, int cur ) {
+	static const entityState_t	nullstate;
+	const entityState_t	*old = info->ents[ cur ^ 1 ];
+	const int			numOld = info->numEnts[ cur ^ 1 ];
+	entityState_t		*ents = info->ents[ cur ];
+	int		oldindex, count, newnum;
+
+	oldindex = 0;
+	count = 0;
+	for ( ;; ) {
+		newnum = MSG_ReadEntitynum( msg );
+		if ( msg->readcount > msg->cursize ) {
+			return qfalse;
+		}
+		if ( newnum == MAX_GENTITIES-1 ) {
+			break;
+		}
+
+		// unchanged entities
+		while ( oldindex < numOld && old[ oldindex ].number < newnum ) {
+			ents[ count++ ] = old[ oldindex++ ];
+		}
+
+		if ( oldindex < numOld && old[ oldindex ].number == newnum ) {
+			MSG_ReadDeltaEntity( msg, &old[ oldindex++ ], &ents[ count ], newnum );
+		} else {
+			MSG_ReadDeltaEntity( msg, &nullstate, &ents[ count ], newnum );
+		}
+
+		if ( ents[ count ].number != MAX_GENTITIES-1 ) {
+			if ( count >= MAX_GENTITIES-1 ) {
+				return qfalse;
+			}
+			count++;
+		}
+	}
+
+	while ( oldindex < numOld ) {
+		ents[ count++ ] = old[ oldindex++ ];
+	}
+
+	info->numEnts[ cur ] = count;
+	info->maxEntities = MAX( info->maxEntities, count );
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_RecordInfoBlock
+==================
+*/
+static qboolean SV_RecordInfoBlock( recordInfo_t *info, msg_t *msg ) {
+	playerState_t	ps;
+	const char		*s;
+	int		time, op, index, players, cur;
+	qboolean	entities;
+
+	cur = info->blocks & 1;
+	entities = qfalse;
+
+	time = MSG_ReadLong( msg );
+	if ( MSG_ReadByte( msg ) ) {
+		info->keyframes++;
+		info->numEnts[ cur ^ 1 ] = 0;
+		Com_Memset( info->havePs, 0, sizeof( info->havePs ) );
+	}
+
+	if ( !info->blocks ) {
+		info->firstTime = time;
+	}
+	info->lastTime = time;
+
+	Com_Memset( info->seenPs, 0, sizeof( info->seenPs ) );
+	players = 0;
+
+	while ( ( op = MSG_ReadByte( msg ) ) != REC_END ) {
+		if ( msg->readcount > msg->cursize ) {
+			return qfalse;
+		}
+
+		switch ( op ) {
+		case REC_CONFIGSTRING:
+			index = MSG_ReadShort( msg );
+			MSG_ReadBigString( msg );
+			if ( index < 0 || index >= MAX_CONFIGSTRINGS ) {
+				return qfalse;
+			}
+			info->configstrings++;
+			break;
+
+		case REC_COMMAND:
+			index = MSG_ReadShort( msg );
+			s = MSG_ReadBigString( msg );
+			if ( info->showCommands ) {
+				Com_Printf( "%3i:%02i.%03i %3i %s\n", ( time - info->firstTime ) / 60000,
+					( ( time - info->firstTime ) / 1000 ) % 60, ( time - info->firstTime ) % 1000, index, s );
+			}
+			info->commands++;
+			break;
+
+		case REC_ENTITIES:
+			if ( entities || !SV_RecordInfoEntities( info, msg, cur ) ) {
+				return qfalse;
+			}
+			entities = qtrue;
+			break;
+
+		case REC_PLAYER:
+			index = MSG_ReadByte( msg );
+			if ( index >= MAX_CLIENTS || info->seenPs[ index ] ) {
+				return qfalse;
+			}
+			MSG_ReadDeltaPlayerstate( msg, info->havePs[ index ] ? &info->ps[ index ] : NULL, &ps );
+			info->ps[ index ] = ps;
+			info->seenPs[ index ] = 1;
+			players++;
+			break;
+
+		default:
+			return qfalse;
+		}
+	}
+
+	// every block carries the entity list
+	if ( !entities || msg->readcount > msg->cursize ) {
+		return qfalse;
+	}
+
+	// players missing from a block are deltaed from nothing when they return
+	Com_Memcpy( info->havePs, info->seenPs, sizeof( info->havePs ) );
+	info->maxPlayers = MAX( info->maxPlayers, players );
+	info->blocks++;
+
+	return qtrue;
+}
+
+
+/*
+==================
+SV_RecordInfo_f
+==================
+*/
+void SV_RecordInfo_f( void ) {
+	static recordInfo_t	info;
+	char		filename[ MAX_QPATH ];
+	int			header[4];
+	int			length, total;
+	qboolean	ok, ended;
+	msg_t		msg;
+
+	if ( Cmd_Argc() < 2 ) {
+		Com_Printf( "usage: svrecordinfo <name> [commands]\n" );
+		return;
+	}
+
+	Com_sprintf( filename, sizeof( filename ), "records/%s", Cmd_Argv( 1 ) );
+	COM_DefaultExtension( filename, sizeof( filename ), ".svrec" );
+
+	Com_Memset( &info, 0, sizeof( info ) );
+	info.showCommands = ( Cmd_Argc() > 2 && !Q_stricmp( Cmd_Argv( 2 ), "commands" ) );
+
+	if ( FS_FOpenFileRead( filename, &info.file, qtrue ) <= 0 ) {
+		Com_Printf( "couldn't open %s\n", filename );
+		return;
+	}
+
+	if ( FS_Read( header, sizeof( header ), info.file ) != sizeof( header )
+		|| LittleLong( header[0] ) != RECORD_MAGIC || LittleLong( header[1] ) != RECORD_VERSION ) {
+		Com_Printf( "%s is not a version %i recording\n", filename, RECORD_VERSION );
+		FS_FCloseFile( info.file );
+		return;
+	}
+
+	if ( LittleLong( header[2] ) != GENTITYNUM_BITS || LittleLong( header[3] ) != MAX_CLIENTS ) {
+		Com_Printf( "%s was recorded with %i entity bits and %i clients, this build uses %i and %i\n", filename,
+			LittleLong( header[2] ), LittleLong( header[3] ), GENTITYNUM_BITS, MAX_CLIENTS );
+		FS_FCloseFile( info.file );
+		return;
+	}
+
+	info.data = Z_Malloc( RECORD_BLOCK_BYTES + RECORD_SLACK );
+	info.ents[0] = Z_Malloc( MAX_GENTITIES * sizeof( entityState_t ) );
+	info.ents[1] = Z_Malloc( MAX_GENTITIES * sizeof( entityState_t ) );
+	info.ps = Z_Malloc( MAX_CLIENTS * sizeof( playerState_t ) );
+
+	ok = qtrue;
+	ended = qfalse;
+	total = sizeof( header );
+
+	while ( ok && FS_Read( &length, 4, info.file ) == 4 ) {
+		length = LittleLong( length );
+		total += 4 + length;
+		if ( length == 0 ) {
+			ended = qtrue;
+			break;
+		}
+		if ( length < 0 || length > RECORD_BLOCK_BYTES || FS_Read( info.data, length, info.file ) != length ) {
+			ok = qfalse;
+			break;
+		}
+		// the reader looks a few bytes ahead
+		Com_Memset( info.data + length, 0, RECORD_SLACK );
+
+		MSG_Init( &msg, info.data, RECORD_BLOCK_BYTES );
+		msg.cursize = length;
+		MSG_BeginReading( &msg );
+		ok = SV_RecordInfoBlock( &info, &msg );
+	}
+
+	if ( ok ) {
+		Com_Printf( "%s: %i:%02i, %i blocks, %i keyframes, %i configstrings, %i commands, "
+			"up to %i entities and %i players, %i KB\n", filename,
+			( info.lastTime - info.firstTime ) / 60000, ( ( info.lastTime - info.firstTime ) / 1000 ) % 60,
+			info.blocks, info.keyframes, info.configstrings, info.commands,
+			info.maxEntities, info.maxPlayers, total / 1024 );
+	}
+	if ( !ok || !ended ) {
+		Com_Printf( S_COLOR_YELLOW "%s is truncated or corrupt after %i blocks\n", filename, info.blocks );
+	}
+
+	FS_FCloseFile( info.file );
+	Z_Free( info.data );
+	Z_Free( info.ents[0] );
+	Z_Free( info.ents[1] );
+	Z_Free( info.ps );
+}
@@ -22,6 +22,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "server.h"
 
+#if idx64
+#include <emmintrin.h>
+#elif arm64
+#include <arm_neon.h>
+#endif
+
 /*
 =============================================================================
 
@@ -44,6 +50,214 @@ A normal server packet will look like:
 =============================================================================
 */
 
+#define FRAME_SLOT( frame, i ) svs.snapshotIndexes[ ( (frame)->first_entity + (i) ) & ( svs.numSnapshotIndexes - 1 ) ]
+
+/*
+===============
+SV_SnapshotEntity
+
+Returns entity state from a client frame
+===============
+*/
+entityState_t *SV_SnapshotEntity( const clientSnapshot_t *frame, int index ) {
+	return &svs.snapshotEntities[ FRAME_SLOT( frame, index ) ];
+}
+
+
+/*
+===============
+SV_CommonEntity
+
+Returns entity state from a common snapshot frame
+===============
+*/
+static entityState_t *SV_CommonEntity( const snapshotFrame_t *sf, int index ) {
+	index += sf->start;
+	if ( index >= svs.numSnapshotEntities ) {
+		index -= svs.numSnapshotEntities;
+	}
+	return &svs.snapshotEntities[ index ];
+}
+
+
+/*
+===============
+SV_ClientFrameValid
+
+Client frame can be used for delta compression only while both common
+snapshot storage and its entity indexes were not overwritten yet
+===============
+*/
+static qboolean SV_ClientFrameValid( const clientSnapshot_t *frame ) {
+	if ( frame->frameNum - svs.lastValidFrame < 0 ) {
+		return qfalse;
+	}
+	if ( svs.nextSnapshotIndex - frame->first_entity > svs.numSnapshotIndexes ) {
+		return qfalse;
+	}
+	return qtrue;
+}
+
+
+/*
+=============================================================================
+
+DELTA CACHE
+
+Most clients delta the same entity between the same two common snapshot
+frames, so encoded entity deltas are kept for the current common frame,
+keyed by their (from, to) state pointers, and spliced into each message.
+Pointers into svs.snapshotEntities are stable until the next common
+snapshot is built, which also invalidates the cache.
+
+=============================================================================
+*/
+
+#define DELTA_CACHE_SLOTS	8192		// must be power of two
+#define DELTA_CACHE_PROBES	8
+#define DELTA_CACHE_BYTES	(512*1024)
+// Worst case for MSG_WriteDeltaEntity is all 55 entityStateFields changed
+// at full width: GENTITYNUM_BITS + 10 header bits, then 35 bits per field
+// (changed, zero, int/float flags and 32 value bits), 1949 bits with 14 bit
+// entity numbers.  Whole bytes are Huffman coded in at most 11 bits, so the
+// encoded delta stays under 336 bytes.  Anything larger still falls back
+// to direct encoding rather than running past the data pool.
+#define MAX_DELTA_BYTES		512
+#define DELTA_SLACK			8			// a write can pass maxbits before overflow is flagged
+
+typedef struct {
+	const entityState_t	*from;
+	const entityState_t	*to;
+	int		frameNum;		// common frame this entry belongs to
+	int		force;
+	int		offset;			// in deltaCacheData
+	int		bits;
+} deltaCacheEntry_t;
+
+static deltaCacheEntry_t	deltaCache[ DELTA_CACHE_SLOTS ];
+static byte		deltaCacheData[ DELTA_CACHE_BYTES ];
+static int		deltaCacheUsed;
+static int		deltaCacheFrame;
+
+static struct {
+	unsigned	hits;
+	unsigned	misses;
+	unsigned	uncached;	// no free slot or data space left
+	int			peakBytes;
+} deltaStats;
+
+
+/*
+===============
+SV_ClearDeltaCache
+===============
+*/
+static void SV_ClearDeltaCache( void ) {
+	int i;
+
+	for ( i = 0; i < DELTA_CACHE_SLOTS; i++ ) {
+		deltaCache[ i ].frameNum = -1;
+	}
+	deltaCacheUsed = 0;
+	deltaCacheFrame = -1;
+}
+
+
+/*
+===============
+SV_WriteDeltaEntityCached
+===============
+*/
+static void SV_WriteDeltaEntityCached( msg_t *msg, const entityState_t *from, const entityState_t *to, qboolean force ) {
+	deltaCacheEntry_t *e;
+	unsigned int h;
+	int frameNum;
+	msg_t tmp;
+	int n;
+
+	if ( !sv_deltaCache->integer || !svs.currFrame || !from || !to ) {
+		MSG_WriteDeltaEntity( msg, from, to, force );
+		return;
+	}
+
+	frameNum = svs.currFrame->frameNum;
+	if ( deltaCacheFrame != frameNum ) {
+		if ( deltaCacheUsed > deltaStats.peakBytes ) {
+			deltaStats.peakBytes = deltaCacheUsed;
+		}
+		deltaCacheFrame = frameNum;
+		deltaCacheUsed = 0;
+	}
+
+	h = (unsigned int)( (intptr_t)from >> 2 ) * 0x9E3779B1U ^ (unsigned int)( (intptr_t)to >> 2 );
+	h = ( h ^ ( h >> 15 ) ) & ( DELTA_CACHE_SLOTS - 1 );
+
+	for ( n = 0; n < DELTA_CACHE_PROBES; n++, h = ( h + 1 ) & ( DELTA_CACHE_SLOTS - 1 ) ) {
+		e = &deltaCache[ h ];
+		if ( e->frameNum != frameNum ) {
+			break; // free slot
+		}
+		if ( e->from == from && e->to == to && e->force == force ) {
+			deltaStats.hits++;
+			MSG_WriteBitStream( msg, deltaCacheData + e->offset, e->bits );
+			return;
+		}
+	}
+
+	deltaStats.misses++;
+
+	if ( n == DELTA_CACHE_PROBES || deltaCacheUsed + MAX_DELTA_BYTES + DELTA_SLACK > DELTA_CACHE_BYTES ) {
+		deltaStats.uncached++;
+		MSG_WriteDeltaEntity( msg, from, to, force );
+		return;
+	}
+
+	// encode directly into the data pool
+	MSG_Init( &tmp, deltaCacheData + deltaCacheUsed, MAX_DELTA_BYTES );
+	MSG_WriteDeltaEntity( &tmp, from, to, force );
+
+	if ( tmp.overflowed ) {
+		deltaStats.uncached++;
+		MSG_WriteDeltaEntity( msg, from, to, force );
+		return;
+	}
+
+	e->from = from;
+	e->to = to;
+	e->force = force;
+	e->frameNum = frameNum;
+	e->offset = deltaCacheUsed;
+	e->bits = tmp.bit;
+
+	deltaCacheUsed += ( tmp.bit + 7 ) >> 3;
+
+	MSG_WriteBitStream( msg, deltaCacheData + e->offset, e->bits );
+}
+
+
+/*
+===============
+SV_DeltaCacheStats_f
+===============
+*/
+void SV_DeltaCacheStats_f( void ) {
+	unsigned total;
+
+	total = deltaStats.hits + deltaStats.misses;
+
+	Com_Printf( "delta cache: %s\n", sv_deltaCache->integer ? "enabled" : "disabled" );
+	Com_Printf( "%u lookups, %u hits (%.1f%%), %u misses, %u uncached\n",
+		total, deltaStats.hits, total ? deltaStats.hits * 100.0 / total : 0.0,
+		deltaStats.misses, deltaStats.uncached );
+	Com_Printf( "%i bytes used by current frame, %i peak of %i\n",
+		deltaCacheUsed, deltaStats.peakBytes, DELTA_CACHE_BYTES );
+
+	if ( Cmd_Argc() > 1 && !Q_stricmp( Cmd_Argv( 1 ), "reset" ) ) {
+		Com_Memset( &deltaStats, 0, sizeof( deltaStats ) );
+	}
+}
+
+
 /*
 =============
 SV_EmitPacketEntities
@@ -51,11 +265,14 @@ SV_EmitPacketEntities
 Writes a delta update of an entityState_t list to the message.
 =============
 */
-static void SV_EmitPacketEntities( const clientSnapshot_t *from, const clientSnapshot_t *to, msg_t *msg ) {
+static void SV_EmitPacketEntities( const clientSnapshot_t *from, const clientSnapshot_t *to, msg_t *msg, clientStats_t *stats ) {
 	entityState_t	*oldent, *newent;
 	int		oldindex, newindex;
 	int		oldnum, newnum;
 	int		from_num_entities;
+	int		startBit;
+
+	startBit = msg->bit;
 
 	// generate the delta update
 	if ( !from ) {
@@ -72,14 +289,14 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, const clientSna
 		if ( newindex >= to->num_entities ) {
 			newnum = MAX_GENTITIES+1;
 		} else {
-			newent = to->ents[ newindex ];
+			newent = SV_SnapshotEntity( to, newindex );
 			newnum = newent->number;
 		}
 
 		if ( oldindex >= from_num_entities ) {
 			oldnum = MAX_GENTITIES+1;
 		} else {
-			oldent = from->ents[ oldindex ];
+			oldent = SV_SnapshotEntity( from, oldindex );
 			oldnum = oldent->number;
 		}
 
@@ -87,7 +304,7 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, const clientSna
 			// delta update from old position
 			// because the force parm is qfalse, this will not result
 			// in any bytes being emitted if the entity has not changed at all
-			MSG_WriteDeltaEntity (msg, oldent, newent, qfalse );
+			SV_WriteDeltaEntityCached( msg, oldent, newent, qfalse );
 			oldindex++;
 			newindex++;
 			continue;
@@ -95,7 +312,8 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, const clientSna
 
 		if ( newnum < oldnum ) {
 			// this is a new entity, send it from the baseline
-			MSG_WriteDeltaEntity (msg, &sv.svEntities[newnum].baseline, newent, qtrue );
+			SV_WriteDeltaEntityCached( msg, &sv.svEntities[newnum].baseline, newent, qtrue );
+			stats->newEntities++;
 			newindex++;
 			continue;
 		}
@@ -108,7 +326,10 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, const clientSna
 		}
 	}
 
-	MSG_WriteBits( msg, (MAX_GENTITIES-1), GENTITYNUM_BITS );	// end of packetentities
+	MSG_WriteEntitynum( msg, MAX_GENTITIES-1 );	// end of packetentities
+
+	stats->entities += to->num_entities;
+	stats->entityBits += msg->bit - startBit;
 }
 
 /*
@@ -116,7 +337,7 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, const clientSna
 SV_WriteSnapshotToClient
 ==================
 */
-static void SV_WriteSnapshotToClient( const client_t *client, msg_t *msg ) {
+static void SV_WriteSnapshotToClient( client_t *client, msg_t *msg ) {
 	const clientSnapshot_t	*oldframe;
 	const clientSnapshot_t	*frame;
 	int					lastframe;
@@ -145,7 +366,7 @@ static void SV_WriteSnapshotToClient( const client_t *client, msg_t *msg ) {
 		oldframe = &client->frames[ client->deltaMessage & PACKET_MASK ];
 		lastframe = client->netchan.outgoingSequence - client->deltaMessage;
 		// we may refer on outdated frame
-		if ( oldframe->frameNum - svs.lastValidFrame < 0 ) {
+		if ( !SV_ClientFrameValid( oldframe ) ) {
 			Com_DPrintf( "%s: Delta request from out of date frame.\n", client->name );
 			oldframe = NULL;
 			lastframe = 0;
@@ -185,19 +406,20 @@ static void SV_WriteSnapshotToClient( const client_t *client, msg_t *msg ) {
 		MSG_WriteByte( msg, 0 ); // # of changes
 		MSG_WriteBits( msg, 0, 1 ); // no array changes
 		// packet entities
-		MSG_WriteBits( msg, (MAX_GENTITIES-1), GENTITYNUM_BITS );
+		MSG_WriteEntitynum( msg, MAX_GENTITIES-1 );
 		return;
 	}
 
 	// delta encode the playerstate
 	if ( oldframe ) {
 		MSG_WriteDeltaPlayerstate( msg, &oldframe->ps, &frame->ps );
+		client->stats.deltaSnapshots++;
 	} else {
 		MSG_WriteDeltaPlayerstate( msg, NULL, &frame->ps );
 	}
 
 	// delta encode the entities
-	SV_EmitPacketEntities (oldframe, frame, msg);
+	SV_EmitPacketEntities (oldframe, frame, msg, &client->stats);
 
 	// padding for rate debugging
 	if ( sv_padPackets->integer ) {
@@ -224,7 +446,7 @@ void SV_UpdateServerCommandsToClient( client_t *client, msg_t *msg ) {
 		const int index = client->reliableAcknowledge + 1 + i;
 		MSG_WriteByte( msg, svc_serverCommand );
 		MSG_WriteLong( msg, index );
-		MSG_WriteString( msg, client->reliableCommands[ index & (MAX_RELIABLE_COMMANDS-1) ] );
+		MSG_WriteString( msg, SV_ReliableCommand( client, index ) );
 	}
 }
 
@@ -291,6 +513,91 @@ static void SV_AddIndexToSnapshot( svEntity_t *svEnt, int index, snapshotEntityN
 	eNums->numSnapshotEntities++;
 }
 
+
+/*
+=============================================================================
+
+CLUSTER MASKS
+
+Every entity of the common snapshot gets a 128-cluster window of its PVS
+clusters, so per-client visibility becomes a single 16-byte AND against the
+client PVS row instead of a bit test for each stored cluster.
+
+=============================================================================
+*/
+
+#define CLUSTER_MASK_BYTES	16
+
+typedef struct {
+	int		offset;		// first PVS byte of the window, -1 = test clusters one by one
+	byte	mask[ CLUSTER_MASK_BYTES ];
+} clusterMask_t;
+
+// indexed like svs.currFrame entities
+static clusterMask_t	*snapClusterMasks;
+
+
+/*
+===============
+SV_BuildClusterMask
+===============
+*/
+static void SV_BuildClusterMask( clusterMask_t *cmask, const svEntity_t *svEnt, int rowBytes ) {
+	int i, c, b, lo, offset;
+
+	cmask->offset = -1;
+
+	// overflow clusters keep their original scan semantics
+	if ( !svEnt->numClusters || svEnt->lastCluster || rowBytes < CLUSTER_MASK_BYTES ) {
+		return;
+	}
+
+	lo = svEnt->clusternums[0];
+	for ( i = 1 ; i < svEnt->numClusters ; i++ ) {
+		if ( svEnt->clusternums[i] < lo ) {
+			lo = svEnt->clusternums[i];
+		}
+	}
+
+	// keep the window inside of the PVS row
+	offset = lo >> 3;
+	if ( offset > rowBytes - CLUSTER_MASK_BYTES ) {
+		offset = rowBytes - CLUSTER_MASK_BYTES;
+	}
+
+	Com_Memset( cmask->mask, 0, sizeof( cmask->mask ) );
+	for ( i = 0 ; i < svEnt->numClusters ; i++ ) {
+		c = svEnt->clusternums[i];
+		b = ( c >> 3 ) - offset;
+		if ( b >= CLUSTER_MASK_BYTES ) {
+			return; // too sparse, use scalar path
+		}
+		cmask->mask[b] |= 1 << ( c & 7 );
+	}
+
+	cmask->offset = offset;
+}
+
+
+/*
+===============
+SV_ClusterMaskVisible
+===============
+*/
+static ID_INLINE qboolean SV_ClusterMaskVisible( const byte *pvs, const byte *mask ) {
+#if idx64
+	const __m128i v = _mm_and_si128( _mm_loadu_si128( (const __m128i *) pvs ), _mm_loadu_si128( (const __m128i *) mask ) );
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( v, _mm_setzero_si128() ) ) != 0xFFFF ? qtrue : qfalse;
+#elif arm64
+	return vmaxvq_u8( vandq_u8( vld1q_u8( pvs ), vld1q_u8( mask ) ) ) ? qtrue : qfalse;
+#else
+	uint64_t p[2], m[2];
+	Com_Memcpy( p, pvs, sizeof( p ) );
+	Com_Memcpy( m, mask, sizeof( m ) );
+	return ( ( p[0] & m[0] ) | ( p[1] & m[1] ) ) ? qtrue : qfalse;
+#endif
+}
+
 qboolean IsEntityVisibleType(sharedEntity_t *ent) {
     if (sv_ace_wallhack->integer == 1 || sv_ace_wallhack->integer == 2) {
         // Только для игроков
@@ -302,6 +609,150 @@ qboolean IsEntityVisibleType(sharedEntity_t *ent) {
     return qfalse; // Если значение sv_ace_wallhack не соответствует ожидаемому, возвращаем false
 }
 
+/*
+=============================================================================
+
+SNAPSHOT GRID
+
+Entities of the common snapshot are bucketed into a uniform 2D grid over
+the world bounds, so view distance culling only has to look at entities
+from the cells within the client's view distance. Broadcast entities and
+movers ignore view distance and are always candidates.
+
+=============================================================================
+*/
+
+#define SNAP_GRID_DIM		64
+#define SNAP_GRID_MIN_CELL	512
+#define SNAP_GRID_LEVELS	4	// deeper nested portal views allocate per call
+
+static struct {
+	float		mins[2];
+	float		cellSize;
+	int			dim[2];
+	int			cellStart[ SNAP_GRID_DIM * SNAP_GRID_DIM + 1 ];
+	int			*cellEnts;		// common snapshot indexes
+	int			*cellOf;
+	uint32_t	*always;
+	int			words;			// of always and candidates
+	int			depth;			// of portal views being added
+	uint32_t	*candidates[ SNAP_GRID_LEVELS ];	// allocated on first use
+} snapGrid;
+
+
+/*
+===============
+SV_BuildSnapshotGrid
+===============
+*/
+static void SV_BuildSnapshotGrid( sharedEntity_t **list, int count ) {
+	int		*cellOf = snapGrid.cellOf;
+	vec3_t	mins, maxs;
+	float	size;
+	int		i, x, y, c, numCells;
+
+	CM_ModelBounds( CM_InlineModel( 0 ), mins, maxs );
+
+	size = maxs[0] - mins[0];
+	if ( maxs[1] - mins[1] > size ) {
+		size = maxs[1] - mins[1];
+	}
+	size /= SNAP_GRID_DIM;
+	if ( size < SNAP_GRID_MIN_CELL ) {
+		size = SNAP_GRID_MIN_CELL;
+	}
+
+	snapGrid.mins[0] = mins[0];
+	snapGrid.mins[1] = mins[1];
+	snapGrid.cellSize = size;
+	for ( i = 0; i < 2; i++ ) {
+		snapGrid.dim[i] = (int)( ( maxs[i] - mins[i] ) / size ) + 1;
+		if ( snapGrid.dim[i] > SNAP_GRID_DIM ) {
+			snapGrid.dim[i] = SNAP_GRID_DIM;
+		}
+	}
+	numCells = snapGrid.dim[0] * snapGrid.dim[1];
+
+	Com_Memset( snapGrid.cellStart, 0, ( numCells + 1 ) * sizeof( snapGrid.cellStart[0] ) );
+	Com_Memset( snapGrid.always, 0, ( ( count + 31 ) >> 5 ) * sizeof( snapGrid.always[0] ) );
+
+	// count entities per cell
+	for ( i = 0; i < count; i++ ) {
+		if ( list[i]->r.svFlags & SVF_BROADCAST || list[i]->s.eType == ET_MOVER ) {
+			snapGrid.always[ i >> 5 ] |= 1U << ( i & 31 );
+			cellOf[i] = -1;
+			continue;
+		}
+		x = (int)( ( list[i]->r.currentOrigin[0] - snapGrid.mins[0] ) / size );
+		y = (int)( ( list[i]->r.currentOrigin[1] - snapGrid.mins[1] ) / size );
+		x = x < 0 ? 0 : ( x >= snapGrid.dim[0] ? snapGrid.dim[0] - 1 : x );
+		y = y < 0 ? 0 : ( y >= snapGrid.dim[1] ? snapGrid.dim[1] - 1 : y );
+		c = y * snapGrid.dim[0] + x;
+		cellOf[i] = c;
+		snapGrid.cellStart[ c + 1 ]++;
+	}
+
+	for ( c = 0; c < numCells; c++ ) {
+		snapGrid.cellStart[ c + 1 ] += snapGrid.cellStart[ c ];
+	}
+
+	// fill cells, cellStart[c] temporarily points past the written entries
+	for ( i = 0; i < count; i++ ) {
+		if ( cellOf[i] >= 0 ) {
+			snapGrid.cellEnts[ snapGrid.cellStart[ cellOf[i] ]++ ] = i;
+		}
+	}
+
+	for ( c = numCells; c > 0; c-- ) {
+		snapGrid.cellStart[ c ] = snapGrid.cellStart[ c - 1 ];
+	}
+	snapGrid.cellStart[ 0 ] = 0;
+}
+
+
+/*
+===============
+SV_GridCandidates
+
+Marks common snapshot indexes which may be within radius of origin
+===============
+*/
+static void SV_GridCandidates( const vec3_t origin, float radius, uint32_t *bits ) {
+	int		x0, x1, y0, y1, x, y, c, i, e;
+	const int words = ( svs.currFrame->count + 31 ) >> 5;
+
+	x0 = (int)floor( ( origin[0] - radius - snapGrid.mins[0] ) / snapGrid.cellSize );
+	x1 = (int)floor( ( origin[0] + radius - snapGrid.mins[0] ) / snapGrid.cellSize );
+	y0 = (int)floor( ( origin[1] - radius - snapGrid.mins[1] ) / snapGrid.cellSize );
+	y1 = (int)floor( ( origin[1] + radius - snapGrid.mins[1] ) / snapGrid.cellSize );
+
+	// entities outside the grid are binned into the edge cells, so a view
+	// origin outside it must still scan the nearest edge
+	x0 = x0 < 0 ? 0 : ( x0 >= snapGrid.dim[0] ? snapGrid.dim[0] - 1 : x0 );
+	x1 = x1 < 0 ? 0 : ( x1 >= snapGrid.dim[0] ? snapGrid.dim[0] - 1 : x1 );
+	y0 = y0 < 0 ? 0 : ( y0 >= snapGrid.dim[1] ? snapGrid.dim[1] - 1 : y0 );
+	y1 = y1 < 0 ? 0 : ( y1 >= snapGrid.dim[1] ? snapGrid.dim[1] - 1 : y1 );
+
+	// view distance covers whole world
+	if ( x0 == 0 && y0 == 0 && x1 == snapGrid.dim[0] - 1 && y1 == snapGrid.dim[1] - 1 ) {
+		Com_Memset( bits, 0xFF, words * sizeof( bits[0] ) );
+		return;
+	}
+
+	Com_Memcpy( bits, snapGrid.always, words * sizeof( bits[0] ) );
+
+	for ( y = y0; y <= y1; y++ ) {
+		for ( x = x0; x <= x1; x++ ) {
+			c = y * snapGrid.dim[0] + x;
+			for ( i = snapGrid.cellStart[ c ]; i < snapGrid.cellStart[ c + 1 ]; i++ ) {
+				e = snapGrid.cellEnts[ i ];
+				bits[ e >> 5 ] |= 1U << ( e & 31 );
+			}
+		}
+	}
+}
+
+
 /*
 ===============
 SV_AddEntitiesVisibleFromPoint
@@ -312,6 +763,7 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin, clientSnapshot_
 	sharedEntity_t *ent;
 	svEntity_t	*svEnt;
 	entityState_t  *es;
+	const clusterMask_t *cmask;
 	int		l;
 	int		clientarea, clientcluster;
 	int		leafnum;
@@ -320,9 +772,21 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin, clientSnapshot_
 	vec3_t dir;
 	float distanceSquared;
 	float maxViewDistanceSquared;
+	uint32_t *candidates;
 
 	if ( sv.state == SS_DEAD ) return;
 
+	// portal views are added while the outer candidates are still walked
+	if ( snapGrid.depth < SNAP_GRID_LEVELS ) {
+		if ( !snapGrid.candidates[ snapGrid.depth ] ) {
+			snapGrid.candidates[ snapGrid.depth ] = Z_Malloc( snapGrid.words * sizeof( uint32_t ) );
+		}
+		candidates = snapGrid.candidates[ snapGrid.depth ];
+	} else {
+		candidates = Z_Malloc( snapGrid.words * sizeof( uint32_t ) );
+	}
+	snapGrid.depth++;
+
     // 1. Q3 PVS stage
 	leafnum = CM_PointLeafnum (origin);
 	clientarea = CM_LeafArea (leafnum);
@@ -332,8 +796,17 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin, clientSnapshot_
 	frame->areabytes = CM_WriteAreaBits( frame->areabits, clientarea );
 	clientpvs = CM_ClusterPVS (clientcluster);
 
+	// entities that can pass the draw distance stage
+	SV_GridCandidates( origin, viewDistance * SNAPSHOT_RECOVER_STEP, candidates );
+
 	for ( e = 0 ; e < svs.currFrame->count; e++ ) {
-		es = svs.currFrame->ents[ e ];
+		if ( !candidates[ e >> 5 ] ) {
+			e |= 31; // skip whole word
+			continue;
+		}
+		if ( !( candidates[ e >> 5 ] & ( 1U << ( e & 31 ) ) ) ) continue;
+
+		es = SV_CommonEntity( svs.currFrame, e );
 		ent = SV_GentityNum( es->number );
 
 		// ent for send everyone except one client
@@ -359,26 +832,31 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin, clientSnapshot_
 
 		// check individual leafs
 		if ( !svEnt->numClusters ) continue;
-		l = 0;
-		for ( i=0 ; i < svEnt->numClusters ; i++ ) {
-			l = svEnt->clusternums[i];
-			if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
-				break;
+		cmask = &snapClusterMasks[ e ];
+		if ( cmask->offset >= 0 ) {
+			if ( !SV_ClusterMaskVisible( bitvector + cmask->offset, cmask->mask ) ) continue;
+		} else {
+			l = 0;
+			for ( i=0 ; i < svEnt->numClusters ; i++ ) {
+				l = svEnt->clusternums[i];
+				if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
+					break;
+				}
 			}
-		}
 
-		// if we haven't found it to be visible,
-		// check overflow clusters that couldn't be stored
-		if ( i == svEnt->numClusters ) {
-			if ( svEnt->lastCluster ) {
-				for ( ; l <= svEnt->lastCluster ; l++ ) {
-					if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
-						break;
+			// if we haven't found it to be visible,
+			// check overflow clusters that couldn't be stored
+			if ( i == svEnt->numClusters ) {
+				if ( svEnt->lastCluster ) {
+					for ( ; l <= svEnt->lastCluster ; l++ ) {
+						if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
+							break;
+						}
 					}
+					if ( l == svEnt->lastCluster ) continue;	// not visible
+				} else {
+					continue;
 				}
-				if ( l == svEnt->lastCluster ) continue;	// not visible
-			} else {
-				continue;
 			}
 		}
 
@@ -451,6 +929,11 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin, clientSnapshot_
 		}
 	}
 
+	snapGrid.depth--;
+	if ( snapGrid.depth >= SNAP_GRID_LEVELS ) {
+		Z_Free( candidates );
+	}
+
 	ent = SV_GentityNum( frame->ps.clientNum );
 	// extension: merge second PVS at ent->r.s.origin2
 	if ( ent->r.svFlags & SVF_SELF_PORTAL2 && !portal ) {
@@ -460,6 +943,207 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin, clientSnapshot_
 }
 
 
+static entityState_t *grownSnapshotEntities;	// zone storage that replaced the hunk one
+static int		*grownSnapshotIndexes;
+static unsigned int	baseSnapshotIndexes;		// hunk ring size before growing
+
+// per entity scratch of the grid, cluster masks and budgeting,
+// indexed by entity number or common snapshot index
+static const entityState_t	**budgetPrevEnts;
+static int		numSnapshotArrays;
+
+#define MIN_SNAPSHOT_ARRAYS		256
+
+#define MAX_SNAPSHOT_INDEXES	( 1 << 24 )
+
+
+/*
+===============
+SV_FreeSnapshotArrays
+===============
+*/
+static void SV_FreeSnapshotArrays( void )
+{
+	int i;
+
+	if ( !numSnapshotArrays ) {
+		return;
+	}
+
+	Z_Free( snapClusterMasks );
+	Z_Free( snapGrid.cellEnts );
+	Z_Free( snapGrid.cellOf );
+	Z_Free( snapGrid.always );
+	Z_Free( (void *)budgetPrevEnts );
+
+	for ( i = 0; i < SNAP_GRID_LEVELS; i++ ) {
+		if ( snapGrid.candidates[ i ] ) {
+			Z_Free( snapGrid.candidates[ i ] );
+			snapGrid.candidates[ i ] = NULL;
+		}
+	}
+
+	snapClusterMasks = NULL;
+	snapGrid.cellEnts = snapGrid.cellOf = NULL;
+	snapGrid.always = NULL;
+	snapGrid.words = 0;
+	budgetPrevEnts = NULL;
+	numSnapshotArrays = 0;
+}
+
+
+/*
+===============
+SV_FreeSnapshotStorage
+
+Returns to the hunk allocated base storage size
+===============
+*/
+void SV_FreeSnapshotStorage( void )
+{
+	if ( grownSnapshotEntities ) {
+		Z_Free( grownSnapshotEntities );
+		grownSnapshotEntities = NULL;
+		svs.snapshotEntities = NULL;
+		svs.numSnapshotEntities = PACKET_BACKUP * SNAPSHOT_BASE_ENTITIES;
+	}
+	if ( grownSnapshotIndexes ) {
+		Z_Free( grownSnapshotIndexes );
+		grownSnapshotIndexes = NULL;
+		svs.snapshotIndexes = NULL;
+		svs.numSnapshotIndexes = baseSnapshotIndexes;
+	}
+	SV_FreeSnapshotArrays();
+}
+
+
+/*
+===============
+SV_ReserveSnapshotArrays
+
+Sizes per entity scratch arrays for count entities, they start
+small at map load and follow sv.num_entities as the level grows
+===============
+*/
+static void SV_ReserveSnapshotArrays( int count )
+{
+	int size, words;
+
+	if ( count <= numSnapshotArrays ) {
+		return;
+	}
+
+	size = numSnapshotArrays ? numSnapshotArrays : MIN_SNAPSHOT_ARRAYS;
+	while ( size < count ) {
+		size <<= 1;
+	}
+	if ( size > MAX_GENTITIES ) {
+		size = MAX_GENTITIES;
+	}
+
+	SV_FreeSnapshotArrays();
+
+	words = size >> 5;
+	snapClusterMasks = Z_Malloc( size * sizeof( snapClusterMasks[0] ) );
+	snapGrid.cellEnts = Z_Malloc( size * sizeof( snapGrid.cellEnts[0] ) );
+	snapGrid.cellOf = Z_Malloc( size * sizeof( snapGrid.cellOf[0] ) );
+	snapGrid.always = Z_Malloc( words * sizeof( snapGrid.always[0] ) );
+	snapGrid.words = words;
+	budgetPrevEnts = Z_Malloc( size * sizeof( budgetPrevEnts[0] ) );
+	numSnapshotArrays = size;
+}
+
+
+/*
+===============
+SV_GrowSnapshotStorage
+
+Keeps PACKET_BACKUP frames of count entities in storage,
+all previously built frames become invalid for delta compression
+===============
+*/
+static void SV_GrowSnapshotStorage( int count )
+{
+	int perFrame;
+
+	perFrame = svs.numSnapshotEntities / PACKET_BACKUP;
+	if ( count <= perFrame || perFrame >= MAX_GENTITIES ) {
+		return;
+	}
+
+	while ( perFrame < count ) {
+		perFrame <<= 1;
+	}
+	if ( perFrame > MAX_GENTITIES ) {
+		perFrame = MAX_GENTITIES;
+	}
+
+	Com_DPrintf( "Growing snapshot storage to %i entities per frame\n", perFrame );
+
+	if ( grownSnapshotEntities ) {
+		Z_Free( grownSnapshotEntities );
+	}
+	grownSnapshotEntities = Z_Malloc( PACKET_BACKUP * perFrame * sizeof( entityState_t ) );
+
+	svs.snapshotEntities = grownSnapshotEntities;
+	svs.numSnapshotEntities = PACKET_BACKUP * perFrame;
+
+	Com_Memset( svs.snapFrames, 0, sizeof( svs.snapFrames ) );
+	svs.freeStorageEntities = svs.numSnapshotEntities;
+	svs.currentStoragePosition = 0;
+	svs.lastValidFrame = svs.snapshotFrame;
+
+	SV_ClearDeltaCache();
+}
+
+
+/*
+===============
+SV_ReserveSnapshotIndexes
+
+The initial index ring size is only an estimate of the entities per
+client frame, grow it when a new frame would overwrite the oldest one
+the client can still delta from.  Live ranges keep their positions.
+===============
+*/
+static void SV_ReserveSnapshotIndexes( const client_t *client, int count )
+{
+	const clientSnapshot_t *oldest;
+	unsigned int size, i;
+	int *indexes;
+
+	oldest = &client->frames[ ( client->netchan.outgoingSequence - ( PACKET_BACKUP - 1 ) ) & PACKET_MASK ];
+	if ( !SV_ClientFrameValid( oldest ) ) {
+		return;
+	}
+
+	size = svs.numSnapshotIndexes;
+	while ( svs.nextSnapshotIndex + count - oldest->first_entity > size && size < MAX_SNAPSHOT_INDEXES ) {
+		size <<= 1;
+	}
+	if ( size == svs.numSnapshotIndexes ) {
+		return;
+	}
+
+	Com_DPrintf( "Growing snapshot index ring to %i\n", size );
+
+	indexes = Z_Malloc( size * sizeof( int ) );
+	for ( i = svs.nextSnapshotIndex - svs.numSnapshotIndexes; i != svs.nextSnapshotIndex; i++ ) {
+		indexes[ i & ( size - 1 ) ] = svs.snapshotIndexes[ i & ( svs.numSnapshotIndexes - 1 ) ];
+	}
+
+	if ( grownSnapshotIndexes ) {
+		Z_Free( grownSnapshotIndexes );
+	} else {
+		baseSnapshotIndexes = svs.numSnapshotIndexes;
+	}
+	grownSnapshotIndexes = indexes;
+
+	svs.snapshotIndexes = indexes;
+	svs.numSnapshotIndexes = size;
+}
+
+
 /*
 ===============
 SV_InitSnapshotStorage
@@ -477,6 +1161,12 @@ void SV_InitSnapshotStorage( void )
 	svs.lastValidFrame = 0;
 
 	svs.currFrame = NULL;
+
+	svs.nextSnapshotIndex = 0;
+
+	SV_ReserveSnapshotArrays( sv.num_entities );
+
+	SV_ClearDeltaCache();
 }
 
 
@@ -506,7 +1196,7 @@ This always allocates new common snapshot frame
 */
 static void SV_BuildCommonSnapshot( void ) 
 {
-	sharedEntity_t	*list[ MAX_GENTITIES ];
+	static sharedEntity_t	*list[ MAX_GENTITIES ];
 	sharedEntity_t	*ent;
 	
 	snapshotFrame_t	*tmp;
@@ -515,6 +1205,7 @@ static void SV_BuildCommonSnapshot( void )
 	int count;
 	int index;
 	int	num;
+	int rowBytes;
 	int i;
 
 	count = 0;
@@ -546,6 +1237,9 @@ static void SV_BuildCommonSnapshot( void )
 
 	sv.snapshotCounter = -1;
 
+	SV_GrowSnapshotStorage( count );
+	SV_ReserveSnapshotArrays( sv.num_entities );
+
 	sf = &svs.snapFrames[ svs.snapshotFrame % NUM_SNAPSHOT_FRAMES ];
 	
 	// track last valid frame
@@ -580,17 +1274,418 @@ static void SV_BuildCommonSnapshot( void )
 	sf->frameNum = svs.snapshotFrame;
 	svs.snapshotFrame++;
 
+	if ( sv.state != SS_DEAD ) {
+		SV_BuildSnapshotGrid( list, count );
+	}
+
 	svs.currFrame = sf; // clients can refer to this
 
+	rowBytes = ( CM_NumClusters() + 7 ) >> 3;
+
 	// setup start index
 	index = sf->start;
 	for ( i = 0 ; i < count ; i++, index = (index+1) % svs.numSnapshotEntities ) {
 		//index %= svs.numSnapshotEntities;
 		svs.snapshotEntities[ index ] = list[ i ]->s;
-		sf->ents[ i ] = &svs.snapshotEntities[ index ];
+		SV_BuildClusterMask( &snapClusterMasks[ i ], &sv.svEntities[ list[ i ]->s.number ], rowBytes );
+	}
+}
+
+
+/*
+===============
+SV_CommonSnapshot
+
+Returns the number of entities in the current common snapshot,
+building it if no client has asked for it this frame
+===============
+*/
+int SV_CommonSnapshot( void ) {
+	if ( svs.currFrame == NULL ) {
+		SV_BuildCommonSnapshot();
 	}
+	return svs.currFrame->count;
 }
 
+
+/*
+===============
+SV_CommonSnapshotEntity
+===============
+*/
+const entityState_t *SV_CommonSnapshotEntity( int index ) {
+	return SV_CommonEntity( svs.currFrame, index );
+}
+
+/*
+=============================================================================
+
+SNAPSHOT BUDGET
+
+With sv_snapshotBudget enabled, rate limited clients get snapshots filled
+up to rate * snapshotMsec bytes. Entities compete by an accumulated
+priority (type, distance, velocity and the number of snapshots they were
+left out of). Entities the client already has are deferred by keeping
+the state it last received, so nothing is emitted for them; new entities
+simply appear later. Temp entities and changed events are always sent.
+
+=============================================================================
+*/
+
+#define SNAPSHOT_OVERHEAD		128		// playerstate, commands, headers
+#define SNAPSHOT_MIN_BUDGET		256
+#define ENTITY_COST_DELTA		16
+#define ENTITY_COST_NEW			48
+#define ENTITY_PRIORITY_FORCED	1e30f	// changed entity that can't be deferred
+
+// a deferred state is carried from frame to frame, keep it within the
+// PACKET_BACKUP messages a client can delta against
+#define MAX_DEFER_FRAMES		PACKET_BACKUP
+
+typedef struct {
+	int		index;		// in client frame
+	int		cost;
+	float	priority;
+} budgetEntity_t;
+
+static budgetEntity_t		budgetEnts[ MAX_SNAPSHOT_ENTITIES ];
+
+
+/*
+===============
+SV_EntityPriority
+===============
+*/
+static float SV_EntityPriority( const entityState_t *es, const vec3_t origin ) {
+	const sharedEntity_t *ent = SV_GentityNum( es->number );
+	float weight;
+
+	if ( es->eType >= ET_EVENTS ) {
+		weight = 8.0f; // temporary events are useless when late
+	} else switch ( es->eType ) {
+		case ET_PLAYER:
+		case ET_GRAPPLE:
+			weight = 4.0f; break;
+		case ET_MISSILE:
+			weight = 3.0f; break;
+		case ET_MOVER:
+			weight = 2.0f; break;
+		default:
+			weight = 1.0f; break;
+	}
+
+	weight *= 1.0f + VectorLength( es->pos.trDelta ) * ( 1.0f / 320.0f );
+
+	return weight * 1024.0f / ( 1024.0f + Distance( ent->r.currentOrigin, origin ) );
+}
+
+
+/*
+===============
+SV_FreeEntityPriority
+===============
+*/
+void SV_FreeEntityPriority( client_t *client ) {
+	if ( client->entityPriority ) {
+		Z_Free( client->entityPriority );
+		client->entityPriority = NULL;
+	}
+	client->numEntityPriority = 0;
+}
+
+
+/*
+===============
+SV_GrowEntityPriority
+
+Accumulated priorities cover entity numbers below sv.num_entities
+===============
+*/
+static void SV_GrowEntityPriority( client_t *client ) {
+	float *priority;
+	int count;
+
+	if ( client->numEntityPriority >= sv.num_entities ) {
+		return;
+	}
+
+	count = ( sv.num_entities + 255 ) & ~255;
+	if ( count > MAX_GENTITIES ) {
+		count = MAX_GENTITIES;
+	}
+
+	priority = Z_Malloc( count * sizeof( priority[0] ) ); // zero-filled
+	if ( client->entityPriority ) {
+		Com_Memcpy( priority, client->entityPriority, client->numEntityPriority * sizeof( priority[0] ) );
+		Z_Free( client->entityPriority );
+	}
+
+	client->entityPriority = priority;
+	client->numEntityPriority = count;
+}
+
+
+/*
+===============
+SV_SortBudgetEntities
+===============
+*/
+static int QDECL SV_SortBudgetEntities( const void *a, const void *b ) {
+	const budgetEntity_t *ea = (const budgetEntity_t *)a;
+	const budgetEntity_t *eb = (const budgetEntity_t *)b;
+
+	if ( ea->priority > eb->priority )
+		return -1;
+	if ( ea->priority < eb->priority )
+		return 1;
+	return ea->index - eb->index;
+}
+
+
+/*
+===============
+SV_BudgetClientSnapshot
+
+Trims client frame entities to the byte budget of the client
+===============
+*/
+static void SV_BudgetClientSnapshot( client_t *client, clientSnapshot_t *frame, const vec3_t origin, float scale ) {
+	const clientSnapshot_t *prev;
+	const entityState_t *old;
+	entityState_t *es;
+	qboolean defer, deferred;
+	int budget, total;
+	int i, n, count;
+
+	SV_GrowEntityPriority( client );
+
+	budget = (int)( client->rate * client->snapshotMsec * scale ) / 1000 - SNAPSHOT_OVERHEAD;
+	if ( budget < SNAPSHOT_MIN_BUDGET ) {
+		budget = SNAPSHOT_MIN_BUDGET;
+	}
+
+	// previous frame should be still valid in snapshot storage
+	prev = &client->frames[ ( client->netchan.outgoingSequence - 1 ) & PACKET_MASK ];
+	if ( client->state != CS_ACTIVE || !SV_ClientFrameValid( prev ) ) {
+		prev = NULL;
+	} else {
+		for ( i = 0; i < prev->num_entities; i++ ) {
+			old = SV_SnapshotEntity( prev, i );
+			budgetPrevEnts[ old->number ] = old;
+		}
+	}
+
+	defer = ( prev && svs.currFrame->frameNum - prev->frameNum < MAX_DEFER_FRAMES );
+
+	count = 0;
+	total = 0;
+	for ( i = 0; i < frame->num_entities; i++ ) {
+		es = SV_SnapshotEntity( frame, i );
+		old = budgetPrevEnts[ es->number ];
+		if ( old && memcmp( old, es, sizeof( *es ) ) == 0 ) {
+			client->entityPriority[ es->number ] = 0.0f;
+			continue; // nothing to send
+		}
+		client->entityPriority[ es->number ] += SV_EntityPriority( es, origin );
+		budgetEnts[ count ].index = i;
+		budgetEnts[ count ].cost = old ? ENTITY_COST_DELTA : ENTITY_COST_NEW;
+		budgetEnts[ count ].priority = client->entityPriority[ es->number ];
+		if ( old && !defer ) {
+			budgetEnts[ count ].priority = ENTITY_PRIORITY_FORCED;
+		}
+		// temp entities are freed before the next snapshot and a deferred
+		// delta would lose the event, so events always go out
+		if ( es->eType >= ET_EVENTS || es->event != ( old ? old->event : 0 )
+			|| ( old && es->eventParm != old->eventParm ) ) {
+			budgetEnts[ count ].priority = ENTITY_PRIORITY_FORCED;
+		}
+		total += budgetEnts[ count ].cost;
+		count++;
+	}
+
+	if ( total > budget ) {
+		qsort( budgetEnts, count, sizeof( budgetEnts[0] ), SV_SortBudgetEntities );
+		deferred = qfalse;
+		for ( i = 0; i < count; i++ ) {
+			es = SV_SnapshotEntity( frame, budgetEnts[ i ].index );
+			if ( budgetEnts[ i ].cost <= budget || budgetEnts[ i ].priority == ENTITY_PRIORITY_FORCED ) {
+				budget -= budgetEnts[ i ].cost;
+				client->entityPriority[ es->number ] = 0.0f;
+			} else if ( ( old = budgetPrevEnts[ es->number ] ) != NULL ) {
+				// keep the state the client already has
+				FRAME_SLOT( frame, budgetEnts[ i ].index ) = old - svs.snapshotEntities;
+				deferred = qtrue;
+			} else {
+				FRAME_SLOT( frame, budgetEnts[ i ].index ) = -1;
+			}
+		}
+
+		// remove entities that were not sent
+		for ( i = 0, n = 0; i < frame->num_entities; i++ ) {
+			if ( FRAME_SLOT( frame, i ) >= 0 ) {
+				FRAME_SLOT( frame, n++ ) = FRAME_SLOT( frame, i );
+			}
+		}
+		frame->num_entities = n;
+
+		// deferred states come from previous frame so it
+		// must be taken into account for delta validation
+		if ( deferred && prev->frameNum - frame->frameNum < 0 ) {
+			frame->frameNum = prev->frameNum;
+		}
+	} else {
+		for ( i = 0; i < count; i++ ) {
+			client->entityPriority[ SV_SnapshotEntity( frame, budgetEnts[ i ].index )->number ] = 0.0f;
+		}
+	}
+
+	if ( prev ) {
+		for ( i = 0; i < prev->num_entities; i++ ) {
+			budgetPrevEnts[ SV_SnapshotEntity( prev, i )->number ] = NULL;
+		}
+	}
+}
+
+
+/*
+=============================================================================
+
+SNAPSHOT TIERS
+
+With sv_snapshotTiers, entities the client already has are refreshed less
+often the farther they are, relative to the client view distance: every
+snapshot in the near quarter, every second one up to half of it and every
+sv_snapshotTiers'th beyond, at most MAX_SNAPSHOT_TIERS. Players and
+missiles are one tier closer. Skipped entities keep the state the client
+last received, like budget deferrals, so they cost nothing. New entities,
+temp entities, changed events, movers and broadcast entities are never
+delayed, so nothing pops in late.
+
+=============================================================================
+*/
+
+#define TIER_NEAR_FRACTION	0.25f
+#define TIER_MID_FRACTION	0.5f
+#define MAX_SNAPSHOT_TIERS	4	// longer intervals would make far entities stutter
+
+
+/*
+===============
+SV_EntityTierInterval
+===============
+*/
+static int SV_EntityTierInterval( const entityState_t *es, const entityState_t *old, const vec3_t origin, float radius ) {
+	const sharedEntity_t *ent = SV_GentityNum( es->number );
+	vec3_t	dir;
+	float	dist2;
+	int		tier, tiers;
+
+	if ( es->eType >= ET_EVENTS || es->eType == ET_MOVER || ent->r.svFlags & SVF_BROADCAST ) {
+		return 1;
+	}
+
+	// a delayed event would be played late or lost
+	if ( es->event != old->event || es->eventParm != old->eventParm ) {
+		return 1;
+	}
+
+	tiers = sv_snapshotTiers->integer;
+	if ( tiers > MAX_SNAPSHOT_TIERS ) {
+		tiers = MAX_SNAPSHOT_TIERS;
+	}
+
+	VectorSubtract( ent->r.currentOrigin, origin, dir );
+	dist2 = VectorLengthSquared( dir );
+
+	if ( dist2 < Square( radius * TIER_NEAR_FRACTION ) ) {
+		tier = 0;
+	} else if ( dist2 < Square( radius * TIER_MID_FRACTION ) ) {
+		tier = 1;
+	} else {
+		tier = 2;
+	}
+
+	if ( es->eType == ET_PLAYER || es->eType == ET_MISSILE || es->eType == ET_GRAPPLE ) {
+		tier--;
+	}
+
+	if ( tier <= 0 ) {
+		return 1;
+	}
+	if ( tier == 1 ) {
+		return 2 < tiers ? 2 : tiers;
+	}
+	return tiers;
+}
+
+
+/*
+===============
+SV_TierClientSnapshot
+
+Keeps previous states of entities which are not due in this snapshot
+===============
+*/
+static void SV_TierClientSnapshot( client_t *client, clientSnapshot_t *frame, const vec3_t origin, int viewDistance ) {
+	const clientSnapshot_t *prev;
+	const entityState_t *old;
+	const entityState_t *es;
+	qboolean deferred;
+	float radius;
+	int i, interval;
+
+	// previous frame should be still valid in snapshot storage
+	prev = &client->frames[ ( client->netchan.outgoingSequence - 1 ) & PACKET_MASK ];
+	if ( client->state != CS_ACTIVE || !SV_ClientFrameValid( prev ) ) {
+		return;
+	}
+
+	// deferred states are carried over, see SV_BudgetClientSnapshot
+	if ( svs.currFrame->frameNum - prev->frameNum >= MAX_DEFER_FRAMES ) {
+		return;
+	}
+
+	for ( i = 0; i < prev->num_entities; i++ ) {
+		old = SV_SnapshotEntity( prev, i );
+		budgetPrevEnts[ old->number ] = old;
+	}
+
+	radius = viewDistance * SNAPSHOT_RECOVER_STEP;
+	deferred = qfalse;
+
+	for ( i = 0; i < frame->num_entities; i++ ) {
+		es = SV_SnapshotEntity( frame, i );
+		old = budgetPrevEnts[ es->number ];
+		if ( !old ) {
+			continue; // new entities are never delayed
+		}
+		interval = SV_EntityTierInterval( es, old, origin, radius );
+		if ( interval <= 1 ) {
+			continue;
+		}
+		// spread entities of a tier over its snapshots
+		if ( ( client->netchan.outgoingSequence + es->number ) % interval == 0 ) {
+			continue;
+		}
+		if ( memcmp( old, es, sizeof( *es ) ) == 0 ) {
+			continue; // nothing to send anyway
+		}
+		FRAME_SLOT( frame, i ) = old - svs.snapshotEntities;
+		deferred = qtrue;
+	}
+
+	// deferred states come from previous frame so it
+	// must be taken into account for delta validation
+	if ( deferred && prev->frameNum - frame->frameNum < 0 ) {
+		frame->frameNum = prev->frameNum;
+	}
+
+	for ( i = 0; i < prev->num_entities; i++ ) {
+		budgetPrevEnts[ SV_SnapshotEntity( prev, i )->number ] = NULL;
+	}
+}
+
+
 /*
 =============
 SV_BuildClientSnapshot
@@ -612,6 +1707,9 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 	svEntity_t					*svEnt;
 	int							clientNum;
 	playerState_t				*ps;
+	qboolean					budget;
+	float						budgetScale;
+	int							viewDistance;
 
 	// this is the frame we are creating
 	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
@@ -624,6 +1722,7 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 	// https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=62
 	frame->num_entities = 0;
 	frame->frameNum = svs.currentSnapshotFrame;
+	frame->first_entity = svs.nextSnapshotIndex;
 	
 	if ( client->state == CS_ZOMBIE )
 		return;
@@ -669,15 +1768,27 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 	// add all the entities directly visible to the eye, which
 	// may include portal entities that merge other viewpoints
 	entityNumbers.unordered = qfalse;
+	budget = ( sv_snapshotBudget->integer && client->rate );
+	budgetScale = 1.0f;
+	viewDistance = client->viewDistance;
 	if(client->netError){
-		SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers, qfalse, client->dynamicViewDistance );
+		if ( budget ) {
+			// shrink byte budget instead of view distance
+			budgetScale = (float)client->dynamicViewDistance / client->viewDistance;
+			if ( budgetScale < 0.25f ) {
+				budgetScale = 0.25f;
+			}
+		} else {
+			viewDistance = client->dynamicViewDistance;
+		}
+		SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers, qfalse, viewDistance );
 		client->dynamicViewDistance++;
 		if(client->dynamicViewDistance >= client->viewDistance){
 			client->netError = qfalse;
 			client->dynamicViewDistance = 0;
 		}
 	} else {
-		SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers, qfalse, client->viewDistance );
+		SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers, qfalse, viewDistance );
 	}
 
 	// if there were portals visible, there may be out of order entities
@@ -695,11 +1806,23 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 		((int *)frame->areabits)[i] = ((int *)frame->areabits)[i] ^ -1;
 	}
 
+	SV_ReserveSnapshotIndexes( client, entityNumbers.numSnapshotEntities );
+
 	frame->num_entities = entityNumbers.numSnapshotEntities;
-	// get pointers from common snapshot
+	// get indexes from common snapshot
 	for ( i = 0 ; i < entityNumbers.numSnapshotEntities ; i++ )	{
-		frame->ents[ i ] = svs.currFrame->ents[ entityNumbers.snapshotEntities[ i ] ];
+		FRAME_SLOT( frame, i ) = ( svs.currFrame->start + entityNumbers.snapshotEntities[ i ] ) % svs.numSnapshotEntities;
+	}
+
+	if ( sv_snapshotTiers->integer > 1 ) {
+		SV_TierClientSnapshot( client, frame, org, viewDistance );
 	}
+
+	if ( budget ) {
+		SV_BudgetClientSnapshot( client, frame, org, budgetScale );
+	}
+
+	svs.nextSnapshotIndex += frame->num_entities;
 }
 
 /*
@@ -710,10 +1833,18 @@ Called by SV_SendClientSnapshot and SV_SendClientGameState
 =======================
 */
 void SV_SendMessageToClient( msg_t *msg, client_t *client ) {
+	clientSnapshot_t *frame;
+
 	// record information about the message
-	client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageSize = msg->cursize;
-	client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageSent = svs.msgTime;
-	client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageAcked = 0;
+	frame = &client->frames[client->netchan.outgoingSequence & PACKET_MASK];
+	if ( frame->messageAcked ) {
+		// reused slot leaves the ping window
+		client->pingTotal -= frame->messageAcked - frame->messageSent;
+		client->pingCount--;
+	}
+	frame->messageSize = msg->cursize;
+	frame->messageSent = svs.msgTime;
+	frame->messageAcked = 0;
 
 	// send the datagram
 	SV_Netchan_Transmit( client, msg );
@@ -760,6 +1891,13 @@ void SV_SendClientSnapshot( client_t *client ) {
 		MSG_Clear( &msg );
 	}
 
+	SV_ReplaySnapshot( msg.cursize );
+
+	client->stats.snapshots++;
+	client->stats.snapshotBytes += msg.cursize;
+	client->stats.maxSnapshotBytes = MAX( client->stats.maxSnapshotBytes, msg.cursize );
+	client->stats.maxBacklog = MAX( client->stats.maxBacklog, client->reliableSequence - client->reliableAcknowledge );
+
 	SV_SendMessageToClient( &msg, client );
 }
 
@@ -790,12 +1928,14 @@ void SV_SendClientMessages( void ) {
 		if ( c->netchan.unsentFragments || c->netchan_start_queue )
 		{
 			c->rateDelayed = qtrue;
+			c->stats.rateDelayed++;
 			continue;		// Drop this snapshot if the packet queue is still full or delta compression will break
 		}
 
 		if ( SV_RateMsec( c ) > 0 ) {
 			// Not enough time since last packet passed through the line
 			c->rateDelayed = qtrue;
+			c->stats.rateDelayed++;
 			continue;
 		}
 
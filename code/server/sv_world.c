@@ -54,6 +54,8 @@ the world is carved up with an evenly spaced, axially aligned bsp tree.  Entitie
 are kept in chains either at the final leafs, or at the first node that splits
 them, which prevents having to deal with multiple fragments of a single entity.
 
+With sv_areaGrid the tree is replaced by a loose hashed grid, see AREA GRID.
+
 ===============================================================================
 */
 
@@ -64,11 +66,18 @@ typedef struct worldSector_s {
 	svEntity_t	*entities;
 } worldSector_t;
 
-#define	AREA_DEPTH	4
-#define	AREA_NODES	64
+// one more level each time the linked entity count doubles,
+// so leaves keep about the same number of entities
+#define	AREA_MIN_DEPTH		4
+#define	AREA_MAX_DEPTH		( GENTITYNUM_BITS - 6 )
+#define	AREA_LEAF_ENTITIES	64
+#define	AREA_NODES			( 4 << AREA_MAX_DEPTH )
 
 static worldSector_t	sv_worldSectors[AREA_NODES];
 static int			sv_numworldSectors;
+static int			sv_worldDepth;
+static int			sv_worldLinked;
+static vec3_t		sv_worldMins, sv_worldMaxs;
 
 /*
 ===============
@@ -85,7 +94,7 @@ static worldSector_t *SV_CreateworldSector( int depth, vec3_t mins, vec3_t maxs
 	anode = &sv_worldSectors[sv_numworldSectors];
 	sv_numworldSectors++;
 
-	if (depth == AREA_DEPTH) {
+	if (depth == sv_worldDepth) {
 		anode->axis = -1;
 		anode->children[0] = anode->children[1] = NULL;
 		return anode;
@@ -112,6 +121,309 @@ static worldSector_t *SV_CreateworldSector( int depth, vec3_t mins, vec3_t maxs
 	return anode;
 }
 
+
+/*
+===============================================================================
+
+AREA GRID
+
+Entities are kept in a hierarchy of loose grids over the x/y plane. An entity
+goes to the finest level whose cells are not smaller than its box and to the
+cell holding its center, so it may overhang that cell by half a cell on every
+side. Cells are hashed into a fixed bucket table. The finest cell size follows
+the number of linked entities per world area, and the grid is rebuilt when
+that count changes a lot, so dense levels get small cells and large entities
+don't pile up on a few top nodes like in the sector tree.
+
+===============================================================================
+*/
+
+#define	GRID_LEVELS			8
+#define	GRID_BUCKETS		4096		// must be power of two
+#define	GRID_HUGE			GRID_BUCKETS	// bucket for entities larger than top level cells
+#define	GRID_DENSITY		4.0f		// entities per finest cell if spread evenly
+#define	GRID_MIN_CELL		64.0f
+#define	GRID_MAX_CELL		1024.0f
+#define	GRID_MIN_REBUILD	64			// don't adapt the cell size below this many entities
+#define	GRID_COORD_LIMIT	1048576.0f
+
+typedef struct {
+	qboolean	active;
+	float		area;					// of the world bounds on x/y
+	float		cellSize[ GRID_LEVELS ];
+	float		invCellSize[ GRID_LEVELS ];
+	int			levelCount[ GRID_LEVELS + 1 ];
+	int			linked;
+	int			builtFor;				// linked count the cell size was chosen for
+	unsigned int	query;
+	svEntity_t	*buckets[ GRID_BUCKETS + 1 ];
+} areaGrid_t;
+
+typedef struct {
+	unsigned int	queries;
+	unsigned int	rebuilds;
+	uint64_t		candidates;			// entities touched by queries
+	uint64_t		listed;				// entities returned by queries
+	int				maxCandidates;
+} areaStats_t;
+
+static areaGrid_t	areaGrid;
+static areaStats_t	areaStats;
+
+
+/*
+===============
+SV_GridCell
+===============
+*/
+static int SV_GridCell( float v, int level ) {
+	if ( v < -GRID_COORD_LIMIT ) {
+		v = -GRID_COORD_LIMIT;
+	} else if ( v > GRID_COORD_LIMIT ) {
+		v = GRID_COORD_LIMIT;
+	}
+	return (int)floorf( v * areaGrid.invCellSize[ level ] );
+}
+
+
+/*
+===============
+SV_GridBucket
+===============
+*/
+static int SV_GridBucket( int level, int x, int y ) {
+	unsigned int h;
+
+	h = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)level * 83492791u;
+
+	return ( h ^ ( h >> 13 ) ) & ( GRID_BUCKETS - 1 );
+}
+
+
+/*
+===============
+SV_GridInsert
+===============
+*/
+static void SV_GridInsert( svEntity_t *ent, const sharedEntity_t *gEnt ) {
+	float extent;
+	int level, bucket;
+
+	extent = gEnt->r.absmax[0] - gEnt->r.absmin[0];
+	if ( extent < gEnt->r.absmax[1] - gEnt->r.absmin[1] ) {
+		extent = gEnt->r.absmax[1] - gEnt->r.absmin[1];
+	}
+
+	for ( level = 0; level < GRID_LEVELS; level++ ) {
+		if ( extent <= areaGrid.cellSize[ level ] ) {
+			break;
+		}
+	}
+
+	if ( level == GRID_LEVELS ) {
+		bucket = GRID_HUGE;
+	} else {
+		bucket = SV_GridBucket( level,
+			SV_GridCell( 0.5f * ( gEnt->r.absmin[0] + gEnt->r.absmax[0] ), level ),
+			SV_GridCell( 0.5f * ( gEnt->r.absmin[1] + gEnt->r.absmax[1] ), level ) );
+	}
+
+	ent->gridLevel = level;
+	ent->nextEntityInGrid = areaGrid.buckets[ bucket ];
+	if ( ent->nextEntityInGrid ) {
+		ent->nextEntityInGrid->prevEntityInGrid = &ent->nextEntityInGrid;
+	}
+	ent->prevEntityInGrid = &areaGrid.buckets[ bucket ];
+	areaGrid.buckets[ bucket ] = ent;
+
+	areaGrid.levelCount[ level ]++;
+	areaGrid.linked++;
+}
+
+
+/*
+===============
+SV_GridRemove
+===============
+*/
+static void SV_GridRemove( svEntity_t *ent ) {
+	*ent->prevEntityInGrid = ent->nextEntityInGrid;
+	if ( ent->nextEntityInGrid ) {
+		ent->nextEntityInGrid->prevEntityInGrid = ent->prevEntityInGrid;
+	}
+	ent->nextEntityInGrid = NULL;
+	ent->prevEntityInGrid = NULL;
+
+	areaGrid.levelCount[ ent->gridLevel ]--;
+	areaGrid.linked--;
+}
+
+
+/*
+===============
+SV_GridSetCellSize
+===============
+*/
+static void SV_GridSetCellSize( int linked ) {
+	float size;
+	int i;
+
+	if ( linked < GRID_MIN_REBUILD ) {
+		size = GRID_MAX_CELL;
+	} else {
+		size = sqrtf( areaGrid.area * GRID_DENSITY / linked );
+		if ( size < GRID_MIN_CELL ) {
+			size = GRID_MIN_CELL;
+		} else if ( size > GRID_MAX_CELL ) {
+			size = GRID_MAX_CELL;
+		}
+	}
+
+	for ( i = 0; i < GRID_LEVELS; i++, size *= 2.0f ) {
+		areaGrid.cellSize[ i ] = size;
+		areaGrid.invCellSize[ i ] = 1.0f / size;
+	}
+
+	areaGrid.builtFor = linked;
+}
+
+
+/*
+===============
+SV_GridRebuild
+
+Rehashes all linked entities for the current entity count
+===============
+*/
+static void SV_GridRebuild( void ) {
+	svEntity_t *ent;
+	int i;
+
+	SV_GridSetCellSize( areaGrid.linked );
+
+	Com_Memset( areaGrid.buckets, 0, sizeof( areaGrid.buckets ) );
+	Com_Memset( areaGrid.levelCount, 0, sizeof( areaGrid.levelCount ) );
+	areaGrid.linked = 0;
+
+	for ( i = 0, ent = sv.svEntities; i < sv.num_entities; i++, ent++ ) {
+		if ( ent->prevEntityInGrid ) {
+			SV_GridInsert( ent, SV_GEntityForSvEntity( ent ) );
+		}
+	}
+
+	areaStats.rebuilds++;
+}
+
+
+/*
+===============
+SV_GridLink
+===============
+*/
+static void SV_GridLink( svEntity_t *ent, const sharedEntity_t *gEnt ) {
+	SV_GridInsert( ent, gEnt );
+
+	if ( areaGrid.linked >= GRID_MIN_REBUILD ) {
+		if ( areaGrid.linked >= areaGrid.builtFor * 2 || areaGrid.linked * 4 <= areaGrid.builtFor ) {
+			SV_GridRebuild();
+		}
+	}
+}
+
+
+/*
+===============
+SV_ClearGrid
+===============
+*/
+static void SV_ClearGrid( const vec3_t mins, const vec3_t maxs ) {
+	Com_Memset( &areaGrid, 0, sizeof( areaGrid ) );
+
+	areaGrid.active = sv_areaGrid->integer ? qtrue : qfalse;
+	areaGrid.area = ( maxs[0] - mins[0] ) * ( maxs[1] - mins[1] );
+	if ( areaGrid.area < GRID_MIN_CELL * GRID_MIN_CELL ) {
+		areaGrid.area = GRID_MIN_CELL * GRID_MIN_CELL;
+	}
+
+	SV_GridSetCellSize( 0 );
+}
+
+
+/*
+===============
+SV_WorldDepth
+
+Tree depth for the given number of linked entities
+===============
+*/
+static int SV_WorldDepth( int linked ) {
+	int depth;
+
+	depth = AREA_MIN_DEPTH;
+	while ( depth < AREA_MAX_DEPTH && linked > ( AREA_LEAF_ENTITIES << depth ) ) {
+		depth++;
+	}
+
+	return depth;
+}
+
+
+/*
+===============
+SV_SectorLink
+
+Links to the first world sector node that the ent's box crosses
+===============
+*/
+static void SV_SectorLink( svEntity_t *ent, const sharedEntity_t *gEnt ) {
+	worldSector_t	*node;
+
+	node = sv_worldSectors;
+	while (1)
+	{
+		if (node->axis == -1)
+			break;
+		if ( gEnt->r.absmin[node->axis] > node->dist)
+			node = node->children[0];
+		else if ( gEnt->r.absmax[node->axis] < node->dist)
+			node = node->children[1];
+		else
+			break;		// crosses the node
+	}
+
+	ent->worldSector = node;
+	ent->nextEntityInWorldSector = node->entities;
+	node->entities = ent;
+}
+
+
+/*
+===============
+SV_RebuildWorldSectors
+
+Subdivides the tree for the current linked entity count and relinks
+===============
+*/
+static void SV_RebuildWorldSectors( void ) {
+	svEntity_t *ent;
+	int i;
+
+	sv_worldDepth = SV_WorldDepth( sv_worldLinked );
+
+	Com_Memset( sv_worldSectors, 0, sizeof(sv_worldSectors) );
+	sv_numworldSectors = 0;
+	SV_CreateworldSector( 0, sv_worldMins, sv_worldMaxs );
+
+	for ( i = 0, ent = sv.svEntities; i < sv.num_entities; i++, ent++ ) {
+		if ( ent->worldSector ) {
+			SV_SectorLink( ent, SV_GEntityForSvEntity( ent ) );
+		}
+	}
+
+	areaStats.rebuilds++;
+}
+
+
 /*
 ===============
 SV_ClearWorld
@@ -124,11 +436,17 @@ void SV_ClearWorld( void ) {
 
 	Com_Memset( sv_worldSectors, 0, sizeof(sv_worldSectors) );
 	sv_numworldSectors = 0;
+	sv_worldDepth = AREA_MIN_DEPTH;
+	sv_worldLinked = 0;
 
 	// get world map bounds
 	h = CM_InlineModel( 0 );
 	CM_ModelBounds( h, mins, maxs );
+	VectorCopy( mins, sv_worldMins );
+	VectorCopy( maxs, sv_worldMaxs );
 	SV_CreateworldSector( 0, mins, maxs );
+
+	SV_ClearGrid( mins, maxs );
 }
 
 
@@ -147,11 +465,17 @@ void SV_UnlinkEntity( sharedEntity_t *gEnt ) {
 
 	gEnt->r.linked = qfalse;
 
+	if ( ent->prevEntityInGrid ) {
+		SV_GridRemove( ent );
+		return;
+	}
+
 	ws = ent->worldSector;
 	if ( !ws ) {
 		return;		// not linked in anywhere
 	}
 	ent->worldSector = NULL;
+	sv_worldLinked--;
 
 	if ( ws->entities == ent ) {
 		ws->entities = ent->nextEntityInWorldSector;
@@ -177,7 +501,6 @@ SV_LinkEntity
 */
 #define MAX_TOTAL_ENT_LEAFS		128
 void SV_LinkEntity( sharedEntity_t *gEnt ) {
-	worldSector_t	*node;
 	int			leafs[MAX_TOTAL_ENT_LEAFS];
 	int			cluster;
 	int			num_leafs;
@@ -189,7 +512,7 @@ void SV_LinkEntity( sharedEntity_t *gEnt ) {
 
 	ent = SV_SvEntityForGentity( gEnt );
 
-	if ( ent->worldSector ) {
+	if ( ent->worldSector || ent->prevEntityInGrid ) {
 		SV_UnlinkEntity( gEnt );	// unlink from old position
 	}
 
@@ -306,24 +629,19 @@ void SV_LinkEntity( sharedEntity_t *gEnt ) {
 
 	gEnt->r.linkcount++;
 
-	// find the first world sector node that the ent's box crosses
-	node = sv_worldSectors;
-	while (1)
-	{
-		if (node->axis == -1)
-			break;
-		if ( gEnt->r.absmin[node->axis] > node->dist)
-			node = node->children[0];
-		else if ( gEnt->r.absmax[node->axis] < node->dist)
-			node = node->children[1];
-		else
-			break;		// crosses the node
+	if ( areaGrid.active ) {
+		SV_GridLink( ent, gEnt );
+		gEnt->r.linked = qtrue;
+		return;
+	}
+
+	SV_SectorLink( ent, gEnt );
+	sv_worldLinked++;
+
+	// keep a margin both ways so the tree isn't rebuilt back and forth
+	if ( SV_WorldDepth( sv_worldLinked ) > sv_worldDepth || SV_WorldDepth( sv_worldLinked * 2 ) < sv_worldDepth ) {
+		SV_RebuildWorldSectors();
 	}
-	
-	// link it in
-	ent->worldSector = node;
-	ent->nextEntityInWorldSector = node->entities;
-	node->entities = ent;
 
 	gEnt->r.linked = qtrue;
 }
@@ -343,6 +661,7 @@ typedef struct {
 	const float	*maxs;
 	int			*list;
 	int			count, maxcount;
+	int			candidates;
 } areaParms_t;
 
 
@@ -360,6 +679,7 @@ static void SV_AreaEntities_r( worldSector_t *node, areaParms_t *ap ) {
 		next = check->nextEntityInWorldSector;
 
 		gcheck = SV_GEntityForSvEntity( check );
+		ap->candidates++;
 
 		if ( gcheck->r.absmin[0] > ap->maxs[0]
 		|| gcheck->r.absmin[1] > ap->maxs[1]
@@ -392,6 +712,129 @@ static void SV_AreaEntities_r( worldSector_t *node, areaParms_t *ap ) {
 	}
 }
 
+/*
+====================
+SV_GridBucketEntities
+
+====================
+*/
+static qboolean SV_GridBucketEntities( svEntity_t *check, areaParms_t *ap ) {
+	const sharedEntity_t *gcheck;
+
+	for ( ; check ; check = check->nextEntityInGrid ) {
+		if ( check->areaQuery == areaGrid.query ) {
+			continue;	// bucket shared by several cells
+		}
+		check->areaQuery = areaGrid.query;
+
+		gcheck = SV_GEntityForSvEntity( check );
+		ap->candidates++;
+
+		if ( gcheck->r.absmin[0] > ap->maxs[0]
+		|| gcheck->r.absmin[1] > ap->maxs[1]
+		|| gcheck->r.absmin[2] > ap->maxs[2]
+		|| gcheck->r.absmax[0] < ap->mins[0]
+		|| gcheck->r.absmax[1] < ap->mins[1]
+		|| gcheck->r.absmax[2] < ap->mins[2]) {
+			continue;
+		}
+
+		if ( ap->count == ap->maxcount ) {
+			Com_Printf ("SV_AreaEntities: MAXCOUNT\n");
+			return qfalse;
+		}
+
+		ap->list[ap->count] = check - sv.svEntities;
+		ap->count++;
+	}
+
+	return qtrue;
+}
+
+
+/*
+====================
+SV_GridAreaEntities
+
+Visits every cell whose loose bounds may touch the box, falls back
+to all buckets when that would be more cells than buckets
+====================
+*/
+static void SV_GridAreaEntities( areaParms_t *ap ) {
+	int level, x, y, x0, y0, x1, y1;
+	float half, cells;
+
+	areaGrid.query++;
+
+	if ( !SV_GridBucketEntities( areaGrid.buckets[ GRID_HUGE ], ap ) ) {
+		return;
+	}
+
+	for ( level = 0; level < GRID_LEVELS; level++ ) {
+		if ( !areaGrid.levelCount[ level ] ) {
+			continue;
+		}
+
+		// entity centers within half a cell (plus rounding) of the box
+		half = areaGrid.cellSize[ level ] * 0.5f + 1.0f;
+
+		cells = ( ( ap->maxs[0] - ap->mins[0] + 2.0f * half ) * areaGrid.invCellSize[ level ] + 2.0f )
+			* ( ( ap->maxs[1] - ap->mins[1] + 2.0f * half ) * areaGrid.invCellSize[ level ] + 2.0f );
+		if ( cells >= GRID_BUCKETS ) {
+			for ( x = 0; x < GRID_BUCKETS; x++ ) {
+				if ( !SV_GridBucketEntities( areaGrid.buckets[ x ], ap ) ) {
+					return;
+				}
+			}
+			return;
+		}
+
+		x0 = SV_GridCell( ap->mins[0] - half, level );
+		x1 = SV_GridCell( ap->maxs[0] + half, level );
+		y0 = SV_GridCell( ap->mins[1] - half, level );
+		y1 = SV_GridCell( ap->maxs[1] + half, level );
+
+		for ( x = x0; x <= x1; x++ ) {
+			for ( y = y0; y <= y1; y++ ) {
+				if ( !SV_GridBucketEntities( areaGrid.buckets[ SV_GridBucket( level, x, y ) ], ap ) ) {
+					return;
+				}
+			}
+		}
+	}
+}
+
+
+/*
+====================
+SV_SortAreaList
+
+Grid buckets have no meaningful order, so list entities by number
+to keep trace tie breaks independent from hashing
+====================
+*/
+static int QDECL SV_CompareEntityNums( const void *a, const void *b ) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static void SV_SortAreaList( int *list, int count ) {
+	int i, j, n;
+
+	if ( count > 32 ) {
+		qsort( list, count, sizeof( list[0] ), SV_CompareEntityNums );
+		return;
+	}
+
+	for ( i = 1; i < count; i++ ) {
+		n = list[ i ];
+		for ( j = i; j > 0 && list[ j - 1 ] > n; j-- ) {
+			list[ j ] = list[ j - 1 ];
+		}
+		list[ j ] = n;
+	}
+}
+
+
 /*
 ================
 SV_AreaEntities
@@ -405,13 +848,62 @@ int SV_AreaEntities( const vec3_t mins, const vec3_t maxs, int *entityList, int
 	ap.list = entityList;
 	ap.count = 0;
 	ap.maxcount = maxcount;
+	ap.candidates = 0;
+
+	if ( areaGrid.active ) {
+		SV_GridAreaEntities( &ap );
+		SV_SortAreaList( ap.list, ap.count );
+	} else {
+		SV_AreaEntities_r( sv_worldSectors, &ap );
+	}
 
-	SV_AreaEntities_r( sv_worldSectors, &ap );
+	areaStats.queries++;
+	areaStats.candidates += ap.candidates;
+	areaStats.listed += ap.count;
+	if ( ap.candidates > areaStats.maxCandidates ) {
+		areaStats.maxCandidates = ap.candidates;
+	}
 
 	return ap.count;
 }
 
 
+/*
+================
+SV_AreaStats_f
+================
+*/
+void SV_AreaStats_f( void ) {
+	int i;
+
+	if ( areaGrid.active ) {
+		Com_Printf( "area grid: %i entities, %i rebuilds, finest cell %.0f\n",
+			areaGrid.linked, areaStats.rebuilds, areaGrid.cellSize[0] );
+		for ( i = 0; i < GRID_LEVELS; i++ ) {
+			if ( areaGrid.levelCount[ i ] ) {
+				Com_Printf( "  level %i: cell %6.0f, %i entities\n", i, areaGrid.cellSize[ i ], areaGrid.levelCount[ i ] );
+			}
+		}
+		if ( areaGrid.levelCount[ GRID_LEVELS ] ) {
+			Com_Printf( "  huge: %i entities\n", areaGrid.levelCount[ GRID_LEVELS ] );
+		}
+	} else {
+		Com_Printf( "area tree: %i entities, depth %i, %i nodes, %i rebuilds\n",
+			sv_worldLinked, sv_worldDepth, sv_numworldSectors, areaStats.rebuilds );
+	}
+
+	Com_Printf( "%u queries, %.1f candidates and %.1f listed per query, %i candidates max\n",
+		areaStats.queries,
+		areaStats.queries ? (double)areaStats.candidates / areaStats.queries : 0.0,
+		areaStats.queries ? (double)areaStats.listed / areaStats.queries : 0.0,
+		areaStats.maxCandidates );
+
+	if ( Cmd_Argc() > 1 && !Q_stricmp( Cmd_Argv( 1 ), "reset" ) ) {
+		Com_Memset( &areaStats, 0, sizeof( areaStats ) );
+	}
+}
+
+
 
 //===========================================================================
 